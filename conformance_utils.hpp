@@ -23,6 +23,8 @@
 #pragma once
 
 #include <random>
+#include <vector>
+#include <algorithm>
 #include "logging.hpp"
 #include "context.hpp"
 #include "device.hpp"
@@ -34,6 +36,13 @@
 #include "android.hpp"
 #endif
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #define LOG_FAILURE() LOGE("Failed at %s:%d.\n", __FILE__, __LINE__)
 
 namespace RDP
@@ -95,6 +104,11 @@ void Interface::update_screen(const void *data, unsigned width, unsigned height,
 	}
 	widths[current_context] = width;
 	heights[current_context] = height;
+
+	// Pipelined scanout delivers its last frames after eof(), those frames were already counted.
+	if (is_eof)
+		return;
+
 	frame_count_for_context[current_context]++;
 	draw_calls_for_context[current_context] = 0;
 	syncs_for_context[current_context] = 0;
@@ -139,6 +153,8 @@ struct ReplayerState
 	inline bool init();
 	inline bool init(Vulkan::Device *device);
 	inline bool init(DumpPlayer &dump);
+	inline bool reset(DumpPlayer &dump);
+	inline bool reset_gpu(const RendererLimits &limits);
 	Vulkan::Context context;
 	std::unique_ptr<Vulkan::Device> owned_device;
 	Vulkan::Device *device = nullptr;
@@ -200,73 +216,169 @@ bool ReplayerState::init(DumpPlayer &dump)
 	if (!init_common())
 		return false;
 
+	// Dumps are validated through memory only, so scanout readback does not have to be synchronous.
 	reference = create_replayer_driver_angrylion(dump, iface);
-	gpu = create_replayer_driver_parallel(*device, dump, iface);
+	gpu = create_replayer_driver_parallel(*device, dump, iface, false, true);
 	combined = create_side_by_side_driver(reference.get(), gpu.get(), iface);
 	dump.set_command_interface(combined.get());
 	return true;
 }
 
-static inline bool compare_memory(const char *tag, const uint8_t *reference_, const uint8_t *gpu_, size_t size,
-                                  uint32_t *fault_addr)
+bool ReplayerState::reset(DumpPlayer &dump)
 {
-	if (!memcmp(reference_, gpu_, size))
-	{
-		auto *reference = reinterpret_cast<const uint32_t *>(reference_);
-		size /= sizeof(uint32_t);
+	// Recreates replayers in their initial state on the existing device.
+	// The reference renderer is a singleton, so the old replayers must go first.
+	combined.reset();
+	gpu.reset();
+	reference.reset();
+	iface = Interface();
 
-		bool nonzero = false;
-		for (size_t i = 0; i < size; i++)
-		{
-			if (reference[i] != 0)
-			{
-				nonzero = true;
-				break;
-			}
-		}
-		if (!nonzero)
-			LOGW("RDRAM is completely zero, might not be a valuable test.\n");
-		return true;
+	reference = create_replayer_driver_angrylion(dump, iface);
+	gpu = create_replayer_driver_parallel(*device, dump, iface, false, true);
+	if (!reference || !gpu)
+		return false;
+	combined = create_side_by_side_driver(reference.get(), gpu.get(), iface);
+	dump.set_command_interface(combined.get());
+	return true;
+}
+
+bool ReplayerState::reset_gpu(const RendererLimits &limits)
+{
+	// Recreates the GPU replayer with new limits, keeping the reference replayer and the builder.
+	combined.reset();
+	gpu.reset();
+
+	gpu = create_replayer_driver_parallel(*device, builder, iface, false, false, limits);
+	if (!gpu)
+		return false;
+	combined = create_side_by_side_driver(reference.get(), gpu.get(), iface);
+	builder.set_command_interface(combined.get());
+	return true;
+}
+
+// Returns offset of the first differing byte, or size if memory is equal.
+// nonzero is set if any byte of reference before that offset is nonzero.
+static inline size_t find_memory_difference(const uint8_t *reference, const uint8_t *gpu, size_t size, bool &nonzero)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	__m256i any = _mm256_setzero_si256();
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(reference + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(gpu + i));
+		if (unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b))) != 0xffffffffu)
+			break;
+		any = _mm256_or_si256(any, a);
 	}
-	else
+	if (!_mm256_testz_si256(any, any))
+		nonzero = true;
+#elif defined(__SSE2__)
+	__m128i any = _mm_setzero_si128();
+	for (; i + 16 <= size; i += 16)
 	{
-		auto *reference = reference_;
-		auto *reference16 = reinterpret_cast<const uint16_t *>(reference_);
-		auto *reference32 = reinterpret_cast<const uint32_t *>(reference_);
-		auto *gpu = gpu_;
-		auto *gpu16 = reinterpret_cast<const uint16_t *>(gpu_);
-		auto *gpu32 = reinterpret_cast<const uint32_t *>(gpu_);
-
-		bool nonzero = false;
-		for (size_t i = 0; i < size; i++)
-		{
-			if (reference[i ^ 3] != gpu[i ^ 3])
-			{
-				LOGE("  8-bit coord: (%d, %d)\n", int(i % 320), int(i / 320));
-				LOGE("Memory delta found at byte %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i, tag, reference[i ^ 3],
-				     gpu[i ^ 3]);
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reference + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(gpu + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+			break;
+		any = _mm_or_si128(any, a);
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+		nonzero = true;
+#elif defined(__ARM_NEON)
+	uint8x16_t any = vdupq_n_u8(0);
+	for (; i + 16 <= size; i += 16)
+	{
+		uint8x16_t a = vld1q_u8(reference + i);
+		uint8x16_t b = vld1q_u8(gpu + i);
+		uint64x2_t diff = vreinterpretq_u64_u8(veorq_u8(a, b));
+		if ((vgetq_lane_u64(diff, 0) | vgetq_lane_u64(diff, 1)) != 0)
+			break;
+		any = vorrq_u8(any, a);
+	}
+	uint64x2_t any64 = vreinterpretq_u64_u8(any);
+	if ((vgetq_lane_u64(any64, 0) | vgetq_lane_u64(any64, 1)) != 0)
+		nonzero = true;
+#else
+	uint64_t any = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t a, b;
+		memcpy(&a, reference + i, sizeof(a));
+		memcpy(&b, gpu + i, sizeof(b));
+		if (a != b)
+			break;
+		any |= a;
+	}
+	if (any)
+		nonzero = true;
+#endif
 
-				LOGE("  16-bit coord: (%d, %d)\n", int((i >> 1) % 320), int((i >> 1) / 320));
-				LOGE("Memory delta found at word %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i >> 1, tag, reference16[(i >> 1) ^ 1],
-				     gpu16[(i >> 1) ^ 1]);
+	for (; i < size; i++)
+	{
+		if (reference[i] != gpu[i])
+			return i;
+		if (reference[i] != 0)
+			nonzero = true;
+	}
 
-				LOGE("  32-bit coord: (%d, %d)\n", int((i >> 2) % 320), int((i >> 2) / 320));
-				LOGE("Memory delta found at dword %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i >> 2, tag, reference32[i >> 2],
-				     gpu32[i >> 2]);
+	return size;
+}
 
-				if (fault_addr)
-					*fault_addr = i;
-				return false;
-			}
+static inline void report_memory_difference(const char *tag, const uint8_t *reference, const uint8_t *gpu, size_t i)
+{
+	auto *reference16 = reinterpret_cast<const uint16_t *>(reference);
+	auto *reference32 = reinterpret_cast<const uint32_t *>(reference);
+	auto *gpu16 = reinterpret_cast<const uint16_t *>(gpu);
+	auto *gpu32 = reinterpret_cast<const uint32_t *>(gpu);
+
+	LOGE("  8-bit coord: (%d, %d)\n", int(i % 320), int(i / 320));
+	LOGE("Memory delta found at byte %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i, tag, reference[i ^ 3],
+	     gpu[i ^ 3]);
+
+	LOGE("  16-bit coord: (%d, %d)\n", int((i >> 1) % 320), int((i >> 1) / 320));
+	LOGE("Memory delta found at word %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i >> 1, tag, reference16[(i >> 1) ^ 1],
+	     gpu16[(i >> 1) ^ 1]);
+
+	LOGE("  32-bit coord: (%d, %d)\n", int((i >> 2) % 320), int((i >> 2) / 320));
+	LOGE("Memory delta found at dword %zu for %s, (ref) 0x%02x != (gpu) 0x%02x!\n", i >> 2, tag, reference32[i >> 2],
+	     gpu32[i >> 2]);
+}
 
-			if (reference[i ^ 3] != 0)
-				nonzero = true;
+// Finds the first differing byte in N64 byte order, starting the search at a word aligned offset.
+static inline bool find_byte_difference(const uint8_t *reference, const uint8_t *gpu, size_t begin, size_t size,
+                                        size_t &fault)
+{
+	for (size_t i = begin & ~size_t(3); i < size; i++)
+	{
+		if (reference[i ^ 3] != gpu[i ^ 3])
+		{
+			fault = i;
+			return true;
 		}
+	}
+	return false;
+}
+
+static inline bool compare_memory(const char *tag, const uint8_t *reference, const uint8_t *gpu, size_t size,
+                                  uint32_t *fault_addr)
+{
+	bool nonzero = false;
+	size_t diff = find_memory_difference(reference, gpu, size, nonzero);
 
-		if (!nonzero)
-			LOGW("RDRAM is completely zero, might not be a valuable test.\n");
+	size_t i;
+	if (diff < size && find_byte_difference(reference, gpu, diff, size, i))
+	{
+		report_memory_difference(tag, reference, gpu, i);
+		if (fault_addr)
+			*fault_addr = i;
+		return false;
 	}
 
+	if (!nonzero)
+		LOGW("RDRAM is completely zero, might not be a valuable test.\n");
+
 	return true;
 }
 
@@ -294,6 +406,138 @@ static inline bool compare_rdram(ReplayerDriver &reference, ReplayerDriver &gpu,
 	return true;
 }
 
+// Per-page hashes of reference and GPU memory. When the caller knows which pages were written since the last
+// comparison, only those pages are rehashed, and only pages with mismatching hashes are compared byte by byte.
+constexpr size_t ComparePageSize = 1024;
+
+static inline uint64_t hash_memory_page(const uint8_t *data, size_t size)
+{
+	// Four independent lanes to keep the multiplies from serializing.
+	uint64_t h[4] = { 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (unsigned lane = 0; lane < 4; lane++)
+		{
+			uint64_t v;
+			memcpy(&v, data + i + 8 * lane, sizeof(v));
+			h[lane] = (h[lane] ^ v) * 0xff51afd7ed558ccdull;
+			h[lane] ^= h[lane] >> 29;
+		}
+	}
+
+	for (; i < size; i++)
+		h[0] = (h[0] ^ data[i]) * 0x100000001b3ull;
+
+	uint64_t ret = h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7);
+	ret ^= ret >> 33;
+	ret *= 0xc4ceb9fe1a85ec53ull;
+	ret ^= ret >> 33;
+	return ret;
+}
+
+struct MemoryPageHashes
+{
+	std::vector<uint64_t> reference;
+	std::vector<uint64_t> gpu;
+
+	// Rehashes pages with their bit set in the dirty masks (one bit per page), or all pages for a null mask.
+	inline void update(const uint8_t *reference_data, const std::vector<uint32_t> *reference_dirty,
+	                   const uint8_t *gpu_data, const std::vector<uint32_t> *gpu_dirty, size_t size);
+
+	// Compares hashes, then compares mismatching pages byte by byte.
+	inline bool compare(const char *tag, const uint8_t *reference_data, const uint8_t *gpu_data, size_t size,
+	                    uint32_t *fault_addr) const;
+
+	inline static void update_hashes(std::vector<uint64_t> &hashes, const uint8_t *data,
+	                                 const std::vector<uint32_t> *dirty, size_t size);
+};
+
+void MemoryPageHashes::update_hashes(std::vector<uint64_t> &hashes, const uint8_t *data,
+                                     const std::vector<uint32_t> *dirty, size_t size)
+{
+	size_t num_pages = (size + ComparePageSize - 1) / ComparePageSize;
+	bool full = hashes.size() != num_pages || !dirty;
+	hashes.resize(num_pages);
+
+	for (size_t page = 0; page < num_pages; page++)
+	{
+		if (!full && ((page >> 5) >= dirty->size() || ((*dirty)[page >> 5] & (1u << (page & 31))) == 0))
+			continue;
+
+		size_t offset = page * ComparePageSize;
+		hashes[page] = hash_memory_page(data + offset, std::min(ComparePageSize, size - offset));
+	}
+}
+
+void MemoryPageHashes::update(const uint8_t *reference_data, const std::vector<uint32_t> *reference_dirty,
+                              const uint8_t *gpu_data, const std::vector<uint32_t> *gpu_dirty, size_t size)
+{
+	update_hashes(reference, reference_data, reference_dirty, size);
+	update_hashes(gpu, gpu_data, gpu_dirty, size);
+}
+
+bool MemoryPageHashes::compare(const char *tag, const uint8_t *reference_data, const uint8_t *gpu_data, size_t size,
+                               uint32_t *fault_addr) const
+{
+	for (size_t page = 0; page < reference.size(); page++)
+	{
+		if (reference[page] == gpu[page])
+			continue;
+
+		size_t offset = page * ComparePageSize;
+		size_t end = std::min(offset + ComparePageSize, size);
+		bool nonzero = false;
+		size_t diff = find_memory_difference(reference_data + offset, gpu_data + offset, end - offset, nonzero);
+
+		size_t i;
+		if (diff < end - offset && find_byte_difference(reference_data, gpu_data, offset + diff, end, i))
+		{
+			report_memory_difference(tag, reference_data, gpu_data, i);
+			if (fault_addr)
+				*fault_addr = i;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct RDRAMPageHashes
+{
+	MemoryPageHashes rdram;
+	MemoryPageHashes hidden_rdram;
+};
+
+// Like compare_rdram(), but through page hashes. Null dirty masks rehash everything.
+static inline bool compare_rdram_hashed(ReplayerDriver &reference, ReplayerDriver &gpu, RDRAMPageHashes &hashes,
+                                        const std::vector<uint32_t> *reference_dirty,
+                                        const std::vector<uint32_t> *reference_hidden_dirty,
+                                        const std::vector<uint32_t> *gpu_dirty,
+                                        const std::vector<uint32_t> *gpu_hidden_dirty,
+                                        uint32_t *fault_addr = nullptr, bool *fault_hidden = nullptr)
+{
+	hashes.rdram.update(reference.get_rdram(), reference_dirty, gpu.get_rdram(), gpu_dirty, gpu.get_rdram_size());
+	if (!hashes.rdram.compare("RDRAM", reference.get_rdram(), gpu.get_rdram(), gpu.get_rdram_size(), fault_addr))
+	{
+		if (fault_hidden)
+			*fault_hidden = false;
+		return false;
+	}
+
+	hashes.hidden_rdram.update(reference.get_hidden_rdram(), reference_hidden_dirty,
+	                           gpu.get_hidden_rdram(), gpu_hidden_dirty, gpu.get_hidden_rdram_size());
+	if (!hashes.hidden_rdram.compare("Hidden RDRAM", reference.get_hidden_rdram(), gpu.get_hidden_rdram(),
+	                                 gpu.get_hidden_rdram_size(), fault_addr))
+	{
+		if (fault_hidden)
+			*fault_hidden = true;
+		return false;
+	}
+
+	return true;
+}
+
 static inline bool compare_image(const std::vector<Interface::RGBA> &reference,
                                  unsigned reference_width, unsigned reference_height,
                                  const std::vector<Interface::RGBA> &gpu, unsigned gpu_width, unsigned gpu_height)
@@ -0,0 +1,214 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "masked_memcpy.hpp"
+#include "worker_thread.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include "global_managers.hpp"
+#include <stdlib.h>
+#include <random>
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace RDP;
+
+// The kernel used before masks were packed to one bit per byte. Takes one mask byte per byte.
+static void masked_memcpy_reference(uint8_t * __restrict dst,
+                                    const uint8_t * __restrict data_src,
+                                    const uint8_t * __restrict masked_src,
+                                    size_t size)
+{
+#if defined(__SSE2__)
+	for (size_t i = 0; i < size; i += 16)
+	{
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data_src + i));
+		__m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(masked_src + i));
+		_mm_maskmoveu_si128(data, mask, reinterpret_cast<char *>(dst + i));
+	}
+	_mm_mfence();
+#else
+	for (size_t i = 0; i < size; i++)
+		if (masked_src[i])
+			dst[i] = data_src[i];
+#endif
+}
+
+enum class MaskPattern
+{
+	Full,
+	Empty,
+	Framebuffer,
+	Random
+};
+
+static const char *mask_pattern_to_string(MaskPattern pattern)
+{
+	switch (pattern)
+	{
+	case MaskPattern::Full: return "full";
+	case MaskPattern::Empty: return "empty";
+	case MaskPattern::Framebuffer: return "framebuffer";
+	case MaskPattern::Random: return "random";
+	}
+	return "";
+}
+
+static void generate_mask(std::vector<uint32_t> &mask, MaskPattern pattern, std::mt19937 &rnd)
+{
+	switch (pattern)
+	{
+	case MaskPattern::Full:
+		std::fill(mask.begin(), mask.end(), ~0u);
+		break;
+
+	case MaskPattern::Empty:
+		std::fill(mask.begin(), mask.end(), 0u);
+		break;
+
+	case MaskPattern::Framebuffer:
+	{
+		// 320 wide RGBA5551 rows, where 600 of 640 bytes are written, starting at an unaligned offset.
+		const size_t stride = 640;
+		std::fill(mask.begin(), mask.end(), 0u);
+		for (size_t byte = 0; byte < mask.size() * 32; byte++)
+		{
+			size_t x = (byte + 6) % stride;
+			if (x < 600)
+				mask[byte >> 5] |= 1u << (byte & 31);
+		}
+		break;
+	}
+
+	case MaskPattern::Random:
+		for (auto &m : mask)
+			m = rnd();
+		break;
+	}
+}
+
+static void print_help()
+{
+	LOGE("Usage: masked-memcpy-bench\n"
+	     "\t[--size <bytes>]\n"
+	     "\t[--iterations <count>]\n"
+	     "\t[--workers <count>]\n"
+	);
+}
+
+static int main_inner(int argc, char *argv[])
+{
+	size_t size = 8 * 1024 * 1024;
+	unsigned iterations = 100;
+	unsigned num_workers = 4;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--size", [&](Util::CLIParser &parser) { size = parser.next_uint(); });
+	cbs.add("--iterations", [&](Util::CLIParser &parser) { iterations = parser.next_uint(); });
+	cbs.add("--workers", [&](Util::CLIParser &parser) { num_workers = parser.next_uint(); });
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	// Chunks handed to the workers, matching the page ranges used by CommandProcessor.
+	const size_t chunk_size = 64 * 1024;
+	size = std::max((size + chunk_size - 1) & ~(chunk_size - 1), chunk_size);
+	iterations = std::max(iterations, 1u);
+
+	std::mt19937 rnd(1337);
+	std::vector<uint8_t> src(size), dst(size), reference_dst(size), byte_mask(size);
+	std::vector<uint32_t> mask(size / 32);
+	for (auto &s : src)
+		s = uint8_t(rnd());
+
+	WorkerPool workers(std::max(num_workers, 1u) - 1);
+	unsigned num_chunks = unsigned(size / chunk_size);
+
+	for (auto pattern : { MaskPattern::Full, MaskPattern::Empty, MaskPattern::Framebuffer, MaskPattern::Random })
+	{
+		generate_mask(mask, pattern, rnd);
+		for (size_t i = 0; i < size; i++)
+			byte_mask[i] = (mask[i >> 5] & (1u << (i & 31))) ? 0xff : 0x00;
+
+		std::fill(reference_dst.begin(), reference_dst.end(), 0);
+		auto start_time = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < iterations; i++)
+			masked_memcpy_reference(reference_dst.data(), src.data(), byte_mask.data(), size);
+		double reference_time = 1e-9 * double(Util::get_current_time_nsecs() - start_time);
+
+		std::fill(dst.begin(), dst.end(), 0);
+		start_time = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < iterations; i++)
+			masked_memcpy(dst.data(), src.data(), mask.data(), size);
+		double packed_time = 1e-9 * double(Util::get_current_time_nsecs() - start_time);
+
+		if (dst != reference_dst)
+		{
+			LOGE("Mismatch for %s mask.\n", mask_pattern_to_string(pattern));
+			return EXIT_FAILURE;
+		}
+
+		std::fill(dst.begin(), dst.end(), 0);
+		start_time = Util::get_current_time_nsecs();
+		for (unsigned i = 0; i < iterations; i++)
+		{
+			workers.run(num_chunks, [&](unsigned index) {
+				size_t offset = index * chunk_size;
+				masked_memcpy(dst.data() + offset, src.data() + offset, mask.data() + offset / 32, chunk_size);
+			});
+		}
+		double pool_time = 1e-9 * double(Util::get_current_time_nsecs() - start_time);
+
+		if (dst != reference_dst)
+		{
+			LOGE("Mismatch for %s mask with workers.\n", mask_pattern_to_string(pattern));
+			return EXIT_FAILURE;
+		}
+
+		double gbytes = 1e-9 * double(size) * double(iterations);
+		LOGI("%12s mask: reference %8.3f GB/s, packed %8.3f GB/s, packed with %u workers %8.3f GB/s.\n",
+		     mask_pattern_to_string(pattern),
+		     gbytes / reference_time, gbytes / packed_time,
+		     workers.get_num_threads(), gbytes / pool_time);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	Granite::Global::init();
+	int ret = main_inner(argc, argv);
+	Granite::Global::deinit();
+	return ret;
+}
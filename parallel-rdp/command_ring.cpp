@@ -22,11 +22,29 @@
 
 #include "command_ring.hpp"
 #include "rdp_device.hpp"
+#include "rdp_common.hpp"
 #include "thread_id.hpp"
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace RDP
 {
+// Number of polls before a side of the ring parks on its condition variable.
+// Commands tend to arrive in bursts, so a short spin avoids most sleep/wake round-trips.
+static constexpr unsigned RingSpinIterations = 1024;
+
+static inline void cpu_relax()
+{
+#ifdef __SSE2__
+	_mm_pause();
+#endif
+}
+
 void CommandRing::init(
 #ifdef PARALLEL_RDP_SHADER_DIR
 		Granite::Global::GlobalManagersHandle global_handles_,
@@ -37,8 +55,11 @@ void CommandRing::init(
 	teardown_thread();
 	processor = processor_;
 	ring.resize(count);
-	write_count = 0;
-	read_count = 0;
+	write_count.store(0, std::memory_order_relaxed);
+	read_count.store(0, std::memory_order_relaxed);
+	cached_read_count = 0;
+	producer_parked.store(false, std::memory_order_relaxed);
+	consumer_parked.store(false, std::memory_order_relaxed);
 #ifdef PARALLEL_RDP_SHADER_DIR
 	global_handles = std::move(global_handles_);
 #endif
@@ -59,27 +80,150 @@ CommandRing::~CommandRing()
 	teardown_thread();
 }
 
-void CommandRing::drain()
+void CommandRing::wake(std::atomic_bool &parked, std::condition_variable &cond)
+{
+	// Pairs with the fence in the parking path. Either the parked side observes our counter update,
+	// or we observe that it has parked and must take the lock to notify it.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (parked.load(std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		cond.notify_one();
+	}
+}
+
+void CommandRing::wait_for_read_count(uint64_t count)
 {
+	for (unsigned i = 0; i < RingSpinIterations; i++)
+	{
+		cached_read_count = read_count.load(std::memory_order_acquire);
+		if (cached_read_count >= count)
+			return;
+		cpu_relax();
+	}
+
 	std::unique_lock<std::mutex> holder{lock};
-	cond.wait(holder, [this]() {
-		return write_count == completed_count;
+	producer_parked.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	producer_cond.wait(holder, [&]() {
+		cached_read_count = read_count.load(std::memory_order_acquire);
+		return cached_read_count >= count;
 	});
+	producer_parked.store(false, std::memory_order_relaxed);
 }
 
-void CommandRing::enqueue_command(unsigned num_words, const uint32_t *words)
+uint64_t CommandRing::wait_for_write_count(uint64_t count)
 {
+	uint64_t current = 0;
+	for (unsigned i = 0; i < RingSpinIterations; i++)
+	{
+		current = write_count.load(std::memory_order_acquire);
+		if (current >= count)
+			return current;
+		cpu_relax();
+	}
+
 	std::unique_lock<std::mutex> holder{lock};
-	cond.wait(holder, [this, num_words]() {
-		return write_count + num_words + 1 <= read_count + ring.size();
+	consumer_parked.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	consumer_cond.wait(holder, [&]() {
+		current = write_count.load(std::memory_order_acquire);
+		return current >= count;
 	});
+	consumer_parked.store(false, std::memory_order_relaxed);
+	return current;
+}
 
-	size_t mask = ring.size() - 1;
-	ring[write_count++ & mask] = num_words;
-	for (unsigned i = 0; i < num_words; i++)
-		ring[write_count++ & mask] = words[i];
+void CommandRing::drain()
+{
+	wait_for_read_count(write_count.load(std::memory_order_relaxed));
+}
+
+void CommandRing::enqueue_command(unsigned num_words, const uint32_t *words)
+{
+	uint64_t write_offset = write_count.load(std::memory_order_relaxed);
+	uint64_t required = write_offset + num_words + 1;
+	if (required > cached_read_count + ring.size())
+		wait_for_read_count(required - ring.size());
 
-	cond.notify_one();
+	ring[write_offset & (ring.size() - 1)] = num_words;
+	write_words(write_offset + 1, words, num_words);
+
+	write_count.store(required, std::memory_order_release);
+	wake(consumer_parked, consumer_cond);
+}
+
+void CommandRing::write_words(uint64_t offset, const uint32_t *words, size_t count)
+{
+	size_t ring_offset = offset & (ring.size() - 1);
+	size_t first_words = std::min<size_t>(count, ring.size() - ring_offset);
+	if (first_words)
+		memcpy(ring.data() + ring_offset, words, first_words * sizeof(uint32_t));
+	if (first_words < count)
+		memcpy(ring.data(), words + first_words, (count - first_words) * sizeof(uint32_t));
+}
+
+size_t CommandRing::enqueue_command_stream(const uint32_t *words, size_t num_words)
+{
+	size_t consumed = 0;
+
+	while (consumed < num_words)
+	{
+		// Decode as many complete commands as fit in the ring, then reserve space for all of them at once.
+		size_t batch_src_words = 0;
+		size_t batch_ring_words = 0;
+		bool split = false;
+
+		while (consumed + batch_src_words < num_words)
+		{
+			const uint32_t *cmd = words + consumed + batch_src_words;
+			unsigned cmd_words = get_command_length_words(Op((cmd[0] >> 24) & 63));
+			if (consumed + batch_src_words + cmd_words > num_words)
+			{
+				split = true;
+				break;
+			}
+
+			unsigned ring_words = ((cmd[0] >> 24) & 63) >= FirstRDPCommandOp ? cmd_words + 1 : 0;
+			if (batch_ring_words + ring_words > ring.size())
+				break;
+
+			batch_src_words += cmd_words;
+			batch_ring_words += ring_words;
+		}
+
+		if (batch_ring_words)
+		{
+			uint64_t write_offset = write_count.load(std::memory_order_relaxed);
+			uint64_t required = write_offset + batch_ring_words;
+			if (required > cached_read_count + ring.size())
+				wait_for_read_count(required - ring.size());
+
+			const uint32_t *cmd = words + consumed;
+			const uint32_t *end = cmd + batch_src_words;
+			while (cmd < end)
+			{
+				unsigned op = (cmd[0] >> 24) & 63;
+				unsigned cmd_words = get_command_length_words(Op(op));
+				if (op >= FirstRDPCommandOp)
+				{
+					ring[write_offset & (ring.size() - 1)] = cmd_words;
+					write_words(write_offset + 1, cmd, cmd_words);
+					write_offset += cmd_words + 1;
+				}
+				cmd += cmd_words;
+			}
+
+			write_count.store(required, std::memory_order_release);
+			wake(consumer_parked, consumer_cond);
+		}
+
+		consumed += batch_src_words;
+		if (split || batch_src_words == 0)
+			break;
+	}
+
+	return consumed;
 }
 
 void CommandRing::thread_loop()
@@ -96,28 +240,43 @@ void CommandRing::thread_loop()
 	std::vector<uint32_t> tmp_buffer;
 	tmp_buffer.reserve(64);
 	size_t mask = ring.size() - 1;
+	uint64_t read_offset = read_count.load(std::memory_order_relaxed);
 
 	for (;;)
 	{
+		// Consume everything the producer has published in one go.
+		uint64_t available = wait_for_write_count(read_offset + 1);
+
+		while (read_offset < available)
 		{
-			std::unique_lock<std::mutex> holder{lock};
-			cond.wait(holder, [this]() {
-				return write_count > read_count;
-			});
-
-			uint32_t num_words = ring[read_count++ & mask];
-			tmp_buffer.resize(num_words);
-			for (uint32_t i = 0; i < num_words; i++)
-				tmp_buffer[i] = ring[read_count++ & mask];
-		}
+			uint32_t num_words = ring[read_offset & mask];
+			if (num_words == 0)
+			{
+				read_count.store(read_offset + 1, std::memory_order_release);
+				wake(producer_parked, producer_cond);
+				return;
+			}
 
-		if (tmp_buffer.empty())
-			break;
+			// The producer cannot overwrite the command until read_count moves past it,
+			// so contiguous commands are processed straight out of the ring.
+			size_t offset = (read_offset + 1) & mask;
+			const uint32_t *words;
+			if (offset + num_words <= ring.size())
+				words = ring.data() + offset;
+			else
+			{
+				size_t first_words = ring.size() - offset;
+				tmp_buffer.resize(num_words);
+				memcpy(tmp_buffer.data(), ring.data() + offset, first_words * sizeof(uint32_t));
+				memcpy(tmp_buffer.data() + first_words, ring.data(), (num_words - first_words) * sizeof(uint32_t));
+				words = tmp_buffer.data();
+			}
 
-		processor->enqueue_command_direct(tmp_buffer.size(), tmp_buffer.data());
-		std::lock_guard<std::mutex> holder{lock};
-		completed_count = read_count;
-		cond.notify_one();
+			processor->enqueue_command_direct(num_words, words);
+			read_offset += num_words + 1;
+			read_count.store(read_offset, std::memory_order_release);
+			wake(producer_parked, producer_cond);
+		}
 	}
 }
 }
@@ -25,6 +25,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <vector>
 
 #ifdef PARALLEL_RDP_SHADER_DIR
@@ -46,20 +47,37 @@ public:
 	void drain();
 
 	void enqueue_command(unsigned num_words, const uint32_t *words);
+	size_t enqueue_command_stream(const uint32_t *words, size_t num_words);
 
 private:
 	CommandProcessor *processor = nullptr;
 	std::thread thr;
+
+	// Single producer, single consumer.
+	// The lock and condition variables are only touched when one side gives up spinning and parks.
 	std::mutex lock;
-	std::condition_variable cond;
+	std::condition_variable producer_cond;
+	std::condition_variable consumer_cond;
+	std::atomic_bool producer_parked{false};
+	std::atomic_bool consumer_parked{false};
 
 	std::vector<uint32_t> ring;
-	uint64_t write_count = 0;
-	uint64_t read_count = 0;
-	uint64_t completed_count = 0;
+
+	// Written by producer, released to consumer.
+	std::atomic<uint64_t> write_count{0};
+	// Written by consumer once a command has been fully processed, released to producer.
+	// Commands are processed in-place in the ring, so this doubles as the completion counter.
+	std::atomic<uint64_t> read_count{0};
+
+	// Producer-local view of read_count, avoids touching the consumer's cache line on every enqueue.
+	uint64_t cached_read_count = 0;
 
 	void thread_loop();
 	void teardown_thread();
+	void wait_for_read_count(uint64_t count);
+	uint64_t wait_for_write_count(uint64_t count);
+	void wake(std::atomic_bool &parked, std::condition_variable &cond);
+	void write_words(uint64_t offset, const uint32_t *words, size_t count);
 #ifdef PARALLEL_RDP_SHADER_DIR
 	Granite::Global::GlobalManagersHandle global_handles;
 #endif
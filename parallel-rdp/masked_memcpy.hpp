@@ -0,0 +1,101 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "bitops.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace RDP
+{
+// Copies the 32 bytes of src selected by mask to dst, one mask bit per byte.
+// Bytes not selected are never written, since the CPU may write to them concurrently,
+// so a read-modify-write blend cannot be used here.
+static inline void masked_memcpy_32(uint8_t * __restrict dst, const uint8_t * __restrict src, uint32_t mask)
+{
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+	__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+	_mm256_mask_storeu_epi8(dst, __mmask32(mask), data);
+#else
+	// Bit 4 * n is set if all bytes of word n are selected.
+	uint32_t full_words = mask & (mask >> 1) & (mask >> 2) & (mask >> 3) & 0x11111111u;
+	uint32_t partial_bytes = mask & ~(full_words * 0xfu);
+
+#if defined(__AVX2__)
+	if (full_words)
+	{
+		const __m256i word_select = _mm256_setr_epi32(1 << 0, 1 << 4, 1 << 8, 1 << 12,
+		                                              1 << 16, 1 << 20, 1 << 24, 1 << 28);
+		__m256i word_mask = _mm256_and_si256(_mm256_set1_epi32(int(full_words)), word_select);
+		word_mask = _mm256_cmpeq_epi32(word_mask, word_select);
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+		_mm256_maskstore_epi32(reinterpret_cast<int *>(dst), word_mask, data);
+	}
+#else
+	Util::for_each_bit(full_words, [&](unsigned byte_index) {
+		memcpy(dst + byte_index, src + byte_index, sizeof(uint32_t));
+	});
+#endif
+
+	Util::for_each_bit(partial_bytes, [&](unsigned byte_index) {
+		dst[byte_index] = src[byte_index];
+	});
+#endif
+}
+
+// Copies the bytes of data_src which are selected by mask_src to dst.
+// The mask has one bit per byte, 32 bytes per mask word, and size must be a multiple of 32.
+static inline void masked_memcpy(uint8_t * __restrict dst,
+                                 const uint8_t * __restrict data_src,
+                                 const uint32_t * __restrict mask_src,
+                                 size_t size)
+{
+	size_t num_words = size >> 5;
+	size_t i = 0;
+
+	while (i < num_words)
+	{
+		uint32_t mask = mask_src[i];
+		if (mask == ~0u)
+		{
+			// Most written pages are fully covered, so copy runs of them in one go.
+			size_t end = i + 1;
+			while (end < num_words && mask_src[end] == ~0u)
+				end++;
+			memcpy(dst + 32 * i, data_src + 32 * i, 32 * (end - i));
+			i = end;
+		}
+		else
+		{
+			if (mask)
+				masked_memcpy_32(dst + 32 * i, data_src + 32 * i, mask);
+			i++;
+		}
+	}
+}
+}
@@ -78,6 +78,36 @@ enum class Op
 	SetColorImage = 0x3f
 };
 
+// Size of an RDP command in 32-bit words, decoded from the opcode in its first word.
+static inline unsigned get_command_length_words(Op op)
+{
+	switch (op)
+	{
+	case Op::FillTriangle:
+		return 8;
+	case Op::FillZBufferTriangle:
+		return 12;
+	case Op::TextureTriangle:
+	case Op::ShadeTriangle:
+		return 24;
+	case Op::TextureZBufferTriangle:
+	case Op::ShadeZBufferTriangle:
+		return 28;
+	case Op::ShadeTextureTriangle:
+		return 40;
+	case Op::ShadeTextureZBufferTriangle:
+		return 44;
+	case Op::TextureRectangle:
+	case Op::TextureRectangleFlip:
+		return 4;
+	default:
+		return 2;
+	}
+}
+
+// Opcodes below this are either RDP no-ops or reserved for internal meta commands.
+constexpr unsigned FirstRDPCommandOp = unsigned(Op::FillTriangle);
+
 enum class RGBMul : uint8_t
 {
 	Combined = 0,
@@ -258,25 +258,42 @@ public:
 			if (memcmp(&elements[cached_index], &t, sizeof(T)) == 0)
 				return unsigned(cached_index);
 
-		for (int i = int(count) - 1; i >= 0; i--)
+		// Open addressing with linear probing. The table is at least twice as large as N, so probing terminates.
+		uint32_t hash = hash_element(t);
+		unsigned slot = hash & (HashTableSize - 1);
+		for (;;)
 		{
-			if (memcmp(&elements[i], &t, sizeof(T)) == 0)
+			auto &entry = hash_table[slot];
+			if (entry.generation != generation)
+				break;
+
+			if (entry.hash == hash && memcmp(&elements[entry.index], &t, sizeof(T)) == 0)
 			{
-				cached_index = i;
-				return unsigned(i);
+				cached_index = int(entry.index);
+				return entry.index;
 			}
+
+			slot = (slot + 1) & (HashTableSize - 1);
 		}
 
-		assert(count < N);
+		assert(count < capacity);
 		memcpy(elements + count, &t, sizeof(T));
 		unsigned ret = count++;
+		hash_table[slot] = { hash, generation, uint16_t(ret) };
 		cached_index = int(ret);
 		return ret;
 	}
 
 	bool full() const
 	{
-		return count == N;
+		return count == capacity;
+	}
+
+	// Lowers the number of elements which fit before the cache is full. N is the upper bound.
+	void set_capacity(unsigned capacity_)
+	{
+		assert(capacity_ && capacity_ <= N && count <= capacity_);
+		capacity = capacity_;
 	}
 
 	unsigned size() const
@@ -298,6 +315,13 @@ public:
 	{
 		count = 0;
 		cached_index = -1;
+
+		// Bumping the generation invalidates every hash entry at once.
+		if (++generation == 0)
+		{
+			memset(hash_table, 0, sizeof(hash_table));
+			generation = 1;
+		}
 	}
 
 	bool empty() const
@@ -306,24 +330,76 @@ public:
 	}
 
 private:
+	static_assert(N <= 0x10000, "StateCache indices must fit in 16 bits.");
+
+	static constexpr unsigned next_pow2(unsigned v)
+	{
+		return v <= 1 ? 1 : 2 * next_pow2((v + 1) / 2);
+	}
+	static constexpr unsigned HashTableSize = next_pow2(2 * N);
+
+	struct HashEntry
+	{
+		uint32_t hash;
+		uint16_t generation;
+		uint16_t index;
+	};
+
+	static uint32_t hash_element(const T &t)
+	{
+		auto *bytes = reinterpret_cast<const uint8_t *>(&t);
+		uint32_t h = 0x811c9dc5u;
+		size_t i = 0;
+		for (; i + 4 <= sizeof(T); i += 4)
+		{
+			uint32_t word;
+			memcpy(&word, bytes + i, sizeof(word));
+			h = (h ^ word) * 0x9e3779b1u;
+			h ^= h >> 15;
+		}
+		for (; i < sizeof(T); i++)
+			h = (h ^ bytes[i]) * 0x01000193u;
+		return h;
+	}
+
 	unsigned count = 0;
+	unsigned capacity = N;
 	int cached_index = -1;
+	uint16_t generation = 1;
+	HashEntry hash_table[HashTableSize] = {};
 	T elements[N];
 };
 
-template <typename T, unsigned N>
+template <typename T>
 class StreamCache
 {
 public:
+	// Elements are written straight into storage, normally a persistently mapped upload buffer,
+	// so they are never read back on the CPU.
+	void set_storage(T *storage, unsigned capacity_)
+	{
+		assert(count == 0);
+		elements = storage;
+		capacity = capacity_;
+	}
+
 	void add(const T &t)
 	{
-		assert(count < N);
-		memcpy(&elements[count++], &t, sizeof(T));
+		assert(count < capacity);
+		memcpy(elements + count++, &t, sizeof(T));
+	}
+
+	// Skips ahead to new_count. The skipped elements are zeroed, so uploads never contain stale data.
+	void pad(unsigned new_count)
+	{
+		assert(new_count >= count && new_count <= capacity);
+		memset(elements + count, 0, (new_count - count) * sizeof(T));
+		count = new_count;
 	}
 
 	bool full() const
 	{
-		return count == N;
+		return count == capacity;
 	}
 
 	unsigned size() const
@@ -353,7 +429,8 @@ public:
 
 private:
 	unsigned count = 0;
-	T elements[N];
+	unsigned capacity = 0;
+	T *elements = nullptr;
 };
 
 namespace Limits
@@ -362,13 +439,19 @@ constexpr unsigned MaxPrimitives = 0x1000;
 constexpr unsigned MaxStaticRasterizationStates = 64;
 constexpr unsigned MaxDepthBlendStates = 256;
 constexpr unsigned MaxTileInfoStates = 256;
-constexpr unsigned NumSyncStates = 8;
+constexpr unsigned MinSyncStates = 2;
 constexpr unsigned MaxNumTiles = 8;
 constexpr unsigned MaxTMEMInstances = 256;
 constexpr unsigned MaxSpanSetups = 512 * 1024;
 constexpr unsigned MaxWidth = 1024;
 constexpr unsigned MaxHeight = 1024;
 constexpr unsigned MaxTileInstances = 0x40000;
+
+// Upper bounds for RendererLimits.
+constexpr unsigned MaxPrimitivesUpperBound = 0x10000;
+// InstanceIndices stores the static state index in 8 bits.
+constexpr unsigned MaxStaticRasterizationStatesUpperBound = 256;
+constexpr unsigned MaxFramebufferSegmentsUpperBound = 64;
 }
 
 namespace ImplementationConstants
@@ -383,6 +466,40 @@ constexpr unsigned TileWidthLowres = TileWidth * TileLowresDownsample;
 constexpr unsigned TileHeightLowres = TileHeight * TileLowresDownsample;
 constexpr unsigned MaxTilesX = Limits::MaxWidth / TileWidth;
 constexpr unsigned MaxTilesY = Limits::MaxHeight / TileHeight;
-constexpr unsigned IncoherentPageSize = 1024;
+// Range of RendererLimits::incoherent_page_size. Coherency shaders process pages in blocks of the minimum size.
+constexpr unsigned MinIncoherentPageSize = 1024;
+constexpr unsigned MaxIncoherentPageSize = 64 * 1024;
+// Incoherent RDRAM write masks hold one bit per byte.
+constexpr unsigned IncoherentMaskBlockSize = MinIncoherentPageSize / 8;
+constexpr unsigned TileBufferWidthAlignment = 64;
+constexpr unsigned MinTileInstances = 4 * 1024;
+constexpr unsigned TileBufferShrinkInterval = 1024;
+// Framebuffer segments start at a multiple of this many primitives, so per-primitive buffers can be bound at
+// the segment offset. Any 4-byte multiple of element size then meets the largest storage buffer offset alignment.
+constexpr unsigned SegmentPrimitiveAlignment = 64;
 }
+
+// Render pass batch sizes, configurable per CommandProcessor. A render pass is flushed when any of them fills up.
+// Larger batches mean fewer flushes at the cost of more GPU memory. Defaults match Limits.
+struct RendererLimits
+{
+	// Rounded up to a multiple of 1024.
+	unsigned max_primitives = Limits::MaxPrimitives;
+	// Rounded up to a multiple of DefaultWorkgroupSize.
+	unsigned max_static_rasterization_states = Limits::MaxStaticRasterizationStates;
+	unsigned max_span_setups = Limits::MaxSpanSetups;
+	unsigned max_tile_instances = Limits::MaxTileInstances;
+	// Render pass buffers are added while earlier ones are still in flight, until they use this much memory.
+	// Once exhausted, recording waits for the GPU instead.
+	// Without a mappable RDRAM, each buffer also holds a staging readback copy of RDRAM, which counts towards this.
+	uint64_t buffer_instance_memory_budget = 128ull * 1024 * 1024;
+	// Number of color and depth framebuffer bindings batched into one render pass submission.
+	// With 1, every framebuffer change flushes.
+	unsigned max_framebuffer_segments = 1;
+	// Without VK_EXT_external_memory_host, RDRAM is uploaded and read back in pages of this size.
+	// Larger pages mean fewer copies and page bookkeeping for large framebuffers,
+	// smaller pages less over-copying for scattered texture loads.
+	// Rounded up to a power of two between MinIncoherentPageSize and MaxIncoherentPageSize.
+	unsigned incoherent_page_size = ImplementationConstants::MinIncoherentPageSize;
+};
 }
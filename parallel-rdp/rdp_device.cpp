@@ -22,11 +22,9 @@
 
 #include "rdp_device.hpp"
 #include "rdp_common.hpp"
+#include "masked_memcpy.hpp"
 #include <chrono>
-
-#ifdef __SSE2__
-#include <emmintrin.h>
-#endif
+#include <algorithm>
 
 #ifndef PARALLEL_RDP_SHADER_DIR
 #include "shaders/slangmosh.hpp"
@@ -41,14 +39,18 @@ using namespace Vulkan;
 
 namespace RDP
 {
+// Readbacks are split into chunks of about this many bytes for the coherency workers.
+static constexpr size_t CoherencyChunkSize = 64 * 1024;
+
 CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
                                    size_t rdram_offset_, size_t rdram_size_, size_t hidden_rdram_size,
-                                   CommandProcessorFlags flags)
+                                   CommandProcessorFlags flags, const RendererLimits &limits)
 	: device(device_), rdram_offset(rdram_offset_), rdram_size(rdram_size_), renderer(*this),
 #ifdef PARALLEL_RDP_SHADER_DIR
-	  timeline_worker(Granite::Global::create_thread_context(), FenceExecutor{&device, &thread_timeline_value})
+	  timeline_worker(Granite::Global::create_thread_context(),
+	                  FenceExecutor{&device, &thread_timeline_value, &thread_readback_count, &coherency_workers})
 #else
-	  timeline_worker(FenceExecutor{&device, &thread_timeline_value})
+	  timeline_worker(FenceExecutor{&device, &thread_timeline_value, &thread_readback_count, &coherency_workers})
 #endif
 {
 	BufferCreateInfo info = {};
@@ -79,7 +81,7 @@ CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
 			host_rdram = static_cast<uint8_t *>(rdram_ptr) + rdram_offset_;
 
 			BufferCreateInfo device_rdram = {};
-			device_rdram.size = rdram_size * 2; // Need twice the memory amount so we can also store a writemask.
+			device_rdram.size = rdram_size + rdram_size / 8; // Also store a writemask with one bit per byte.
 			device_rdram.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 			                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
 			                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
@@ -99,6 +101,18 @@ CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
 	if (!rdram)
 		LOGE("Failed to allocate RDRAM.\n");
 
+	if (!is_host_coherent)
+	{
+		// The emulator keeps other cores busy, so only use a few.
+		unsigned num_workers = std::min(std::thread::hardware_concurrency() / 4, 4u);
+		if (const char *env = getenv("PARALLEL_RDP_COHERENCY_WORKERS"))
+		{
+			num_workers = unsigned(strtoul(env, nullptr, 0));
+			LOGI("Overriding coherency workers = %u\n", num_workers);
+		}
+		coherency_workers.reset(new WorkerPool(std::max(num_workers, 1u) - 1));
+	}
+
 	info.size = hidden_rdram_size;
 	// Should be CachedHost, but seeing some insane bug on incoherent Arm systems for time being,
 	// so just forcing coherent memory here for now. Not sure what is going on.
@@ -114,7 +128,9 @@ CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
 
 	clear_hidden_rdram();
 	clear_tmem();
+	renderer.set_limits(limits);
 	init_renderer();
+	renderer.set_cpu_write_tracking((flags & COMMAND_PROCESSOR_FLAG_TRACK_CPU_WRITES_BIT) != 0);
 
 	ring.init(
 #ifdef PARALLEL_RDP_SHADER_DIR
@@ -186,6 +202,11 @@ bool CommandProcessor::device_is_supported() const
 	return is_supported;
 }
 
+const RendererLimits &CommandProcessor::get_limits() const
+{
+	return renderer.get_limits();
+}
+
 void CommandProcessor::clear_hidden_rdram()
 {
 	clear_buffer(*hidden_rdram, 0x03030303);
@@ -815,6 +836,26 @@ void CommandProcessor::enqueue_command(unsigned num_words, const uint32_t *words
 		ring.enqueue_command(num_words, words);
 }
 
+size_t CommandProcessor::enqueue_command_stream(const uint32_t *words, size_t num_words)
+{
+	if (!single_threaded_processing)
+		return ring.enqueue_command_stream(words, num_words);
+
+	size_t consumed = 0;
+	while (consumed < num_words)
+	{
+		unsigned op = (words[consumed] >> 24) & 63;
+		unsigned cmd_words = get_command_length_words(Op(op));
+		if (consumed + cmd_words > num_words)
+			break;
+		if (op >= FirstRDPCommandOp)
+			enqueue_command_direct(cmd_words, words + consumed);
+		consumed += cmd_words;
+	}
+
+	return consumed;
+}
+
 void CommandProcessor::enqueue_command_direct(unsigned num_words, const uint32_t *words)
 {
 #define OP(x) &CommandProcessor::op_##x
@@ -885,6 +926,12 @@ void CommandProcessor::end_write_rdram()
 		device.unmap_host_buffer(*rdram, MEMORY_ACCESS_WRITE_BIT);
 }
 
+void CommandProcessor::notify_cpu_write(size_t offset, size_t length)
+{
+	if (!is_host_coherent && offset < rdram_size)
+		renderer.notify_cpu_write(uint32_t(offset), uint32_t(std::min(length, rdram_size - offset)));
+}
+
 void *CommandProcessor::begin_read_hidden_rdram()
 {
 	return device.map_host_buffer(*hidden_rdram, MEMORY_ACCESS_READ_BIT);
@@ -986,7 +1033,7 @@ void CommandProcessor::drain_command_ring()
 	}
 }
 
-void CommandProcessor::scanout_sync(std::vector<RGBA> &colors, unsigned &width, unsigned &height)
+Vulkan::ImageHandle CommandProcessor::scanout_for_readback()
 {
 	drain_command_ring();
 	renderer.flush();
@@ -998,7 +1045,12 @@ void CommandProcessor::scanout_sync(std::vector<RGBA> &colors, unsigned &width,
 		renderer.resolve_coherency_external(offset, length);
 	}
 
-	auto handle = vi.scanout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+	return vi.scanout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+}
+
+void CommandProcessor::scanout_sync(std::vector<RGBA> &colors, unsigned &width, unsigned &height)
+{
+	auto handle = scanout_for_readback();
 
 	if (!handle)
 	{
@@ -1032,10 +1084,91 @@ void CommandProcessor::scanout_sync(std::vector<RGBA> &colors, unsigned &width,
 	device.unmap_host_buffer(*readback, Vulkan::MEMORY_ACCESS_READ_BIT);
 }
 
+void CommandProcessor::queue_scanout_readback(ScanoutReadbackSlot &slot)
+{
+	if (slot.mapped)
+	{
+		device.unmap_host_buffer(*slot.buffer, Vulkan::MEMORY_ACCESS_READ_BIT);
+		slot.mapped = false;
+	}
+
+	slot.fence.reset();
+	auto handle = scanout_for_readback();
+	if (!handle)
+	{
+		slot.width = 0;
+		slot.height = 0;
+		return;
+	}
+
+	slot.width = handle->get_width();
+	slot.height = handle->get_height();
+
+	// Readback buffers persist and are only reallocated if the scanout grows.
+	VkDeviceSize size = slot.width * slot.height * sizeof(uint32_t);
+	if (!slot.buffer || slot.buffer->get_create_info().size < size)
+	{
+		Vulkan::BufferCreateInfo info = {};
+		info.size = size;
+		info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		info.domain = Vulkan::BufferDomain::CachedCoherentHostPreferCached;
+		slot.buffer = device.create_buffer(info);
+	}
+
+	auto cmd = device.request_command_buffer();
+	cmd->copy_image_to_buffer(*slot.buffer, *handle, 0, {}, { slot.width, slot.height, 1 }, 0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+	cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	device.submit(cmd, &slot.fence);
+}
+
+void CommandProcessor::complete_scanout_readback(ScanoutReadbackSlot &slot, ScanoutReadback &readback)
+{
+	readback = {};
+	if (!slot.fence)
+		return;
+
+	slot.fence->wait();
+	slot.fence.reset();
+
+	readback.colors = static_cast<const RGBA *>(device.map_host_buffer(*slot.buffer, Vulkan::MEMORY_ACCESS_READ_BIT));
+	readback.width = slot.width;
+	readback.height = slot.height;
+	slot.mapped = true;
+}
+
+bool CommandProcessor::scanout_async(ScanoutReadback &readback)
+{
+	queue_scanout_readback(scanout_readbacks[scanout_readback_index]);
+	scanout_readback_index = (scanout_readback_index + 1) % ScanoutReadbackRingSize;
+	scanout_readback_count++;
+
+	// The oldest readback lives in the slot we will write to next.
+	if (scanout_readback_count < ScanoutReadbackRingSize)
+		return false;
+
+	complete_scanout_readback(scanout_readbacks[scanout_readback_index], readback);
+	scanout_readback_count--;
+	return true;
+}
+
+bool CommandProcessor::scanout_async_drain(ScanoutReadback &readback)
+{
+	if (!scanout_readback_count)
+		return false;
+
+	unsigned index = (scanout_readback_index + ScanoutReadbackRingSize - scanout_readback_count) % ScanoutReadbackRingSize;
+	complete_scanout_readback(scanout_readbacks[index], readback);
+	scanout_readback_count--;
+	return true;
+}
+
 void CommandProcessor::FenceExecutor::notify_work_locked(const CoherencyOperation &work)
 {
 	if (work.timeline_value)
 		*value = work.timeline_value;
+	if (work.src)
+		(*readbacks)++;
 }
 
 bool CommandProcessor::FenceExecutor::is_sentinel(const CoherencyOperation &work) const
@@ -1043,69 +1176,62 @@ bool CommandProcessor::FenceExecutor::is_sentinel(const CoherencyOperation &work
 	return !work.fence;
 }
 
-static void masked_memcpy(uint8_t * __restrict dst,
-                          const uint8_t * __restrict data_src,
-                          const uint8_t * __restrict masked_src,
-                          size_t size)
-{
-#if defined(__SSE2__)
-	for (size_t i = 0; i < size; i += 16)
-	{
-		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data_src + i));
-		__m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(masked_src + i));
-		_mm_maskmoveu_si128(data, mask, reinterpret_cast<char *>(dst + i));
-	}
-#else
-	auto * __restrict data32 = reinterpret_cast<const uint32_t *>(data_src);
-	auto * __restrict mask32 = reinterpret_cast<const uint32_t *>(masked_src);
-	auto * __restrict dst32 = reinterpret_cast<uint32_t *>(dst);
-	auto size32 = size >> 2;
-
-	for (size_t i = 0; i < size32; i++)
-	{
-		auto mask = mask32[i];
-		if (mask == ~0u)
-		{
-			dst32[i] = data32[i];
-		}
-		else if (mask)
-		{
-			// Fairly rare path.
-			for (unsigned j = 0; j < 4; j++)
-				if (masked_src[4 * i + j])
-					dst[4 * i + j] = data_src[4 * i + j];
-		}
-	}
-#endif
-}
-
 void CommandProcessor::FenceExecutor::perform_work(CoherencyOperation &work)
 {
 	work.fence->wait();
 
 	if (work.src)
 	{
+		// Split copies into page ranges, so large readbacks are merged on all coherency workers.
+		chunks.clear();
 		for (auto &copy : work.copies)
 		{
-			auto *mapped_data = static_cast<uint8_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.src_offset, copy.size));
-			auto *mapped_mask = static_cast<uint8_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.mask_offset, copy.size));
-			masked_memcpy(work.dst + copy.dst_offset, mapped_data, mapped_mask, copy.size);
-			for (unsigned i = 0; i < copy.counters; i++)
+			auto *mapped_data = static_cast<const uint8_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.src_offset, copy.size));
+			auto *mapped_mask = static_cast<const uint32_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.mask_offset, copy.size / 8));
+
+			// Each counter covers one page.
+			size_t page_size = copy.size / copy.counters;
+			unsigned chunk_pages = unsigned(std::max<size_t>(CoherencyChunkSize / page_size, 1));
+
+			for (unsigned page = 0; page < copy.counters; page += chunk_pages)
 			{
-				unsigned val = copy.counter_base[i].fetch_sub(1, std::memory_order_release);
-				(void)val;
-				assert(val > 0);
+				CopyChunk chunk = {};
+				size_t offset = size_t(page) * page_size;
+				chunk.counters = std::min(copy.counters - page, chunk_pages);
+				chunk.size = size_t(chunk.counters) * page_size;
+				chunk.dst = work.dst + copy.dst_offset + offset;
+				chunk.data = mapped_data + offset;
+				chunk.mask = mapped_mask + offset / 32;
+				chunk.counter_base = copy.counter_base + page;
+				chunks.push_back(chunk);
 			}
 		}
 
-#ifdef __SSE2__
-		_mm_mfence();
-#endif
+		(*workers)->run(unsigned(chunks.size()), [this](unsigned index) {
+			auto &chunk = chunks[index];
+			masked_memcpy(chunk.dst, chunk.data, chunk.mask, chunk.size);
+			for (unsigned i = 0; i < chunk.counters; i++)
+			{
+				unsigned val = chunk.counter_base[i].fetch_sub(1, std::memory_order_release);
+				(void)val;
+				assert(val > 0);
+			}
+		});
 	}
 }
 
-void CommandProcessor::enqueue_coherency_operation(CoherencyOperation &&op)
+uint64_t CommandProcessor::enqueue_coherency_operation(CoherencyOperation &&op)
 {
+	if (op.src)
+		readback_count++;
 	timeline_worker.push(std::move(op));
+	return readback_count;
+}
+
+void CommandProcessor::wait_for_readback(uint64_t index)
+{
+	timeline_worker.wait([this, index]() -> bool {
+		return thread_readback_count >= index;
+	});
 }
 }
@@ -46,7 +46,10 @@ struct RGBA
 enum CommandProcessorFlagBits
 {
 	COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_HIDDEN_RDRAM_BIT = 1 << 0,
-	COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_TMEM_BIT = 1 << 1
+	COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_TMEM_BIT = 1 << 1,
+	// Without VK_EXT_external_memory_host, RDRAM is copied to the GPU before it is read.
+	// With this flag, only pages reported through notify_cpu_write() are copied, instead of every page which is read.
+	COMMAND_PROCESSOR_FLAG_TRACK_CPU_WRITES_BIT = 1 << 2
 };
 using CommandProcessorFlags = uint32_t;
 
@@ -78,11 +81,14 @@ public:
 	                 size_t rdram_offset,
 	                 size_t rdram_size,
 	                 size_t hidden_rdram_size,
-	                 CommandProcessorFlags flags);
+	                 CommandProcessorFlags flags,
+	                 const RendererLimits &limits = {});
 
 	~CommandProcessor();
 
 	bool device_is_supported() const;
+	// Render pass batch sizes in effect, after rounding.
+	const RendererLimits &get_limits() const;
 
 	// Synchronization.
 	void flush();
@@ -95,9 +101,17 @@ public:
 	void enqueue_command(unsigned num_words, const uint32_t *words);
 	void enqueue_command_direct(unsigned num_words, const uint32_t *words);
 
+	// Queues up a raw span of RDP commands, e.g. DP_START to DP_END.
+	// Returns number of words consumed. If the last command is split across the end of the span,
+	// it is not consumed and must be resubmitted along with the rest of its words.
+	size_t enqueue_command_stream(const uint32_t *words, size_t num_words);
+
 	// Interact with memory.
 	void *begin_read_rdram();
 	void end_write_rdram();
+	// Reports CPU writes to RDRAM, relative to the RDRAM base. Required for every write
+	// with COMMAND_PROCESSOR_FLAG_TRACK_CPU_WRITES_BIT, ignored otherwise.
+	void notify_cpu_write(size_t offset, size_t length);
 	void *begin_read_hidden_rdram();
 	void end_write_hidden_rdram();
 	size_t get_rdram_size() const;
@@ -110,6 +124,19 @@ public:
 	Vulkan::ImageHandle scanout(const ScanoutOptions &opts = {});
 	void scanout_sync(std::vector<RGBA> &colors, unsigned &width, unsigned &height);
 
+	// Pipelined scanout readback. Queues a readback of the current scanout and returns the one queued
+	// ScanoutReadbackLatency calls earlier, which has normally completed by then, so the CPU does not stall on the GPU.
+	// Returns false until enough frames are queued. colors points to mapped memory, valid until the next call.
+	struct ScanoutReadback
+	{
+		const RGBA *colors = nullptr;
+		unsigned width = 0;
+		unsigned height = 0;
+	};
+	bool scanout_async(ScanoutReadback &readback);
+	// Waits for and returns the oldest readback still queued, if any.
+	bool scanout_async_drain(ScanoutReadback &readback);
+
 private:
 	Vulkan::Device &device;
 	Vulkan::BufferHandle rdram;
@@ -157,16 +184,55 @@ private:
 
 	uint64_t timeline_value = 0;
 	uint64_t thread_timeline_value = 0;
+	// Coherency operations with a readback source, enqueued and merged into host RDRAM respectively.
+	uint64_t readback_count = 0;
+	uint64_t thread_readback_count = 0;
+
+	static constexpr unsigned ScanoutReadbackLatency = 2;
+	static constexpr unsigned ScanoutReadbackRingSize = ScanoutReadbackLatency + 1;
+	struct ScanoutReadbackSlot
+	{
+		Vulkan::BufferHandle buffer;
+		Vulkan::Fence fence;
+		unsigned width = 0;
+		unsigned height = 0;
+		bool mapped = false;
+	};
+	ScanoutReadbackSlot scanout_readbacks[ScanoutReadbackRingSize];
+	unsigned scanout_readback_index = 0;
+	unsigned scanout_readback_count = 0;
+
+	Vulkan::ImageHandle scanout_for_readback();
+	void queue_scanout_readback(ScanoutReadbackSlot &slot);
+	void complete_scanout_readback(ScanoutReadbackSlot &slot, ScanoutReadback &readback);
+
+	// Helps the timeline worker merge large GPU writes back into host RDRAM.
+	std::unique_ptr<WorkerPool> coherency_workers;
 
 	struct FenceExecutor
 	{
-		explicit inline FenceExecutor(Vulkan::Device *device_, uint64_t *ptr)
-			: device(device_), value(ptr)
+		explicit inline FenceExecutor(Vulkan::Device *device_, uint64_t *ptr, uint64_t *readbacks_,
+		                              const std::unique_ptr<WorkerPool> *workers_)
+			: device(device_), value(ptr), readbacks(readbacks_), workers(workers_)
 		{
 		}
 
 		Vulkan::Device *device;
 		uint64_t *value;
+		uint64_t *readbacks;
+		const std::unique_ptr<WorkerPool> *workers;
+
+		struct CopyChunk
+		{
+			uint8_t *dst;
+			const uint8_t *data;
+			const uint32_t *mask;
+			size_t size;
+			std::atomic_uint32_t *counter_base;
+			unsigned counters;
+		};
+		std::vector<CopyChunk> chunks;
+
 		bool is_sentinel(const CoherencyOperation &work) const;
 		void perform_work(CoherencyOperation &work);
 		void notify_work_locked(const CoherencyOperation &work);
@@ -182,7 +248,9 @@ private:
 
 	friend class Renderer;
 
-	void enqueue_coherency_operation(CoherencyOperation &&op);
+	// Returns the readback index to pass to wait_for_readback() once op.src may be overwritten.
+	uint64_t enqueue_coherency_operation(CoherencyOperation &&op);
+	void wait_for_readback(uint64_t index);
 	void drain_command_ring();
 };
 }
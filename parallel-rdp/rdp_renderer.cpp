@@ -25,6 +25,7 @@
 #include "logging.hpp"
 #include "bitops.hpp"
 #include "luts.hpp"
+#include "timer.hpp"
 #ifdef PARALLEL_RDP_SHADER_DIR
 #include "global_managers.hpp"
 #include "os_filesystem.hpp"
@@ -43,6 +44,23 @@ Renderer::Renderer(CommandProcessor &processor_)
 
 Renderer::~Renderer()
 {
+	if (caps.timestamp && buffer_instance_stalls.waits)
+	{
+		LOGI("Waited %llu times for render pass buffers, %.3f ms in total, with %u buffer instances.\n",
+		     static_cast<unsigned long long>(buffer_instance_stalls.waits),
+		     1e-6 * double(buffer_instance_stalls.stall_ns), unsigned(buffer_instances.size()));
+	}
+
+	if (caps.timestamp && !is_host_coherent)
+	{
+		auto &counters = incoherent.counters;
+		LOGI("Coherency traffic with %u byte pages: uploaded %llu pages (%llu masked), read back %llu pages in %llu copies.\n",
+		     incoherent.page_size,
+		     static_cast<unsigned long long>(counters.direct_upload_pages + counters.masked_upload_pages),
+		     static_cast<unsigned long long>(counters.masked_upload_pages),
+		     static_cast<unsigned long long>(counters.readback_pages),
+		     static_cast<unsigned long long>(counters.readback_copies));
+	}
 }
 
 void Renderer::set_shader_bank(const ShaderBank *bank)
@@ -50,10 +68,55 @@ void Renderer::set_shader_bank(const ShaderBank *bank)
 	shader_bank = bank;
 }
 
+void Renderer::set_limits(const RendererLimits &limits_)
+{
+	assert(!device);
+	limits = limits_;
+
+	auto align = [](unsigned v, unsigned a) { return (v + a - 1) & ~(a - 1); };
+	limits.max_primitives = align(std::max(limits.max_primitives, 1024u), 1024);
+	limits.max_primitives = std::min(limits.max_primitives, Limits::MaxPrimitivesUpperBound);
+	limits.max_static_rasterization_states =
+			align(std::max(limits.max_static_rasterization_states, 1u), ImplementationConstants::DefaultWorkgroupSize);
+	limits.max_static_rasterization_states =
+			std::min(limits.max_static_rasterization_states, Limits::MaxStaticRasterizationStatesUpperBound);
+	// A render pass must at least fit one primitive spanning the full height.
+	limits.max_span_setups = std::max(limits.max_span_setups, 2 * Limits::MaxHeight);
+	limits.max_tile_instances = std::max(limits.max_tile_instances,
+	                                     2 * ImplementationConstants::MaxTilesX * ImplementationConstants::MaxTilesY);
+
+	if (const char *env = getenv("PARALLEL_RDP_FRAMEBUFFER_SEGMENTS"))
+	{
+		limits.max_framebuffer_segments = unsigned(strtoul(env, nullptr, 0));
+		LOGI("Overriding framebuffer segments = %u\n", limits.max_framebuffer_segments);
+	}
+	limits.max_framebuffer_segments = std::max(limits.max_framebuffer_segments, 1u);
+	limits.max_framebuffer_segments = std::min(limits.max_framebuffer_segments, Limits::MaxFramebufferSegmentsUpperBound);
+
+	if (const char *env = getenv("PARALLEL_RDP_INCOHERENT_PAGE_SIZE"))
+	{
+		limits.incoherent_page_size = unsigned(strtoul(env, nullptr, 0));
+		LOGI("Overriding incoherent page size = %u\n", limits.incoherent_page_size);
+	}
+	limits.incoherent_page_size = std::max(limits.incoherent_page_size, ImplementationConstants::MinIncoherentPageSize);
+	limits.incoherent_page_size = std::min(limits.incoherent_page_size, ImplementationConstants::MaxIncoherentPageSize);
+	unsigned page_size = ImplementationConstants::MinIncoherentPageSize;
+	while (page_size < limits.incoherent_page_size)
+		page_size *= 2;
+	limits.incoherent_page_size = page_size;
+}
+
+const RendererLimits &Renderer::get_limits() const
+{
+	return limits;
+}
+
 bool Renderer::set_device(Vulkan::Device *device_)
 {
 	device = device_;
 
+	stream.static_raster_state_cache.set_capacity(limits.max_static_rasterization_states);
+
 #ifdef PARALLEL_RDP_SHADER_DIR
 	pipeline_worker.reset(new WorkerThread<Vulkan::DeferredPipelineCompile, PipelineExecutor>(
 			Granite::Global::create_thread_context(), { device }));
@@ -67,8 +130,9 @@ bool Renderer::set_device(Vulkan::Device *device_)
 	device->get_shader_manager().add_include_directory("builtin://shaders/inc");
 #endif
 
-	for (auto &buffer : buffer_instances)
-		buffer.init(*device);
+	for (unsigned i = 0; i < Limits::MinSyncStates; i++)
+		add_buffer_instance(i);
+	begin_buffer_instance();
 
 	if (const char *env = getenv("RDP_DEBUG"))
 		debug_channel = strtoul(env, nullptr, 0) != 0;
@@ -83,20 +147,16 @@ bool Renderer::set_device(Vulkan::Device *device_)
 		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 		info.domain = Vulkan::BufferDomain::Device;
 		info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
-		tmem_instances = device->create_buffer(info);
-		device->set_name(*tmem_instances, "tmem-instances");
+		for (auto &instances : tmem_instances)
+		{
+			instances = device->create_buffer(info);
+			device->set_name(*instances, "tmem-instances");
+		}
 		stream.tmem_upload_infos.reserve(Limits::MaxTMEMInstances);
 	}
 
-	{
-		Vulkan::BufferCreateInfo info = {};
-		info.size = Limits::MaxSpanSetups * sizeof(SpanSetup);
-		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-		info.domain = Vulkan::BufferDomain::Device;
-		info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
-		span_setups = device->create_buffer(info);
-		device->set_name(*span_setups, "span-setups");
-	}
+	// The second set is only needed once render passes overlap.
+	init_span_setups(0);
 
 	init_blender_lut();
 	init_buffers();
@@ -243,76 +303,163 @@ int Renderer::resolve_shader_define(const char *name, const char *define) const
 }
 
 void Renderer::init_buffers()
+{
+	static_assert((Limits::MaxWidth % ImplementationConstants::TileWidthLowres) == 0, "MaxWidth must be divisible by maximum tile width.");
+	static_assert((Limits::MaxHeight % ImplementationConstants::TileHeightLowres) == 0, "MaxHeight must be divisible by maximum tile height.");
+
+	// Binning and per-tile buffers are allocated lazily in ensure_tile_buffers().
+	if (!caps.ubershader)
+	{
+		Vulkan::BufferCreateInfo indirect_info = {};
+		indirect_info.size = 4 * sizeof(uint32_t) * limits.max_static_rasterization_states;
+		indirect_info.domain = Vulkan::BufferDomain::Device;
+		indirect_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+		indirect_info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
+		indirect_dispatch_buffer = device->create_buffer(indirect_info);
+		device->set_name(*indirect_dispatch_buffer, "indirect-dispatch-buffer");
+	}
+}
+
+void Renderer::init_binning_buffers(unsigned width, unsigned height)
 {
 	Vulkan::BufferCreateInfo info = {};
 	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 	info.domain = Vulkan::BufferDomain::Device;
 	info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
 
-	static_assert((Limits::MaxPrimitives % (32 * 32)) == 0, "MaxPrimitives must be divisble by 1024.");
-	static_assert((Limits::MaxWidth % ImplementationConstants::TileWidthLowres) == 0, "MaxWidth must be divisible by maximum tile width.");
-	static_assert((Limits::MaxHeight % ImplementationConstants::TileHeightLowres) == 0, "MaxHeight must be divisible by maximum tile height.");
+	assert((limits.max_primitives % (32 * 32)) == 0);
+	assert((width % ImplementationConstants::TileWidthLowres) == 0);
+	assert((height % ImplementationConstants::TileHeightLowres) == 0);
+
+	tile_buffers.width = width;
+	tile_buffers.height = height;
 
 	info.size = sizeof(uint32_t) *
-	            (Limits::MaxPrimitives / 32) *
-	            (Limits::MaxWidth / ImplementationConstants::TileWidth) *
-	            (Limits::MaxHeight / ImplementationConstants::TileHeight);
+	            (limits.max_primitives / 32) *
+	            (width / ImplementationConstants::TileWidth) *
+	            (height / ImplementationConstants::TileHeight);
 	tile_binning_buffer = device->create_buffer(info);
 	device->set_name(*tile_binning_buffer, "tile-binning-buffer");
 
 	info.size = sizeof(uint32_t) *
-	            (Limits::MaxPrimitives / 1024) *
-	            (Limits::MaxWidth / ImplementationConstants::TileWidth) *
-	            (Limits::MaxHeight / ImplementationConstants::TileHeight);
+	            (limits.max_primitives / 1024) *
+	            (width / ImplementationConstants::TileWidth) *
+	            (height / ImplementationConstants::TileHeight);
 	tile_binning_buffer_coarse = device->create_buffer(info);
 	device->set_name(*tile_binning_buffer_coarse, "tile-binning-buffer-coarse");
 
 	info.size = sizeof(uint32_t) *
-	            (Limits::MaxPrimitives / 32) *
-	            (Limits::MaxWidth / ImplementationConstants::TileWidthLowres) *
-	            (Limits::MaxHeight / ImplementationConstants::TileHeightLowres);
+	            (limits.max_primitives / 32) *
+	            (width / ImplementationConstants::TileWidthLowres) *
+	            (height / ImplementationConstants::TileHeightLowres);
 	tile_binning_buffer_prepass = device->create_buffer(info);
 	device->set_name(*tile_binning_buffer_prepass, "tile-binning-buffer-prepass");
 
 	if (!caps.ubershader)
 	{
-		Vulkan::BufferCreateInfo indirect_info = {};
-		indirect_info.size = 4 * sizeof(uint32_t) * Limits::MaxStaticRasterizationStates;
-		indirect_info.domain = Vulkan::BufferDomain::Device;
-		indirect_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
-		indirect_info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
-		indirect_dispatch_buffer = device->create_buffer(indirect_info);
-		device->set_name(*indirect_dispatch_buffer, "indirect-dispatch-buffer");
-
 		info.size = sizeof(uint32_t) *
-		            (Limits::MaxPrimitives / 32) *
-		            (Limits::MaxWidth / ImplementationConstants::TileWidth) *
-		            (Limits::MaxHeight / ImplementationConstants::TileHeight);
+		            (limits.max_primitives / 32) *
+		            (width / ImplementationConstants::TileWidth) *
+		            (height / ImplementationConstants::TileHeight);
 		per_tile_offsets = device->create_buffer(info);
 		device->set_name(*per_tile_offsets, "per-tile-offsets");
+	}
+}
 
-		info.size = sizeof(TileRasterWork) * Limits::MaxStaticRasterizationStates * Limits::MaxTileInstances;
-		tile_work_list = device->create_buffer(info);
-		device->set_name(*tile_work_list, "tile-work-list");
+void Renderer::init_tile_instance_buffers(unsigned tile_instances)
+{
+	Vulkan::BufferCreateInfo info = {};
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.domain = Vulkan::BufferDomain::Device;
+	info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
 
-		info.size = sizeof(uint32_t) *
-		            Limits::MaxTileInstances *
-		            ImplementationConstants::TileWidth *
-		            ImplementationConstants::TileHeight;
-		per_tile_shaded_color = device->create_buffer(info);
-		device->set_name(*per_tile_shaded_color, "per-tile-shaded-color");
-		per_tile_shaded_depth = device->create_buffer(info);
-		device->set_name(*per_tile_shaded_depth, "per-tile-shaded-depth");
+	tile_buffers.tile_instances = tile_instances;
+
+	info.size = sizeof(TileRasterWork) * limits.max_static_rasterization_states * tile_instances;
+	tile_work_list = device->create_buffer(info);
+	device->set_name(*tile_work_list, "tile-work-list");
 
-		info.size = sizeof(uint8_t) *
-		            Limits::MaxTileInstances *
-		            ImplementationConstants::TileWidth *
-		            ImplementationConstants::TileHeight;
-		per_tile_shaded_coverage = device->create_buffer(info);
-		per_tile_shaded_shaded_alpha = device->create_buffer(info);
-		device->set_name(*per_tile_shaded_coverage, "per-tile-shaded-coverage");
-		device->set_name(*per_tile_shaded_shaded_alpha, "per-tile-shaded-shaded-alpha");
+	info.size = sizeof(uint32_t) *
+	            tile_instances *
+	            ImplementationConstants::TileWidth *
+	            ImplementationConstants::TileHeight;
+	per_tile_shaded_color = device->create_buffer(info);
+	device->set_name(*per_tile_shaded_color, "per-tile-shaded-color");
+	per_tile_shaded_depth = device->create_buffer(info);
+	device->set_name(*per_tile_shaded_depth, "per-tile-shaded-depth");
+
+	info.size = sizeof(uint8_t) *
+	            tile_instances *
+	            ImplementationConstants::TileWidth *
+	            ImplementationConstants::TileHeight;
+	per_tile_shaded_coverage = device->create_buffer(info);
+	per_tile_shaded_shaded_alpha = device->create_buffer(info);
+	device->set_name(*per_tile_shaded_coverage, "per-tile-shaded-coverage");
+	device->set_name(*per_tile_shaded_shaded_alpha, "per-tile-shaded-shaded-alpha");
+}
+
+void Renderer::ensure_tile_buffers(unsigned fb_width, unsigned fb_height)
+{
+	auto &tb = tile_buffers;
+
+	// The binning width is the tile stride specialization constant, so it is rounded up further
+	// than strictly needed to keep the number of pipeline variants down.
+	unsigned width = (fb_width + ImplementationConstants::TileBufferWidthAlignment - 1) &
+	                 ~(ImplementationConstants::TileBufferWidthAlignment - 1);
+	unsigned height = (fb_height + ImplementationConstants::TileHeightLowres - 1) &
+	                  ~(ImplementationConstants::TileHeightLowres - 1);
+	width = std::min(width, Limits::MaxWidth);
+	height = std::min(height, Limits::MaxHeight);
+
+	// Tile instances are also a specialization constant, so allocate in powers of two.
+	unsigned tile_instances = 0;
+	if (!caps.ubershader)
+	{
+		tile_instances = std::max(Util::next_pow2(stream.max_shaded_tiles), ImplementationConstants::MinTileInstances);
+		tile_instances = std::min(tile_instances, limits.max_tile_instances);
 	}
+
+	tb.high_water_width = std::max(tb.high_water_width, width);
+	tb.high_water_height = std::max(tb.high_water_height, height);
+	tb.high_water_tile_instances = std::max(tb.high_water_tile_instances, tile_instances);
+
+	unsigned target_width = std::max(tb.width, width);
+	unsigned target_height = std::max(tb.height, height);
+	unsigned target_tile_instances = std::max(tb.tile_instances, tile_instances);
+
+	// Periodically release memory when no recent render pass needed more than half of it.
+	if (++tb.render_passes >= ImplementationConstants::TileBufferShrinkInterval)
+	{
+		if (2 * tb.high_water_width * tb.high_water_height <= target_width * target_height)
+		{
+			target_width = tb.high_water_width;
+			target_height = tb.high_water_height;
+		}
+
+		if (2 * tb.high_water_tile_instances <= target_tile_instances)
+			target_tile_instances = tb.high_water_tile_instances;
+
+		tb.high_water_width = 0;
+		tb.high_water_height = 0;
+		tb.high_water_tile_instances = 0;
+		tb.render_passes = 0;
+	}
+
+	if (target_width != tb.width || target_height != tb.height)
+		init_binning_buffers(target_width, target_height);
+	if (target_tile_instances != tb.tile_instances)
+		init_tile_instance_buffers(target_tile_instances);
+}
+
+void Renderer::init_span_setups(unsigned index)
+{
+	Vulkan::BufferCreateInfo info = {};
+	info.size = limits.max_span_setups * sizeof(SpanSetup);
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	info.domain = Vulkan::BufferDomain::Device;
+	info.misc = Vulkan::BUFFER_MISC_ZERO_INITIALIZE_BIT;
+	span_setups[index] = device->create_buffer(info);
+	device->set_name(*span_setups[index], "span-setups");
 }
 
 void Renderer::init_blender_lut()
@@ -431,30 +578,30 @@ void Renderer::message(const std::string &tag, uint32_t code, uint32_t x, uint32
 }
 
 void Renderer::RenderBuffers::init(Vulkan::Device &device, Vulkan::BufferDomain domain,
-                                   RenderBuffers *borrow)
+                                   const RendererLimits &limits, RenderBuffers *borrow)
 {
 	triangle_setup = create_buffer(device, domain,
-	                               sizeof(TriangleSetup) * Limits::MaxPrimitives,
+	                               sizeof(TriangleSetup) * limits.max_primitives,
 	                               borrow ? &borrow->triangle_setup : nullptr);
 	device.set_name(*triangle_setup.buffer, "triangle-setup");
 
 	attribute_setup = create_buffer(device, domain,
-	                                sizeof(AttributeSetup) * Limits::MaxPrimitives,
+	                                sizeof(AttributeSetup) * limits.max_primitives,
 	                                borrow ? &borrow->attribute_setup: nullptr);
 	device.set_name(*attribute_setup.buffer, "attribute-setup");
 
 	derived_setup = create_buffer(device, domain,
-	                              sizeof(DerivedSetup) * Limits::MaxPrimitives,
+	                              sizeof(DerivedSetup) * limits.max_primitives,
 	                              borrow ? &borrow->derived_setup : nullptr);
 	device.set_name(*derived_setup.buffer, "derived-setup");
 
 	scissor_setup = create_buffer(device, domain,
-	                              sizeof(ScissorState) * Limits::MaxPrimitives,
+	                              sizeof(ScissorState) * limits.max_primitives,
 	                              borrow ? &borrow->scissor_setup : nullptr);
 	device.set_name(*scissor_setup.buffer, "scissor-state");
 
 	static_raster_state = create_buffer(device, domain,
-	                                    sizeof(StaticRasterizationState) * Limits::MaxStaticRasterizationStates,
+	                                    sizeof(StaticRasterizationState) * limits.max_static_rasterization_states,
 	                                    borrow ? &borrow->static_raster_state : nullptr);
 	device.set_name(*static_raster_state.buffer, "static-raster-state");
 
@@ -469,17 +616,17 @@ void Renderer::RenderBuffers::init(Vulkan::Device &device, Vulkan::BufferDomain
 	device.set_name(*tile_info_state.buffer, "tile-info-state");
 
 	state_indices = create_buffer(device, domain,
-	                              sizeof(InstanceIndices) * Limits::MaxPrimitives,
+	                              sizeof(InstanceIndices) * limits.max_primitives,
 	                              borrow ? &borrow->state_indices : nullptr);
 	device.set_name(*state_indices.buffer, "state-indices");
 
 	span_info_offsets = create_buffer(device, domain,
-	                                  sizeof(SpanInfoOffsets) * Limits::MaxPrimitives,
+	                                  sizeof(SpanInfoOffsets) * limits.max_primitives,
 	                                  borrow ? &borrow->span_info_offsets : nullptr);
 	device.set_name(*span_info_offsets.buffer, "span-info-offsets");
 
 	span_info_jobs = create_buffer(device, domain,
-	                               sizeof(SpanInterpolationJob) * Limits::MaxSpanSetups,
+	                               sizeof(SpanInterpolationJob) * limits.max_span_setups,
 	                               borrow ? &borrow->span_info_jobs : nullptr);
 	device.set_name(*span_info_jobs.buffer, "span-info-jobs");
 
@@ -523,10 +670,31 @@ Renderer::MappedBuffer Renderer::RenderBuffers::create_buffer(
 	return buffer;
 }
 
-void Renderer::RenderBuffersUpdater::init(Vulkan::Device &device)
+VkDeviceSize Renderer::RenderBuffers::get_memory_size() const
+{
+	VkDeviceSize size = 0;
+	for (auto *buffer : { &triangle_setup, &attribute_setup, &derived_setup, &scissor_setup,
+	                      &static_raster_state, &depth_blend_state, &tile_info_state,
+	                      &state_indices, &span_info_offsets, &span_info_jobs })
+	{
+		size += buffer->buffer->get_create_info().size;
+	}
+	return size;
+}
+
+void Renderer::RenderBuffersUpdater::init(Vulkan::Device &device, const RendererLimits &limits)
+{
+	gpu.init(device, Vulkan::BufferDomain::LinkedDeviceHostPreferDevice, limits, nullptr);
+	cpu.init(device, Vulkan::BufferDomain::Host, limits, &gpu);
+}
+
+VkDeviceSize Renderer::RenderBuffersUpdater::get_memory_size() const
 {
-	gpu.init(device, Vulkan::BufferDomain::LinkedDeviceHostPreferDevice, nullptr);
-	cpu.init(device, Vulkan::BufferDomain::Host, &gpu);
+	VkDeviceSize size = gpu.get_memory_size();
+	// The CPU buffers borrow the GPU buffers when those are host visible.
+	if (cpu.triangle_setup.buffer != gpu.triangle_setup.buffer)
+		size += cpu.get_memory_size();
+	return size;
 }
 
 void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t offset, size_t size, bool coherent)
@@ -554,28 +722,27 @@ void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t off
 
 		const auto div_round_up = [](size_t a, size_t b) -> size_t { return (a + b - 1) / b; };
 
-		if (!rdram->get_allocation().is_host_allocation())
-		{
-			// If we cannot map RDRAM, we need a staging readback buffer.
-			Vulkan::BufferCreateInfo readback_info = {};
-			readback_info.domain = Vulkan::BufferDomain::CachedCoherentHostPreferCached;
-			readback_info.size = rdram_size * Limits::NumSyncStates;
-			readback_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-			incoherent.staging_readback = device->create_buffer(readback_info);
-			device->set_name(*incoherent.staging_readback, "staging-readback");
-			incoherent.staging_readback_pages = div_round_up(readback_info.size, ImplementationConstants::IncoherentPageSize);
-		}
+		// If we cannot map RDRAM, every buffer instance needs a staging readback buffer.
+		incoherent.use_staging_readback = !rdram->get_allocation().is_host_allocation();
+		for (auto &sync : internal_sync)
+			init_staging_readback(sync);
 
 		incoherent.page_to_direct_copy.clear();
 		incoherent.page_to_masked_copy.clear();
 		incoherent.page_to_pending_readback.clear();
+		incoherent.page_to_clear_write_mask.clear();
+		incoherent.page_write_mask_dirty.clear();
 
-		auto packed_pages = div_round_up(size, ImplementationConstants::IncoherentPageSize * 32);
-		incoherent.num_pages = div_round_up(size, ImplementationConstants::IncoherentPageSize);
+		incoherent.page_size = limits.incoherent_page_size;
+		incoherent.mask_page_size = incoherent.page_size / 8;
+		auto packed_pages = div_round_up(size, incoherent.page_size * 32);
+		incoherent.num_pages = div_round_up(size, incoherent.page_size);
 
 		incoherent.page_to_direct_copy.resize(packed_pages);
 		incoherent.page_to_masked_copy.resize(packed_pages);
 		incoherent.page_to_pending_readback.resize(packed_pages);
+		incoherent.page_to_clear_write_mask.resize(packed_pages);
+		incoherent.page_write_mask_dirty.resize(packed_pages);
 		incoherent.pending_writes_for_page.reset(new std::atomic_uint32_t[incoherent.num_pages]);
 		for (unsigned i = 0; i < incoherent.num_pages; i++)
 			incoherent.pending_writes_for_page[i].store(0);
@@ -583,9 +750,60 @@ void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t off
 	else
 	{
 		incoherent = {};
+		for (auto &sync : internal_sync)
+			init_staging_readback(sync);
 	}
 }
 
+void Renderer::init_staging_readback(InternalSynchronization &sync)
+{
+	if (!incoherent.use_staging_readback)
+	{
+		sync.staging_readback.reset();
+		return;
+	}
+
+	// Same layout as RDRAM, so pages and their write masks land at the offsets they were read from.
+	Vulkan::BufferCreateInfo readback_info = {};
+	readback_info.domain = Vulkan::BufferDomain::CachedCoherentHostPreferCached;
+	readback_info.size = rdram_size + rdram_size / 8;
+	readback_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	sync.staging_readback = device->create_buffer(readback_info);
+	device->set_name(*sync.staging_readback, "staging-readback");
+}
+
+void Renderer::set_cpu_write_tracking(bool enable)
+{
+	if (is_host_coherent)
+		return;
+
+	incoherent.track_cpu_writes = enable;
+	if (enable)
+	{
+		// The GPU copy starts out stale.
+		size_t packed_pages = incoherent.page_to_direct_copy.size();
+		incoherent.page_cpu_written.reset(new std::atomic_uint32_t[packed_pages]);
+		for (size_t i = 0; i < packed_pages; i++)
+			incoherent.page_cpu_written[i].store(~0u, std::memory_order_relaxed);
+	}
+	else
+		incoherent.page_cpu_written.reset();
+}
+
+void Renderer::notify_cpu_write(uint32_t offset, uint32_t length)
+{
+	if (!incoherent.track_cpu_writes || length == 0)
+		return;
+
+	uint32_t start_page = offset / incoherent.page_size;
+	uint32_t end_page = (offset + length - 1) / incoherent.page_size + 1;
+	end_page = std::min(end_page, incoherent.num_pages);
+
+	// Release, so the written data is visible once the page is seen as written.
+	for (uint32_t page = start_page; page < end_page; page++)
+		incoherent.page_cpu_written[page / 32].fetch_or(1u << (page & 31), std::memory_order_release);
+}
+
 void Renderer::set_hidden_rdram(Vulkan::Buffer *buffer)
 {
 	hidden_rdram = buffer;
@@ -601,6 +819,15 @@ void Renderer::set_tmem(Vulkan::Buffer *buffer)
 void Renderer::flush()
 {
 	flush_queues();
+	// Work outside the renderer, such as VI scanout, expects render passes to be complete.
+	if (last_render_pass.pending)
+	{
+		auto cmd = device->request_command_buffer(Vulkan::CommandBuffer::Type::AsyncCompute);
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+		device->submit(cmd);
+		last_render_pass.pending = false;
+	}
 	device->flush_frame();
 }
 
@@ -616,7 +843,7 @@ Vulkan::Fence Renderer::flush_and_signal()
 void Renderer::set_color_framebuffer(uint32_t addr, uint32_t width, FBFormat fmt)
 {
 	if (fb.addr != addr || fb.width != width || fb.fmt != fmt)
-		flush_queues();
+		begin_framebuffer_segment();
 
 	fb.addr = addr;
 	fb.width = width;
@@ -626,7 +853,7 @@ void Renderer::set_color_framebuffer(uint32_t addr, uint32_t width, FBFormat fmt
 void Renderer::set_depth_framebuffer(uint32_t addr)
 {
 	if (fb.depth_addr != addr)
-		flush_queues();
+		begin_framebuffer_segment();
 
 	fb.depth_addr = addr;
 }
@@ -1345,13 +1572,17 @@ void Renderer::draw_shaded_primitive(const TriangleSetup &setup, const Attribute
 	indices.static_index = stream.static_raster_state_cache.add(normalize_static_state(stream.static_raster_state));
 	indices.depth_blend_index = stream.depth_blend_state_cache.add(stream.depth_blend_state);
 	indices.tile_instance_index = uint8_t(stream.tmem_upload_infos.size());
-	for (unsigned i = 0; i < 8; i++)
-		indices.tile_indices[i] = stream.tile_info_state_cache.add(tiles[i]);
+	if (stream.tile_dirty_mask)
+	{
+		for (unsigned i = 0; i < Limits::MaxNumTiles; i++)
+			if (stream.tile_dirty_mask & (1u << i))
+				stream.tile_indices[i] = uint8_t(stream.tile_info_state_cache.add(tiles[i]));
+		stream.tile_dirty_mask = 0;
+	}
+	memcpy(indices.tile_indices, stream.tile_indices, sizeof(indices.tile_indices));
 	stream.state_indices.add(indices);
 
-	fb.color_write_pending = true;
-	if (stream.depth_blend_state.flags & DEPTH_BLEND_DEPTH_UPDATE_BIT)
-		fb.depth_write_pending = true;
+	update_rows_written(setup);
 
 	if (need_flush())
 		flush_queues();
@@ -1394,6 +1625,48 @@ void Renderer::update_deduced_height(const TriangleSetup &setup)
 	fb.deduced_height = std::max(fb.deduced_height, uint32_t(height));
 }
 
+static void set_row_range(uint32_t *rows, unsigned first, unsigned last)
+{
+	for (unsigned word = first / 32; word <= last / 32; word++)
+	{
+		uint32_t mask = ~0u;
+		if (word == first / 32)
+			mask &= ~0u << (first & 31);
+		if (word == last / 32)
+			mask &= ~0u >> (31 - (last & 31));
+		rows[word] |= mask;
+	}
+}
+
+static bool test_row_range(const uint32_t *rows, unsigned first, unsigned last)
+{
+	for (unsigned word = first / 32; word <= last / 32; word++)
+	{
+		uint32_t mask = ~0u;
+		if (word == first / 32)
+			mask &= ~0u << (first & 31);
+		if (word == last / 32)
+			mask &= ~0u >> (31 - (last & 31));
+		if (rows[word] & mask)
+			return true;
+	}
+	return false;
+}
+
+void Renderer::update_rows_written(const TriangleSetup &setup)
+{
+	int min_active_line = std::max(int(setup.yh), int(stream.scissor_state.ylo)) >> 2;
+	int max_active_line = std::min(setup.yl - 1, int(stream.scissor_state.yhi) - 1) >> 2;
+	min_active_line = std::max(min_active_line, 0);
+	max_active_line = std::min(max_active_line, int(Limits::MaxHeight) - 1);
+	if (max_active_line < min_active_line)
+		return;
+
+	set_row_range(fb.color_rows_written, min_active_line, max_active_line);
+	if (stream.depth_blend_state.flags & DEPTH_BLEND_DEPTH_UPDATE_BIT)
+		set_row_range(fb.depth_rows_written, min_active_line, max_active_line);
+}
+
 bool Renderer::need_flush() const
 {
 	bool cache_full =
@@ -1404,9 +1677,9 @@ bool Renderer::need_flush() const
 	bool triangle_full =
 			stream.triangle_setup.full();
 	bool span_info_full =
-			(stream.span_info_jobs.size() * ImplementationConstants::DefaultWorkgroupSize + Limits::MaxHeight > Limits::MaxSpanSetups);
+			(stream.span_info_jobs.size() * ImplementationConstants::DefaultWorkgroupSize + Limits::MaxHeight > limits.max_span_setups);
 	bool max_shaded_tiles =
-			(stream.max_shaded_tiles + ImplementationConstants::MaxTilesX * ImplementationConstants::MaxTilesY > Limits::MaxTileInstances);
+			(stream.max_shaded_tiles + ImplementationConstants::MaxTilesX * ImplementationConstants::MaxTilesY > limits.max_tile_instances);
 
 #ifdef VULKAN_DEBUG
 	if (cache_full)
@@ -1422,24 +1695,48 @@ bool Renderer::need_flush() const
 	return cache_full || triangle_full || span_info_full || max_shaded_tiles;
 }
 
+template <typename T>
+void Renderer::RenderBuffersUpdater::map(Vulkan::Device &device, const MappedBuffer &cpu, StreamCache<T> &cache)
+{
+	auto size = cpu.buffer->get_create_info().size;
+	cache.set_storage(static_cast<T *>(device.map_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT)),
+	                  unsigned(size / sizeof(T)));
+}
+
+void Renderer::RenderBuffersUpdater::map(Vulkan::Device &device, Renderer::StreamCaches &caches)
+{
+	map(device, cpu.triangle_setup, caches.triangle_setup);
+	map(device, cpu.attribute_setup, caches.attribute_setup);
+	map(device, cpu.derived_setup, caches.derived_setup);
+	map(device, cpu.scissor_setup, caches.scissor_setup);
+	map(device, cpu.state_indices, caches.state_indices);
+	map(device, cpu.span_info_offsets, caches.span_info_offsets);
+	map(device, cpu.span_info_jobs, caches.span_info_jobs);
+}
+
 template <typename Cache>
 void Renderer::RenderBuffersUpdater::upload(Vulkan::CommandBuffer *cmd, Vulkan::Device &device,
                                             const MappedBuffer &gpu, const MappedBuffer &cpu, const Cache &cache)
 {
 	if (!cache.empty())
 	{
-		memcpy(device.map_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT), cache.data(), cache.byte_size());
+		// Stream caches already live in the mapped buffer, only state caches need a copy.
+		void *mapped = device.map_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		if (mapped != cache.data())
+			memcpy(mapped, cache.data(), cache.byte_size());
 		device.unmap_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
 		if (cmd)
 			cmd->copy_buffer(*gpu.buffer, 0, *cpu.buffer, 0, cache.byte_size());
 	}
 }
 
-void Renderer::RenderBuffersUpdater::upload(Vulkan::Device &device, const Renderer::StreamCaches &caches)
+void Renderer::RenderBuffersUpdater::upload(Vulkan::CommandBuffer &render_cmd, Vulkan::Device &device,
+                                            const Renderer::StreamCaches &caches)
 {
-	Vulkan::CommandBufferHandle cmd;
+	// If the GPU cannot read the upload buffers in place, copy them in the render pass command buffer.
+	Vulkan::CommandBuffer *cmd = nullptr;
 	if (!gpu.triangle_setup.is_host)
-		cmd = device.request_command_buffer(Vulkan::CommandBuffer::Type::AsyncCompute);
+		cmd = &render_cmd;
 
 #ifdef UPLOAD_TRANSFER_TIMESTAMPS
 	Vulkan::QueryPoolHandle start_ts, end_ts;
@@ -1447,18 +1744,18 @@ void Renderer::RenderBuffersUpdater::upload(Vulkan::Device &device, const Render
 		start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_TRANSFER_BIT);
 #endif
 
-	upload(cmd.get(), device, gpu.triangle_setup, cpu.triangle_setup, caches.triangle_setup);
-	upload(cmd.get(), device, gpu.attribute_setup, cpu.attribute_setup, caches.attribute_setup);
-	upload(cmd.get(), device, gpu.derived_setup, cpu.derived_setup, caches.derived_setup);
-	upload(cmd.get(), device, gpu.scissor_setup, cpu.scissor_setup, caches.scissor_setup);
+	upload(cmd, device, gpu.triangle_setup, cpu.triangle_setup, caches.triangle_setup);
+	upload(cmd, device, gpu.attribute_setup, cpu.attribute_setup, caches.attribute_setup);
+	upload(cmd, device, gpu.derived_setup, cpu.derived_setup, caches.derived_setup);
+	upload(cmd, device, gpu.scissor_setup, cpu.scissor_setup, caches.scissor_setup);
 
-	upload(cmd.get(), device, gpu.static_raster_state, cpu.static_raster_state, caches.static_raster_state_cache);
-	upload(cmd.get(), device, gpu.depth_blend_state, cpu.depth_blend_state, caches.depth_blend_state_cache);
-	upload(cmd.get(), device, gpu.tile_info_state, cpu.tile_info_state, caches.tile_info_state_cache);
+	upload(cmd, device, gpu.static_raster_state, cpu.static_raster_state, caches.static_raster_state_cache);
+	upload(cmd, device, gpu.depth_blend_state, cpu.depth_blend_state, caches.depth_blend_state_cache);
+	upload(cmd, device, gpu.tile_info_state, cpu.tile_info_state, caches.tile_info_state_cache);
 
-	upload(cmd.get(), device, gpu.state_indices, cpu.state_indices, caches.state_indices);
-	upload(cmd.get(), device, gpu.span_info_offsets, cpu.span_info_offsets, caches.span_info_offsets);
-	upload(cmd.get(), device, gpu.span_info_jobs, cpu.span_info_jobs, caches.span_info_jobs);
+	upload(cmd, device, gpu.state_indices, cpu.state_indices, caches.state_indices);
+	upload(cmd, device, gpu.span_info_offsets, cpu.span_info_offsets, caches.span_info_offsets);
+	upload(cmd, device, gpu.span_info_jobs, cpu.span_info_jobs, caches.span_info_jobs);
 
 #ifdef UPLOAD_TRANSFER_TIMESTAMPS
 	if (cmd)
@@ -1472,21 +1769,25 @@ void Renderer::RenderBuffersUpdater::upload(Vulkan::Device &device, const Render
 	{
 		cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
 		             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
-		device.submit(cmd);
 	}
 }
 
-void Renderer::update_tmem_instances(Vulkan::CommandBuffer &cmd)
+void Renderer::update_tmem_instances(Vulkan::CommandBuffer &cmd, unsigned first_upload, unsigned num_uploads)
 {
+	// The shader writes the TMEM state before the first upload to its instance 0,
+	// which for a later range is the same as the last instance of the previous one.
+	VkDeviceSize instance_offset = VkDeviceSize(first_upload) * 0x1000;
 	cmd.set_storage_buffer(0, 0, *rdram, rdram_offset, rdram_size);
 	cmd.set_storage_buffer(0, 1, *tmem);
-	cmd.set_storage_buffer(0, 2, *tmem_instances);
+	cmd.set_storage_buffer(0, 2, *tmem_instances[scratch_index], instance_offset,
+	                       tmem_instances[scratch_index]->get_create_info().size - instance_offset);
 
-	memcpy(cmd.allocate_typed_constant_data<UploadInfo>(1, 0, stream.tmem_upload_infos.size()),
-	       stream.tmem_upload_infos.data(),
-	       stream.tmem_upload_infos.size() * sizeof(UploadInfo));
+	// A range can be empty, but instance 0 is still needed.
+	memcpy(cmd.allocate_typed_constant_data<UploadInfo>(1, 0, std::max(num_uploads, 1u)),
+	       stream.tmem_upload_infos.data() + first_upload,
+	       num_uploads * sizeof(UploadInfo));
 
-	auto count = uint32_t(stream.tmem_upload_infos.size());
+	auto count = uint32_t(num_uploads);
 
 #ifdef PARALLEL_RDP_SHADER_DIR
 	cmd.set_program("rdp://tmem_update.comp", {{ "DEBUG_ENABLE", debug_channel ? 1 : 0 }});
@@ -1509,7 +1810,7 @@ void Renderer::update_tmem_instances(Vulkan::CommandBuffer &cmd)
 	{
 		end_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 		device->register_time_interval("RDP GPU", std::move(start_ts), std::move(end_ts),
-		                               "tmem-update", std::to_string(stream.tmem_upload_infos.size()));
+		                               "tmem-update", std::to_string(num_uploads));
 	}
 #endif
 }
@@ -1521,7 +1822,7 @@ void Renderer::submit_span_setup_jobs(Vulkan::CommandBuffer &cmd)
 	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
 	cmd.set_storage_buffer(0, 1, *instance.gpu.attribute_setup.buffer);
 	cmd.set_storage_buffer(0, 2, *instance.gpu.scissor_setup.buffer);
-	cmd.set_storage_buffer(0, 3, *span_setups);
+	cmd.set_storage_buffer(0, 3, *span_setups[scratch_index]);
 
 #ifdef PARALLEL_RDP_SHADER_DIR
 	cmd.set_program("rdp://span_setup.comp", {{ "DEBUG_ENABLE", debug_channel ? 1 : 0 }});
@@ -1549,29 +1850,37 @@ void Renderer::submit_span_setup_jobs(Vulkan::CommandBuffer &cmd)
 	cmd.end_region();
 }
 
-void Renderer::submit_tile_binning_prepass(Vulkan::CommandBuffer &cmd)
+template <typename T>
+void Renderer::set_segment_storage_buffer(Vulkan::CommandBuffer &cmd, unsigned set, unsigned binding,
+                                          const MappedBuffer &buffer, const FramebufferSegment &segment)
+{
+	VkDeviceSize offset = VkDeviceSize(segment.first_primitive) * sizeof(T);
+	cmd.set_storage_buffer(set, binding, *buffer.buffer, offset, buffer.buffer->get_create_info().size - offset);
+}
+
+void Renderer::submit_tile_binning_prepass(Vulkan::CommandBuffer &cmd, const FramebufferSegment &segment)
 {
 	cmd.begin_region("tile-binning-prepass");
 	auto &instance = buffer_instances[buffer_instance];
 	cmd.set_storage_buffer(0, 0, *tile_binning_buffer_prepass);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.scissor_setup.buffer);
+	set_segment_storage_buffer<TriangleSetup>(cmd, 0, 1, instance.gpu.triangle_setup, segment);
+	set_segment_storage_buffer<ScissorState>(cmd, 0, 2, instance.gpu.scissor_setup, segment);
 
 	cmd.set_specialization_constant_mask(0x3f);
 	cmd.set_specialization_constant(1, ImplementationConstants::TileWidth);
 	cmd.set_specialization_constant(2, ImplementationConstants::TileHeight);
 	cmd.set_specialization_constant(3, ImplementationConstants::TileLowresDownsample);
-	cmd.set_specialization_constant(4, Limits::MaxPrimitives);
-	cmd.set_specialization_constant(5, Limits::MaxWidth);
+	cmd.set_specialization_constant(4, limits.max_primitives);
+	cmd.set_specialization_constant(5, tile_buffers.width);
 
 	struct PushData
 	{
 		uint32_t width, height;
 		uint32_t num_primitives;
 	} push = {};
-	push.width = fb.width;
-	push.height = fb.deduced_height;
-	push.num_primitives = uint32_t(stream.triangle_setup.size());
+	push.width = segment.width;
+	push.height = segment.deduced_height;
+	push.num_primitives = segment.num_primitives;
 
 	cmd.push_constants(&push, 0, sizeof(push));
 
@@ -1653,25 +1962,25 @@ void Renderer::clear_indirect_buffer(Vulkan::CommandBuffer &cmd)
 
 	cmd.set_storage_buffer(0, 0, *indirect_dispatch_buffer);
 
-	static_assert((Limits::MaxStaticRasterizationStates % ImplementationConstants::DefaultWorkgroupSize) == 0, "MaxStaticRasterizationStates does not align.");
+	assert((limits.max_static_rasterization_states % ImplementationConstants::DefaultWorkgroupSize) == 0);
 	cmd.set_specialization_constant_mask(1);
 	cmd.set_specialization_constant(0, ImplementationConstants::DefaultWorkgroupSize);
-	cmd.dispatch(Limits::MaxStaticRasterizationStates / ImplementationConstants::DefaultWorkgroupSize, 1, 1);
+	cmd.dispatch(limits.max_static_rasterization_states / ImplementationConstants::DefaultWorkgroupSize, 1, 1);
 	cmd.end_region();
 }
 
-void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem)
+void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, const FramebufferSegment &segment)
 {
 	cmd.begin_region("rasterization");
 	auto &instance = buffer_instances[buffer_instance];
 
-	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.attribute_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.derived_setup.buffer);
+	set_segment_storage_buffer<TriangleSetup>(cmd, 0, 0, instance.gpu.triangle_setup, segment);
+	set_segment_storage_buffer<AttributeSetup>(cmd, 0, 1, instance.gpu.attribute_setup, segment);
+	set_segment_storage_buffer<DerivedSetup>(cmd, 0, 2, instance.gpu.derived_setup, segment);
 	cmd.set_storage_buffer(0, 3, *instance.gpu.static_raster_state.buffer);
-	cmd.set_storage_buffer(0, 4, *instance.gpu.state_indices.buffer);
-	cmd.set_storage_buffer(0, 5, *instance.gpu.span_info_offsets.buffer);
-	cmd.set_storage_buffer(0, 6, *span_setups);
+	set_segment_storage_buffer<InstanceIndices>(cmd, 0, 4, instance.gpu.state_indices, segment);
+	set_segment_storage_buffer<SpanInfoOffsets>(cmd, 0, 5, instance.gpu.span_info_offsets, segment);
+	cmd.set_storage_buffer(0, 6, *span_setups[scratch_index]);
 	cmd.set_storage_buffer(0, 7, tmem);
 	cmd.set_storage_buffer(0, 8, *instance.gpu.tile_info_state.buffer);
 
@@ -1681,7 +1990,7 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 	cmd.set_storage_buffer(0, 12, *per_tile_shaded_coverage);
 
 	auto *global_fb_info = cmd.allocate_typed_constant_data<GlobalFBInfo>(2, 0, 1);
-	switch (fb.fmt)
+	switch (segment.fmt)
 	{
 	case FBFormat::I4:
 		global_fb_info->fb_size = 0;
@@ -1709,7 +2018,7 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 		break;
 	}
 
-	global_fb_info->base_primitive_index = base_primitive_index;
+	global_fb_info->base_primitive_index = base_primitive_index + segment.first_primitive;
 
 #ifdef PARALLEL_RDP_SHADER_DIR
 	cmd.set_program("rdp://rasterizer.comp", {
@@ -1732,8 +2041,8 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 	for (size_t i = 0; i < stream.static_raster_state_cache.size(); i++)
 	{
 		cmd.set_storage_buffer(1, 0, *tile_work_list,
-		                       i * sizeof(TileRasterWork) * Limits::MaxTileInstances,
-		                       sizeof(TileRasterWork) * Limits::MaxTileInstances);
+		                       i * sizeof(TileRasterWork) * tile_buffers.tile_instances,
+		                       sizeof(TileRasterWork) * tile_buffers.tile_instances);
 
 		auto &state = stream.static_raster_state_cache.data()[i];
 		cmd.set_specialization_constant(2, state.flags | RASTERIZATION_USE_SPECIALIZATION_CONSTANT_BIT);
@@ -1770,13 +2079,13 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 	cmd.end_region();
 }
 
-void Renderer::submit_tile_binning_complete(Vulkan::CommandBuffer &cmd)
+void Renderer::submit_tile_binning_complete(Vulkan::CommandBuffer &cmd, const FramebufferSegment &segment)
 {
 	cmd.begin_region("tile-binning-complete");
 	auto &instance = buffer_instances[buffer_instance];
-	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.scissor_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.state_indices.buffer);
+	set_segment_storage_buffer<TriangleSetup>(cmd, 0, 0, instance.gpu.triangle_setup, segment);
+	set_segment_storage_buffer<ScissorState>(cmd, 0, 1, instance.gpu.scissor_setup, segment);
+	set_segment_storage_buffer<InstanceIndices>(cmd, 0, 2, instance.gpu.state_indices, segment);
 	cmd.set_storage_buffer(0, 3, *tile_binning_buffer);
 	cmd.set_storage_buffer(0, 4, *tile_binning_buffer_prepass);
 	cmd.set_storage_buffer(0, 5, *tile_binning_buffer_coarse);
@@ -1792,9 +2101,9 @@ void Renderer::submit_tile_binning_complete(Vulkan::CommandBuffer &cmd)
 	cmd.set_specialization_constant(1, ImplementationConstants::TileWidth);
 	cmd.set_specialization_constant(2, ImplementationConstants::TileHeight);
 	cmd.set_specialization_constant(3, ImplementationConstants::TileLowresDownsampleLog2);
-	cmd.set_specialization_constant(4, Limits::MaxPrimitives);
-	cmd.set_specialization_constant(5, Limits::MaxWidth);
-	cmd.set_specialization_constant(6, Limits::MaxTileInstances);
+	cmd.set_specialization_constant(4, limits.max_primitives);
+	cmd.set_specialization_constant(5, tile_buffers.width);
+	cmd.set_specialization_constant(6, tile_buffers.tile_instances);
 
 	struct PushData
 	{
@@ -1802,9 +2111,9 @@ void Renderer::submit_tile_binning_complete(Vulkan::CommandBuffer &cmd)
 		uint32_t num_primitives;
 		uint32_t num_primitives_32;
 	} push = {};
-	push.width = fb.width;
-	push.height = fb.deduced_height;
-	push.num_primitives = uint32_t(stream.triangle_setup.size());
+	push.width = segment.width;
+	push.height = segment.deduced_height;
+	push.num_primitives = segment.num_primitives;
 	push.num_primitives_32 = (push.num_primitives + 31) / 32;
 
 	cmd.push_constants(&push, 0, sizeof(push));
@@ -1873,9 +2182,137 @@ void Renderer::submit_tile_binning_complete(Vulkan::CommandBuffer &cmd)
 	cmd.end_region();
 }
 
+void Renderer::submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, const FramebufferSegment &segment)
+{
+	cmd.begin_region("render-pass");
+	auto &instance = buffer_instances[buffer_instance];
+
+	cmd.set_specialization_constant_mask(0xff);
+	cmd.set_specialization_constant(0, uint32_t(rdram_size));
+	cmd.set_specialization_constant(1, uint32_t(segment.fmt));
+	cmd.set_specialization_constant(2, int(segment.addr == segment.depth_addr));
+	cmd.set_specialization_constant(3, ImplementationConstants::TileWidth);
+	cmd.set_specialization_constant(4, ImplementationConstants::TileHeight);
+	cmd.set_specialization_constant(5, limits.max_primitives);
+	cmd.set_specialization_constant(6, tile_buffers.width);
+	cmd.set_specialization_constant(7, uint32_t(!is_host_coherent));
+
+	cmd.set_storage_buffer(0, 0, *rdram, rdram_offset, is_host_coherent ? rdram_size : (rdram_size + rdram_size / 8));
+	cmd.set_storage_buffer(0, 1, *hidden_rdram);
+	cmd.set_storage_buffer(0, 2, tmem);
+
+	if (!caps.ubershader)
+	{
+		cmd.set_storage_buffer(0, 3, *per_tile_shaded_color);
+		cmd.set_storage_buffer(0, 4, *per_tile_shaded_depth);
+		cmd.set_storage_buffer(0, 5, *per_tile_shaded_shaded_alpha);
+		cmd.set_storage_buffer(0, 6, *per_tile_shaded_coverage);
+		cmd.set_storage_buffer(0, 7, *per_tile_offsets);
+	}
+
+	set_segment_storage_buffer<TriangleSetup>(cmd, 1, 0, instance.gpu.triangle_setup, segment);
+	set_segment_storage_buffer<AttributeSetup>(cmd, 1, 1, instance.gpu.attribute_setup, segment);
+	set_segment_storage_buffer<DerivedSetup>(cmd, 1, 2, instance.gpu.derived_setup, segment);
+	set_segment_storage_buffer<ScissorState>(cmd, 1, 3, instance.gpu.scissor_setup, segment);
+	cmd.set_storage_buffer(1, 4, *instance.gpu.static_raster_state.buffer);
+	cmd.set_storage_buffer(1, 5, *instance.gpu.depth_blend_state.buffer);
+	set_segment_storage_buffer<InstanceIndices>(cmd, 1, 6, instance.gpu.state_indices, segment);
+	cmd.set_storage_buffer(1, 7, *instance.gpu.tile_info_state.buffer);
+	cmd.set_storage_buffer(1, 8, *span_setups[scratch_index]);
+	set_segment_storage_buffer<SpanInfoOffsets>(cmd, 1, 9, instance.gpu.span_info_offsets, segment);
+	cmd.set_buffer_view(1, 10, *blender_divider_buffer);
+	cmd.set_storage_buffer(1, 11, *tile_binning_buffer);
+	cmd.set_storage_buffer(1, 12, *tile_binning_buffer_coarse);
+
+	auto *global_fb_info = cmd.allocate_typed_constant_data<GlobalFBInfo>(2, 0, 1);
+
+	GlobalState push = {};
+	push.fb_width = segment.width;
+	push.fb_height = segment.deduced_height;
+	switch (segment.fmt)
+	{
+	case FBFormat::I4:
+		push.addr_index = segment.addr;
+		global_fb_info->fb_size = 0;
+		global_fb_info->dx_mask = 0;
+		global_fb_info->dx_shift = 0;
+		break;
+
+	case FBFormat::I8:
+		push.addr_index = segment.addr;
+		global_fb_info->fb_size = 1;
+		global_fb_info->dx_mask = ~7u;
+		global_fb_info->dx_shift = 3;
+		break;
+
+	case FBFormat::RGBA5551:
+	case FBFormat::IA88:
+		push.addr_index = segment.addr >> 1u;
+		global_fb_info->fb_size = 2;
+		global_fb_info->dx_mask = ~3u;
+		global_fb_info->dx_shift = 2;
+		break;
+
+	case FBFormat::RGBA8888:
+		push.addr_index = segment.addr >> 2u;
+		global_fb_info->fb_size = 4;
+		global_fb_info->dx_mask = ~1u;
+		global_fb_info->dx_shift = 1;
+		break;
+	}
+
+	global_fb_info->base_primitive_index = base_primitive_index + segment.first_primitive;
+
+	push.depth_addr_index = segment.depth_addr >> 1;
+	push.num_primitives_1024 = (segment.num_primitives + 1023) / 1024;
+	cmd.push_constants(&push, 0, sizeof(push));
+
+	if (caps.ubershader)
+	{
+#ifdef PARALLEL_RDP_SHADER_DIR
+		cmd.set_program("rdp://ubershader.comp", {
+			{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
+			{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
+		});
+#else
+		cmd.set_program(shader_bank->ubershader);
+#endif
+	}
+	else
+	{
+#ifdef PARALLEL_RDP_SHADER_DIR
+		cmd.set_program("rdp://depth_blend.comp", {
+			{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
+			{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
+		});
+#else
+		cmd.set_program(shader_bank->depth_blend);
+#endif
+	}
+
+#ifdef FINE_GRAINED_TIMESTAMP
+	Vulkan::QueryPoolHandle start_ts, end_ts;
+	if (caps.timestamp)
+		start_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+#endif
+
+	cmd.dispatch((push.fb_width + 7) / 8, (push.fb_height + 7) / 8, 1);
+
+#ifdef FINE_GRAINED_TIMESTAMP
+	if (caps.timestamp)
+	{
+		end_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+		device->register_time_interval("RDP GPU", std::move(start_ts), std::move(end_ts), "depth-blending");
+	}
+#endif
+
+	cmd.end_region();
+}
+
 void Renderer::submit_render_pass()
 {
-	bool need_render_pass = fb.width != 0 && fb.deduced_height != 0 && !stream.triangle_setup.empty();
+	auto &segments = stream.framebuffer_segments;
+	bool need_render_pass = !segments.empty();
 	bool need_tmem_upload = !stream.tmem_upload_infos.empty();
 	bool need_submit = need_render_pass || need_tmem_upload;
 	if (!need_submit)
@@ -1887,29 +2324,103 @@ void Renderer::submit_render_pass()
 	if (caps.timestamp)
 		render_pass_start = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
+	auto &instance = buffer_instances[buffer_instance];
+	instance.upload(*cmd, *device, stream);
+
+	// The last pass may still be running. Unless this pass reads what it writes,
+	// only swap the scratch buffers both passes write early on, so the two can overlap.
+	if (render_pass_depends_on_previous(need_tmem_upload))
+	{
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	}
+	else if (last_render_pass.pending)
+	{
+		scratch_index ^= 1;
+		if (!span_setups[scratch_index])
+			init_span_setups(scratch_index);
+	}
+	last_render_pass.pending = false;
+
 	if (debug_channel)
 		cmd->begin_debug_channel(this, "Debug", 16 * 1024 * 1024);
 
+	auto &render_tmem = need_tmem_upload ? *tmem_instances[scratch_index] : *tmem;
+
+	// TMEM uploads which read framebuffers drawn earlier in the batch run in later phases, after those segments.
+	auto &splits = stream.tmem_upload_splits;
+	size_t next_split = 0;
+	auto split_end_upload = [&](size_t split) -> unsigned {
+		return split + 1 < splits.size() ? splits[split + 1].first_upload : unsigned(stream.tmem_upload_infos.size());
+	};
+	auto run_tmem_splits = [&](size_t segment_index) {
+		for (bool first = true; next_split < splits.size() && splits[next_split].first_segment <= segment_index; first = false)
+		{
+			if (!first)
+			{
+				cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+				             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			}
+
+			unsigned first_upload = splits[next_split].first_upload;
+			update_tmem_instances(*cmd, first_upload, split_end_upload(next_split) - first_upload);
+			next_split++;
+		}
+	};
+
 	// Here we run 3 dispatches in parallel. Span setup and TMEM instances are low occupancy kind of jobs, but the binning
 	// pass should dominate here unless the workload is trivial.
+	// Span setup covers every framebuffer segment at once, the rest runs once per segment.
 	if (need_render_pass)
 	{
+		unsigned max_width = 0;
+		unsigned max_height = 0;
+		for (auto &segment : segments)
+		{
+			max_width = std::max(max_width, segment.width);
+			max_height = std::max(max_height, segment.deduced_height);
+		}
+
+		ensure_tile_buffers(max_width, max_height);
 		submit_span_setup_jobs(*cmd);
-		submit_tile_binning_prepass(*cmd);
+		submit_tile_binning_prepass(*cmd, segments.front());
 		if (!caps.ubershader)
 			clear_indirect_buffer(*cmd);
 	}
 
 	if (need_tmem_upload)
-		update_tmem_instances(*cmd);
+		update_tmem_instances(*cmd, 0, splits.empty() ? unsigned(stream.tmem_upload_infos.size()) : splits.front().first_upload);
 
 	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
 	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
 
-	if (need_render_pass)
+	for (size_t i = 0; i < segments.size(); i++)
 	{
-		submit_tile_binning_complete(*cmd);
+		auto &segment = segments[i];
+
+		// Binning state is shared, and segments may alias each other in RDRAM, so wait for the previous segment.
+		if (i != 0 || (next_split < splits.size() && splits[next_split].first_segment == 0))
+		{
+			cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+			             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+			run_tmem_splits(i);
+			if (i != 0)
+			{
+				submit_tile_binning_prepass(*cmd, segment);
+				if (!caps.ubershader)
+					clear_indirect_buffer(*cmd);
+			}
+
+			cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+			             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+		}
+
+		submit_tile_binning_complete(*cmd, segment);
 
 		if (caps.ubershader)
 		{
@@ -1922,156 +2433,63 @@ void Renderer::submit_render_pass()
 			             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
 			             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
-			submit_rasterization(*cmd, need_tmem_upload ? *tmem_instances : *tmem);
+			submit_rasterization(*cmd, render_tmem, segment);
 
 			cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
 			             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
 		}
+
+		submit_depth_blend(*cmd, render_tmem, segment);
 	}
 
-	auto &sync = internal_sync[buffer_instance];
-	if (need_render_pass)
+	// Uploads after the last segment still have to land in TMEM.
+	bool trailing_tmem_update = next_split < splits.size();
+	if (trailing_tmem_update)
 	{
-		cmd->begin_region("render-pass");
-		auto &instance = buffer_instances[buffer_instance];
-
-		cmd->set_specialization_constant_mask(0xff);
-		cmd->set_specialization_constant(0, uint32_t(rdram_size));
-		cmd->set_specialization_constant(1, uint32_t(fb.fmt));
-		cmd->set_specialization_constant(2, int(fb.addr == fb.depth_addr));
-		cmd->set_specialization_constant(3, ImplementationConstants::TileWidth);
-		cmd->set_specialization_constant(4, ImplementationConstants::TileHeight);
-		cmd->set_specialization_constant(5, Limits::MaxPrimitives);
-		cmd->set_specialization_constant(6, Limits::MaxWidth);
-		cmd->set_specialization_constant(7, uint32_t(!is_host_coherent));
-
-		cmd->set_storage_buffer(0, 0, *rdram, rdram_offset, rdram_size * (is_host_coherent ? 1 : 2));
-		cmd->set_storage_buffer(0, 1, *hidden_rdram);
-		cmd->set_storage_buffer(0, 2, need_tmem_upload ? *tmem_instances : *tmem);
-
-		if (!caps.ubershader)
-		{
-			cmd->set_storage_buffer(0, 3, *per_tile_shaded_color);
-			cmd->set_storage_buffer(0, 4, *per_tile_shaded_depth);
-			cmd->set_storage_buffer(0, 5, *per_tile_shaded_shaded_alpha);
-			cmd->set_storage_buffer(0, 6, *per_tile_shaded_coverage);
-			cmd->set_storage_buffer(0, 7, *per_tile_offsets);
-		}
-
-		cmd->set_storage_buffer(1, 0, *instance.gpu.triangle_setup.buffer);
-		cmd->set_storage_buffer(1, 1, *instance.gpu.attribute_setup.buffer);
-		cmd->set_storage_buffer(1, 2, *instance.gpu.derived_setup.buffer);
-		cmd->set_storage_buffer(1, 3, *instance.gpu.scissor_setup.buffer);
-		cmd->set_storage_buffer(1, 4, *instance.gpu.static_raster_state.buffer);
-		cmd->set_storage_buffer(1, 5, *instance.gpu.depth_blend_state.buffer);
-		cmd->set_storage_buffer(1, 6, *instance.gpu.state_indices.buffer);
-		cmd->set_storage_buffer(1, 7, *instance.gpu.tile_info_state.buffer);
-		cmd->set_storage_buffer(1, 8, *span_setups);
-		cmd->set_storage_buffer(1, 9, *instance.gpu.span_info_offsets.buffer);
-		cmd->set_buffer_view(1, 10, *blender_divider_buffer);
-		cmd->set_storage_buffer(1, 11, *tile_binning_buffer);
-		cmd->set_storage_buffer(1, 12, *tile_binning_buffer_coarse);
-
-		auto *global_fb_info = cmd->allocate_typed_constant_data<GlobalFBInfo>(2, 0, 1);
-
-		GlobalState push = {};
-		push.fb_width = fb.width;
-		push.fb_height = fb.deduced_height;
-		switch (fb.fmt)
-		{
-		case FBFormat::I4:
-			push.addr_index = fb.addr;
-			global_fb_info->fb_size = 0;
-			global_fb_info->dx_mask = 0;
-			global_fb_info->dx_shift = 0;
-			break;
-
-		case FBFormat::I8:
-			push.addr_index = fb.addr;
-			global_fb_info->fb_size = 1;
-			global_fb_info->dx_mask = ~7u;
-			global_fb_info->dx_shift = 3;
-			break;
-
-		case FBFormat::RGBA5551:
-		case FBFormat::IA88:
-			push.addr_index = fb.addr >> 1u;
-			global_fb_info->fb_size = 2;
-			global_fb_info->dx_mask = ~3u;
-			global_fb_info->dx_shift = 2;
-			break;
-
-		case FBFormat::RGBA8888:
-			push.addr_index = fb.addr >> 2u;
-			global_fb_info->fb_size = 4;
-			global_fb_info->dx_mask = ~1u;
-			global_fb_info->dx_shift = 1;
-			break;
-		}
-
-		global_fb_info->base_primitive_index = base_primitive_index;
-
-		push.depth_addr_index = fb.depth_addr >> 1;
-		push.num_primitives_1024 = (uint32_t(stream.triangle_setup.size()) + 1023) / 1024;
-		cmd->push_constants(&push, 0, sizeof(push));
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+		run_tmem_splits(segments.size());
+	}
 
-		if (caps.ubershader)
-		{
-#ifdef PARALLEL_RDP_SHADER_DIR
-			cmd->set_program("rdp://ubershader.comp", {
-				{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
-				{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
-			});
-#else
-			cmd->set_program(shader_bank->ubershader);
-#endif
-		}
-		else
-		{
-#ifdef PARALLEL_RDP_SHADER_DIR
-			cmd->set_program("rdp://depth_blend.comp", {
-				{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
-				{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
-			});
-#else
-			cmd->set_program(shader_bank->depth_blend);
-#endif
-		}
+	if (need_render_pass)
+		base_primitive_index += uint32_t(stream.triangle_setup.size());
 
-#ifdef FINE_GRAINED_TIMESTAMP
-		Vulkan::QueryPoolHandle start_ts, end_ts;
-		if (caps.timestamp)
-			start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-#endif
+	auto &sync = internal_sync[buffer_instance];
+	bool need_host_barrier = is_host_coherent || !incoherent.use_staging_readback;
 
-		cmd->dispatch((push.fb_width + 7) / 8, (push.fb_height + 7) / 8, 1);
+	if (is_host_coherent && need_render_pass)
+	{
+		// Only the host needs to wait here. The next render pass decides whether it has to wait for this one.
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
 
-#ifdef FINE_GRAINED_TIMESTAMP
-		if (caps.timestamp)
+		last_render_pass.pending = true;
+		last_render_pass.reads_tmem = !need_tmem_upload || trailing_tmem_update;
+		last_render_pass.writes.clear();
+		for (auto &segment : segments)
 		{
-			end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-			device->register_time_interval("RDP GPU", std::move(start_ts), std::move(end_ts), "depth-blending");
+			last_render_pass.writes.push_back({ segment.addr, segment.addr + get_byte_size_for_color_framebuffer(segment) });
+			last_render_pass.writes.push_back({ segment.depth_addr, segment.depth_addr + get_byte_size_for_depth_framebuffer(segment) });
 		}
-#endif
-
-		cmd->end_region();
-
-		base_primitive_index += uint32_t(stream.triangle_setup.size());
 	}
-
-	bool need_host_barrier = is_host_coherent || !incoherent.staging_readback;
-
-	cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
-	             (need_host_barrier ? VK_PIPELINE_STAGE_HOST_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT),
-	             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT |
-	             (need_host_barrier ? VK_ACCESS_HOST_READ_BIT : VK_ACCESS_TRANSFER_READ_BIT));
+	else
+	{
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+		             (need_host_barrier ? VK_PIPELINE_STAGE_HOST_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT),
+		             VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT |
+		             (need_host_barrier ? VK_ACCESS_HOST_READ_BIT : VK_ACCESS_TRANSFER_READ_BIT));
+	}
 
 	if (caps.timestamp)
 	{
 		render_pass_end = cmd->write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 		std::string tag;
-		tag = "(" + std::to_string(fb.width) + " x " + std::to_string(fb.deduced_height) + ")";
+		if (segments.size() > 1)
+			tag = "(" + std::to_string(segments.size()) + " framebuffers)";
+		else if (need_render_pass)
+			tag = "(" + std::to_string(segments.front().width) + " x " + std::to_string(segments.front().deduced_height) + ")";
 		tag += " (" + std::to_string(stream.triangle_setup.size()) + " triangles)";
 		device->register_time_interval("RDP GPU", std::move(render_pass_start), std::move(render_pass_end), "render-pass", std::move(tag));
 	}
@@ -2093,15 +2511,48 @@ void Renderer::submit_render_pass()
 		{
 			op.fence = fence;
 			if (!op.copies.empty())
-				processor.enqueue_coherency_operation(std::move(op));
+				sync.readback_index = processor.enqueue_coherency_operation(std::move(op));
 		}
 		sync.complete.fence = std::move(fence);
 	}
 }
 
+bool Renderer::render_pass_depends_on_previous(bool need_tmem_upload) const
+{
+	// Everything but TMEM updates runs after a full barrier, and only touches RDRAM after that.
+	if (!last_render_pass.pending || !need_tmem_upload)
+		return false;
+
+	// TMEM updates write the TMEM buffer, which the last pass reads directly if it had no uploads of its own.
+	if (last_render_pass.reads_tmem)
+		return true;
+
+	auto overlaps = [](const RDRAMRange &a, const RDRAMRange &b) {
+		return a.begin < b.end && b.begin < a.end;
+	};
+
+	for (auto &upload : stream.tmem_upload_infos)
+	{
+		// Conservative estimate of the RDRAM which is read, with some slack for 64-bit alignment.
+		unsigned shift = upload.vram_size > 1 ? unsigned(upload.vram_size - 1) : 0u;
+		uint32_t pixels = uint32_t(std::max(upload.height - 1, 0)) * uint32_t(upload.vram_width) +
+		                  uint32_t(upload.vram_effective_width);
+		RDRAMRange range = { uint32_t(upload.vram_addr) & ~7u, uint32_t(upload.vram_addr) + (pixels << shift) + 8 };
+
+		// RDRAM addressing wraps, just assume a dependency.
+		if (range.end > rdram_size)
+			return true;
+		for (auto &write : last_render_pass.writes)
+			if (overlaps(range, write))
+				return true;
+	}
+
+	return false;
+}
+
 void Renderer::begin_new_context()
 {
-	buffer_instance = (buffer_instance + 1) % Limits::NumSyncStates;
+	buffer_instance = (buffer_instance + 1) % unsigned(buffer_instances.size());
 	stream.scissor_setup.reset();
 	stream.static_raster_state_cache.reset();
 	stream.depth_blend_state_cache.reset();
@@ -2113,40 +2564,47 @@ void Renderer::begin_new_context()
 	stream.span_info_offsets.reset();
 	stream.span_info_jobs.reset();
 	stream.max_shaded_tiles = 0;
+	stream.tile_dirty_mask = ~0u;
+
+	stream.framebuffer_segments.clear();
+	stream.tmem_upload_splits.clear();
+	stream.framebuffer_changes = 0;
 
 	fb.deduced_height = 0;
-	fb.color_write_pending = false;
-	fb.depth_write_pending = false;
+	memset(fb.color_rows_written, 0, sizeof(fb.color_rows_written));
+	memset(fb.depth_rows_written, 0, sizeof(fb.depth_rows_written));
+	fb.first_primitive = 0;
+	fb.num_primitives = 0;
 
 	stream.tmem_upload_infos.clear();
+
+	begin_buffer_instance();
 }
 
-uint32_t Renderer::get_byte_size_for_bound_color_framebuffer() const
+uint32_t Renderer::get_stride_for_color_framebuffer(const FramebufferSegment &segment)
 {
-	unsigned pixel_count = fb.width * fb.deduced_height;
-	unsigned byte_count;
-	switch (fb.fmt)
+	switch (segment.fmt)
 	{
 	case FBFormat::RGBA8888:
-		byte_count = pixel_count * 4;
-		break;
+		return segment.width * 4;
 
 	case FBFormat::RGBA5551:
 	case FBFormat::IA88:
-		byte_count = pixel_count * 2;
-		break;
+		return segment.width * 2;
 
 	default:
-		byte_count = pixel_count;
-		break;
+		return segment.width;
 	}
+}
 
-	return byte_count;
+uint32_t Renderer::get_byte_size_for_color_framebuffer(const FramebufferSegment &segment)
+{
+	return get_stride_for_color_framebuffer(segment) * segment.deduced_height;
 }
 
-uint32_t Renderer::get_byte_size_for_bound_depth_framebuffer() const
+uint32_t Renderer::get_byte_size_for_depth_framebuffer(const FramebufferSegment &segment)
 {
-	return fb.width * fb.deduced_height * 2;
+	return segment.width * segment.deduced_height * 2;
 }
 
 void Renderer::mark_pages_for_gpu_read(uint32_t base_addr, uint32_t byte_count)
@@ -2154,21 +2612,41 @@ void Renderer::mark_pages_for_gpu_read(uint32_t base_addr, uint32_t byte_count)
 	if (byte_count == 0)
 		return;
 
-	uint32_t start_page = base_addr / ImplementationConstants::IncoherentPageSize;
-	uint32_t end_page = (base_addr + byte_count - 1) / ImplementationConstants::IncoherentPageSize + 1;
+	uint32_t start_page = base_addr / incoherent.page_size;
+	uint32_t end_page = (base_addr + byte_count - 1) / incoherent.page_size + 1;
 	start_page &= incoherent.num_pages - 1;
 	end_page &= incoherent.num_pages - 1;
 
 	uint32_t page = start_page;
 	while (page != end_page)
 	{
+		uint32_t mask = 1u << (page & 31);
+
+		// The GPU copy of a page is current unless the CPU wrote to it since it was last uploaded.
+		// The page is copied after the flag is cleared, so a concurrent write at worst uploads it again later.
+		bool cpu_written = !incoherent.track_cpu_writes ||
+		                   (incoherent.page_cpu_written[page / 32].fetch_and(~mask, std::memory_order_acquire) & mask) != 0;
+
 		bool pending_writes = incoherent.pending_writes_for_page[page].load(std::memory_order_relaxed) != 0;
 
-		// We'll do an acquire memory barrier later before we start memcpy-ing from host memory.
-		if (pending_writes)
-			incoherent.page_to_masked_copy[page / 32] |= 1u << (page & 31);
-		else
-			incoherent.page_to_direct_copy[page / 32] |= 1u << (page & 31);
+		if (cpu_written)
+		{
+			// We'll do an acquire memory barrier later before we start memcpy-ing from host memory.
+			if (pending_writes)
+				incoherent.page_to_masked_copy[page / 32] |= mask;
+			else
+			{
+				incoherent.page_to_direct_copy[page / 32] |= mask;
+				incoherent.page_write_mask_dirty[page / 32] &= ~mask;
+			}
+		}
+		else if (!pending_writes && (incoherent.page_write_mask_dirty[page / 32] & mask) != 0)
+		{
+			// Earlier GPU writes are merged, so their mask must not survive into the next readback,
+			// or it would overwrite CPU writes made after this point.
+			incoherent.page_to_clear_write_mask[page / 32] |= mask;
+			incoherent.page_write_mask_dirty[page / 32] &= ~mask;
+		}
 
 		page = (page + 1) & (incoherent.num_pages - 1);
 	}
@@ -2179,19 +2657,36 @@ void Renderer::lock_pages_for_gpu_write(uint32_t base_addr, uint32_t byte_count)
 	if (byte_count == 0)
 		return;
 
-	uint32_t start_page = base_addr / ImplementationConstants::IncoherentPageSize;
-	uint32_t end_page = (base_addr + byte_count - 1) / ImplementationConstants::IncoherentPageSize + 1;
+	uint32_t start_page = base_addr / incoherent.page_size;
+	uint32_t end_page = (base_addr + byte_count - 1) / incoherent.page_size + 1;
 
 	for (uint32_t page = start_page; page < end_page; page++)
 	{
 		uint32_t wrapped_page = page & (incoherent.num_pages - 1);
 		incoherent.page_to_pending_readback[wrapped_page / 32] |= 1u << (wrapped_page & 31);
+		incoherent.page_write_mask_dirty[wrapped_page / 32] |= 1u << (wrapped_page & 31);
+	}
+}
+
+void Renderer::lock_rows_for_gpu_write(const uint32_t *rows_written, uint32_t base_addr, uint32_t stride, uint32_t height)
+{
+	// Depth-blend only stores pixels covered by primitives,
+	// so only pages holding rows which primitives touch have to be read back.
+	for (unsigned word = 0; word < (height + 31) / 32; word++)
+	{
+		Util::for_each_bit_range(rows_written[word], [&](unsigned row, unsigned count) {
+			row += 32 * word;
+			if (row >= height)
+				return;
+			count = std::min(count, height - row);
+			lock_pages_for_gpu_write(base_addr + row * stride, count * stride);
+		});
 	}
 }
 
 void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::CommandBuffer &cmd)
 {
-	if (!incoherent.staging_readback)
+	if (!incoherent.use_staging_readback)
 	{
 		// iGPU path.
 		op.src = rdram;
@@ -2207,14 +2702,16 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 
 				for (unsigned i = 0; i < count; i++)
 					incoherent.pending_writes_for_page[index + i].fetch_add(1, std::memory_order_relaxed);
+				incoherent.counters.readback_pages += count;
+				incoherent.counters.readback_copies++;
 
 				CoherencyCopy coherent_copy = {};
 				coherent_copy.counter_base = &incoherent.pending_writes_for_page[index];
 				coherent_copy.counters = count;
-				coherent_copy.src_offset = index * ImplementationConstants::IncoherentPageSize;
-				coherent_copy.mask_offset = coherent_copy.src_offset + rdram_size;
-				coherent_copy.dst_offset = index * ImplementationConstants::IncoherentPageSize;
-				coherent_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				coherent_copy.src_offset = index * incoherent.page_size;
+				coherent_copy.mask_offset = index * incoherent.mask_page_size + rdram_size;
+				coherent_copy.dst_offset = index * incoherent.page_size;
+				coherent_copy.size = incoherent.page_size * count;
 				op.copies.push_back(coherent_copy);
 			});
 
@@ -2224,8 +2721,14 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 	else
 	{
 		// Discrete GPU path.
+		// The staging buffer belongs to the current buffer instance.
+		// Its fence has signalled, but the previous readback may still be merging into host RDRAM.
+		auto &sync = internal_sync[buffer_instance];
+		processor.wait_for_readback(sync.readback_index);
+
 		Util::SmallVector<VkBufferCopy, 1024> copies;
-		op.src = incoherent.staging_readback.get();
+		auto &staging_readback = *sync.staging_readback;
+		op.src = &staging_readback;
 		op.dst = incoherent.host_rdram;
 		op.timeline_value = 0;
 
@@ -2238,48 +2741,26 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 
 				for (unsigned i = 0; i < count; i++)
 					incoherent.pending_writes_for_page[index + i].fetch_add(1, std::memory_order_relaxed);
+				incoherent.counters.readback_pages += count;
+				incoherent.counters.readback_copies++;
 
 				VkBufferCopy copy = {};
-				copy.srcOffset = index * ImplementationConstants::IncoherentPageSize;
-
-				unsigned dst_page_index = incoherent.staging_readback_index;
-				copy.dstOffset = dst_page_index * ImplementationConstants::IncoherentPageSize;
-
-				incoherent.staging_readback_index += count;
-				incoherent.staging_readback_index &= (incoherent.staging_readback_pages - 1);
-				// Unclean wraparound check.
-				if (incoherent.staging_readback_index != 0 && incoherent.staging_readback_index < dst_page_index)
-				{
-					copy.dstOffset = 0;
-					incoherent.staging_readback_index = count;
-				}
-
-				copy.size = ImplementationConstants::IncoherentPageSize * count;
+				copy.srcOffset = index * incoherent.page_size;
+				copy.dstOffset = copy.srcOffset;
+				copy.size = incoherent.page_size * count;
 				copies.push_back(copy);
 
 				CoherencyCopy coherent_copy = {};
 				coherent_copy.counter_base = &incoherent.pending_writes_for_page[index];
 				coherent_copy.counters = count;
 				coherent_copy.src_offset = copy.dstOffset;
-				coherent_copy.dst_offset = index * ImplementationConstants::IncoherentPageSize;
-				coherent_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				coherent_copy.dst_offset = index * incoherent.page_size;
+				coherent_copy.size = incoherent.page_size * count;
 
 				VkBufferCopy mask_copy = {};
-				mask_copy.srcOffset = index * ImplementationConstants::IncoherentPageSize + rdram_size;
-
-				dst_page_index = incoherent.staging_readback_index;
-				mask_copy.dstOffset = dst_page_index * ImplementationConstants::IncoherentPageSize;
-
-				incoherent.staging_readback_index += count;
-				incoherent.staging_readback_index &= (incoherent.staging_readback_pages - 1);
-				// Unclean wraparound check.
-				if (incoherent.staging_readback_index != 0 && incoherent.staging_readback_index < dst_page_index)
-				{
-					mask_copy.dstOffset = 0;
-					incoherent.staging_readback_index = count;
-				}
-
-				mask_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				mask_copy.srcOffset = index * incoherent.mask_page_size + rdram_size;
+				mask_copy.size = incoherent.mask_page_size * count;
+				mask_copy.dstOffset = mask_copy.srcOffset;
 				copies.push_back(mask_copy);
 				coherent_copy.mask_offset = mask_copy.dstOffset;
 
@@ -2296,7 +2777,7 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 			Vulkan::QueryPoolHandle start_ts, end_ts;
 			start_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_TRANSFER_BIT);
 #endif
-			cmd.copy_buffer(*incoherent.staging_readback, *rdram, copies.data(), copies.size());
+			cmd.copy_buffer(staging_readback, *rdram, copies.data(), copies.size());
 #ifdef COHERENCY_READBACK_TIMESTAMPS
 			end_ts = cmd.write_timestamp(VK_PIPELINE_STAGE_TRANSFER_BIT);
 			device->register_time_interval(std::move(start_ts), std::move(end_ts), "coherency-readback");
@@ -2340,30 +2821,47 @@ void Renderer::resolve_coherency_host_to_gpu()
 			uint32_t base_index = 32 * (&direct - incoherent.page_to_direct_copy.data());
 			Util::for_each_bit_range(direct, [&](unsigned index, unsigned count) {
 				index += base_index;
+				incoherent.counters.direct_upload_pages += count;
 				auto *mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                                             ImplementationConstants::IncoherentPageSize * index,
-				                                             ImplementationConstants::IncoherentPageSize * count);
+				                                             incoherent.page_size * index,
+				                                             incoherent.page_size * count);
 				memcpy(mapped_rdram,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize * count);
+				       incoherent.host_rdram + incoherent.page_size * index,
+				       incoherent.page_size * count);
 
 				device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                          ImplementationConstants::IncoherentPageSize * index,
-				                          ImplementationConstants::IncoherentPageSize * count);
+				                          incoherent.page_size * index,
+				                          incoherent.page_size * count);
 
 				mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                                       ImplementationConstants::IncoherentPageSize * index + rdram_size,
-				                                       ImplementationConstants::IncoherentPageSize * count);
+				                                       incoherent.mask_page_size * index + rdram_size,
+				                                       incoherent.mask_page_size * count);
 
-				memset(mapped_rdram, 0, ImplementationConstants::IncoherentPageSize * count);
+				memset(mapped_rdram, 0, incoherent.mask_page_size * count);
 
 				device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                          ImplementationConstants::IncoherentPageSize * index + rdram_size,
-				                          ImplementationConstants::IncoherentPageSize * count);
+				                          incoherent.mask_page_size * index + rdram_size,
+				                          incoherent.mask_page_size * count);
 			});
 			direct = 0;
 		}
 
+		for (auto &clear : incoherent.page_to_clear_write_mask)
+		{
+			uint32_t base_index = 32 * (&clear - incoherent.page_to_clear_write_mask.data());
+			Util::for_each_bit_range(clear, [&](unsigned index, unsigned count) {
+				index += base_index;
+				auto *mapped_mask = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+				                                            incoherent.mask_page_size * index + rdram_size,
+				                                            incoherent.mask_page_size * count);
+				memset(mapped_mask, 0, incoherent.mask_page_size * count);
+				device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+				                          incoherent.mask_page_size * index + rdram_size,
+				                          incoherent.mask_page_size * count);
+			});
+			clear = 0;
+		}
+
 		auto *mapped_staging = static_cast<uint8_t *>(device->map_host_buffer(*incoherent.staging_rdram,
 		                                                                      Vulkan::MEMORY_ACCESS_WRITE_BIT));
 
@@ -2373,9 +2871,9 @@ void Renderer::resolve_coherency_host_to_gpu()
 			Util::for_each_bit(indirect, [&](unsigned index) {
 				index += base_index;
 				masked_page_copies.push_back(index);
-				memcpy(mapped_staging + ImplementationConstants::IncoherentPageSize * index,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize);
+				memcpy(mapped_staging + incoherent.page_size * index,
+				       incoherent.host_rdram + incoherent.page_size * index,
+				       incoherent.page_size);
 			});
 			indirect = 0;
 		}
@@ -2400,27 +2898,37 @@ void Renderer::resolve_coherency_host_to_gpu()
 				else
 				{
 					VkBufferCopy copy = {};
-					copy.size = ImplementationConstants::IncoherentPageSize;
-					copy.dstOffset = copy.srcOffset = index * ImplementationConstants::IncoherentPageSize;
+					copy.size = incoherent.page_size;
+					copy.dstOffset = copy.srcOffset = index * incoherent.page_size;
 					buffer_copies.push_back(copy);
 					to_clear_write_mask.push_back(index);
+					incoherent.counters.direct_upload_pages++;
 				}
 
-				memcpy(mapped_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize);
+				memcpy(mapped_rdram + incoherent.page_size * index,
+				       incoherent.host_rdram + incoherent.page_size * index,
+				       incoherent.page_size);
 			});
 
 			incoherent.page_to_masked_copy[i] = 0;
 			incoherent.page_to_direct_copy[i] = 0;
+
+			Util::for_each_bit(incoherent.page_to_clear_write_mask[i], [&](unsigned index) {
+				to_clear_write_mask.push_back(base_index + index);
+			});
+			incoherent.page_to_clear_write_mask[i] = 0;
 		}
 
 		device->unmap_host_buffer(*incoherent.staging_rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT);
 	}
 
+	incoherent.counters.masked_upload_pages += masked_page_copies.size();
+
 	if (!masked_page_copies.empty() || !to_clear_write_mask.empty())
 	{
 		auto cmd = device->request_command_buffer(Vulkan::CommandBuffer::Type::AsyncCompute);
+		// Pages are processed with one workgroup per block of the minimum page size.
+		unsigned blocks_per_page = incoherent.page_size / ImplementationConstants::MinIncoherentPageSize;
 
 		if (!masked_page_copies.empty())
 		{
@@ -2430,12 +2938,12 @@ void Renderer::resolve_coherency_host_to_gpu()
 			cmd->set_program(shader_bank->masked_rdram_resolve);
 #endif
 			cmd->set_specialization_constant_mask(3);
-			cmd->set_specialization_constant(0, ImplementationConstants::IncoherentPageSize / 4);
-			cmd->set_specialization_constant(1, ImplementationConstants::IncoherentPageSize / 4);
+			cmd->set_specialization_constant(0, ImplementationConstants::MinIncoherentPageSize / 4);
+			cmd->set_specialization_constant(1, incoherent.page_size / 4);
 
 			cmd->set_storage_buffer(0, 0, *rdram, rdram_offset, rdram_size);
 			cmd->set_storage_buffer(0, 1, *incoherent.staging_rdram);
-			cmd->set_storage_buffer(0, 2, *rdram, rdram_offset + rdram_size, rdram_size);
+			cmd->set_storage_buffer(0, 2, *rdram, rdram_offset + rdram_size, rdram_size / 8);
 
 //#define COHERENCY_MASK_TIMESTAMPS
 #ifdef COHERENCY_MASK_TIMESTAMPS
@@ -2449,7 +2957,7 @@ void Renderer::resolve_coherency_host_to_gpu()
 				memcpy(cmd->allocate_typed_constant_data<uint32_t>(1, 0, to_copy),
 				       masked_page_copies.data() + i,
 				       to_copy * sizeof(uint32_t));
-				cmd->dispatch(to_copy, 1, 1);
+				cmd->dispatch(to_copy, blocks_per_page, 1);
 			}
 
 #ifdef COHERENCY_MASK_TIMESTAMPS
@@ -2467,16 +2975,16 @@ void Renderer::resolve_coherency_host_to_gpu()
 			cmd->set_program(shader_bank->clear_write_mask);
 #endif
 			cmd->set_specialization_constant_mask(3);
-			cmd->set_specialization_constant(0, ImplementationConstants::IncoherentPageSize / 4);
-			cmd->set_specialization_constant(1, ImplementationConstants::IncoherentPageSize / 4);
-			cmd->set_storage_buffer(0, 0, *rdram, rdram_offset + rdram_size, rdram_size);
+			cmd->set_specialization_constant(0, ImplementationConstants::IncoherentMaskBlockSize / 4);
+			cmd->set_specialization_constant(1, incoherent.mask_page_size / 4);
+			cmd->set_storage_buffer(0, 0, *rdram, rdram_offset + rdram_size, rdram_size / 8);
 			for (size_t i = 0; i < to_clear_write_mask.size(); i += 4096)
 			{
 				size_t to_copy = std::min(to_clear_write_mask.size() - i, size_t(4096));
 				memcpy(cmd->allocate_typed_constant_data<uint32_t>(1, 0, to_copy),
 				       to_clear_write_mask.data() + i,
 				       to_copy * sizeof(uint32_t));
-				cmd->dispatch(to_copy, 1, 1);
+				cmd->dispatch(to_copy, blocks_per_page, 1);
 			}
 		}
 
@@ -2517,26 +3025,122 @@ void Renderer::flush_queues()
 	if (stream.triangle_setup.empty() && stream.tmem_upload_infos.empty())
 		return;
 
+	end_framebuffer_segment();
+
 	if (!is_host_coherent)
 	{
-		mark_pages_for_gpu_read(fb.addr, get_byte_size_for_bound_color_framebuffer());
-		mark_pages_for_gpu_read(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
-
-		// We're going to write to these pages, so lock them down.
-		lock_pages_for_gpu_write(fb.addr, get_byte_size_for_bound_color_framebuffer());
-		lock_pages_for_gpu_write(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
+		for (auto &segment : stream.framebuffer_segments)
+		{
+			mark_pages_for_gpu_read(segment.addr, get_byte_size_for_color_framebuffer(segment));
+			mark_pages_for_gpu_read(segment.depth_addr, get_byte_size_for_depth_framebuffer(segment));
+
+			// We're going to write to these pages, so lock them down.
+			lock_rows_for_gpu_write(segment.color_rows_written, segment.addr,
+			                        get_stride_for_color_framebuffer(segment), segment.deduced_height);
+			lock_rows_for_gpu_write(segment.depth_rows_written, segment.depth_addr,
+			                        segment.width * 2, segment.deduced_height);
+		}
 
 		resolve_coherency_host_to_gpu();
 	}
 
-	auto &instance = buffer_instances[buffer_instance];
+	submit_render_pass();
+	begin_new_context();
+}
+
+void Renderer::end_framebuffer_segment()
+{
+	fb.num_primitives = stream.triangle_setup.size() - fb.first_primitive;
+	if (fb.num_primitives != 0 && fb.width != 0 && fb.deduced_height != 0)
+		stream.framebuffer_segments.push_back(fb);
+}
+
+void Renderer::begin_framebuffer_segment()
+{
+	// Nothing was drawn to the current framebuffer, so it can just be retargeted.
+	if (stream.triangle_setup.size() == fb.first_primitive)
+		return;
+
+	if (stream.framebuffer_changes + 1 >= limits.max_framebuffer_segments || !start_next_framebuffer_segment())
+		flush_queues();
+	else
+		stream.framebuffer_changes++;
+}
+
+void Renderer::split_tmem_uploads()
+{
+	// Incoherent RDRAM is copied to the GPU before the batch, which would overwrite what the batch renders.
+	if (!is_host_coherent ||
+	    (stream.triangle_setup.size() != fb.first_primitive && !start_next_framebuffer_segment()))
+	{
+		flush_queues();
+		return;
+	}
+
+	stream.tmem_upload_splits.push_back({ unsigned(stream.tmem_upload_infos.size()),
+	                                      unsigned(stream.framebuffer_segments.size()) });
+}
+
+bool Renderer::start_next_framebuffer_segment()
+{
+	unsigned first_primitive = (stream.triangle_setup.size() + ImplementationConstants::SegmentPrimitiveAlignment - 1) &
+	                           ~(ImplementationConstants::SegmentPrimitiveAlignment - 1);
+	if (first_primitive >= limits.max_primitives)
+		return false;
+
+	end_framebuffer_segment();
+
+	// Per-primitive data of the next segment starts at an aligned offset.
+	stream.triangle_setup.pad(first_primitive);
+	stream.attribute_setup.pad(first_primitive);
+	stream.derived_setup.pad(first_primitive);
+	stream.scissor_setup.pad(first_primitive);
+	stream.state_indices.pad(first_primitive);
+	stream.span_info_offsets.pad(first_primitive);
+
+	fb.first_primitive = first_primitive;
+	fb.num_primitives = 0;
+	fb.deduced_height = 0;
+	memset(fb.color_rows_written, 0, sizeof(fb.color_rows_written));
+	memset(fb.depth_rows_written, 0, sizeof(fb.depth_rows_written));
+	return true;
+}
+
+void Renderer::add_buffer_instance(unsigned index)
+{
+	RenderBuffersUpdater instance;
+	instance.init(*device, limits);
+	buffer_instance_size = instance.get_memory_size();
+	if (incoherent.use_staging_readback)
+		buffer_instance_size += rdram_size + rdram_size / 8;
+	buffer_instances.insert(buffer_instances.begin() + index, std::move(instance));
+	internal_sync.insert(internal_sync.begin() + index, InternalSynchronization{});
+	init_staging_readback(internal_sync[index]);
+}
+
+void Renderer::begin_buffer_instance()
+{
+	// Stream caches are written straight into the upload buffers of this instance,
+	// so the GPU must be done with them before recording can start.
 	auto &sync = internal_sync[buffer_instance];
-	if (sync.complete.fence)
+	if (sync.complete.fence && !sync.complete.fence->wait_timeout(0) &&
+	    (buffer_instances.size() + 1) * buffer_instance_size <= limits.buffer_instance_memory_budget)
+	{
+		// Rather than stalling, insert a fresh instance here. The busy one becomes the next in line.
+#ifdef VULKAN_DEBUG
+		LOGI("Growing to %u render pass buffer instances.\n", unsigned(buffer_instances.size() + 1));
+#endif
+		add_buffer_instance(buffer_instance);
+	}
+	else if (sync.complete.fence)
 	{
 		Vulkan::QueryPoolHandle start_ts, end_ts;
 		if (caps.timestamp)
 			start_ts = device->write_calibrated_timestamp();
+		auto start_ns = Util::get_current_time_nsecs();
 		sync.complete.fence->wait();
+		buffer_instance_stalls.stall_ns += Util::get_current_time_nsecs() - start_ns;
+		buffer_instance_stalls.waits++;
 		if (caps.timestamp)
 		{
 			end_ts = device->write_calibrated_timestamp();
@@ -2545,15 +3149,13 @@ void Renderer::flush_queues()
 		sync.complete.fence.reset();
 	}
 
-	instance.upload(*device, stream);
-
-	submit_render_pass();
-	begin_new_context();
+	buffer_instances[buffer_instance].map(*device, stream);
 }
 
 void Renderer::set_tile(uint32_t tile, const TileMeta &meta)
 {
 	tiles[tile].meta = meta;
+	stream.tile_dirty_mask |= 1u << tile;
 }
 
 void Renderer::set_tile_size(uint32_t tile, uint32_t slo, uint32_t shi, uint32_t tlo, uint32_t thi)
@@ -2562,61 +3164,72 @@ void Renderer::set_tile_size(uint32_t tile, uint32_t slo, uint32_t shi, uint32_t
 	tiles[tile].size.shi = shi;
 	tiles[tile].size.tlo = tlo;
 	tiles[tile].size.thi = thi;
+	stream.tile_dirty_mask |= 1u << tile;
 }
 
-bool Renderer::tmem_upload_needs_flush(uint32_t addr) const
+bool Renderer::tmem_upload_reads_rows(const uint32_t *rows_written, uint32_t fb_addr, uint32_t stride,
+                                      uint32_t height, uint32_t addr, uint32_t byte_count) const
 {
-	// Not perfect, since TMEM upload could slice into framebuffer,
-	// but I doubt this will be an issue (famous last words ...)
+	uint64_t fb_bytes = uint64_t(stride) * height;
+	uint64_t begin = (addr - fb_addr) & (rdram_size - 1);
+	uint64_t end = begin + byte_count;
 
-	if (fb.color_write_pending)
+	if (begin >= fb_bytes)
 	{
-		uint32_t offset = (addr - fb.addr) & (rdram_size - 1);
-		uint32_t pending_pixels = fb.deduced_height * fb.width;
+		// The upload may still wrap around into the start of the framebuffer.
+		if (end <= rdram_size)
+			return false;
+		begin = 0;
+		end -= rdram_size;
+	}
 
-		switch (fb.fmt)
-		{
-		case FBFormat::RGBA5551:
-		case FBFormat::I8:
-			offset >>= 1;
-			break;
+	end = std::min(end, fb_bytes);
+	if (end <= begin)
+		return false;
 
-		case FBFormat::RGBA8888:
-			offset >>= 2;
-			break;
+	return test_row_range(rows_written, unsigned(begin / stride), unsigned((end - 1) / stride));
+}
 
-		default:
-			break;
-		}
+bool Renderer::tmem_upload_reads_pending_write(const FramebufferSegment &segment, uint32_t addr, uint32_t byte_count) const
+{
+	if (segment.width == 0 || segment.deduced_height == 0)
+		return false;
 
-		if (offset < pending_pixels)
-		{
-			//LOGI("Flushing render pass due to coherent TMEM fetch from color buffer.\n");
-			return true;
-		}
+	if (tmem_upload_reads_rows(segment.color_rows_written, segment.addr,
+	                           get_stride_for_color_framebuffer(segment), segment.deduced_height,
+	                           addr, byte_count))
+	{
+		//LOGI("Flushing render pass due to coherent TMEM fetch from color buffer.\n");
+		return true;
 	}
 
-	if (fb.depth_write_pending)
+	if (tmem_upload_reads_rows(segment.depth_rows_written, segment.depth_addr, segment.width * 2, segment.deduced_height,
+	                           addr, byte_count))
 	{
-		uint32_t offset = (addr - fb.depth_addr) & (rdram_size - 1);
-		uint32_t pending_pixels = fb.deduced_height * fb.width;
-		offset >>= 1;
+		//LOGI("Flushing render pass due to coherent TMEM fetch from depth buffer.\n");
+		return true;
+	}
 
-		if (offset < pending_pixels)
-		{
-			//LOGI("Flushing render pass due to coherent TMEM fetch from depth buffer.\n");
+	return false;
+}
+
+bool Renderer::tmem_upload_needs_split(uint32_t addr, uint32_t byte_count) const
+{
+	// TMEM updates run before the framebuffer segments drawn since the last split are rendered.
+	if (tmem_upload_reads_pending_write(fb, addr, byte_count))
+		return true;
+
+	auto &segments = stream.framebuffer_segments;
+	size_t first_segment = stream.tmem_upload_splits.empty() ? 0 : stream.tmem_upload_splits.back().first_segment;
+	for (size_t i = first_segment; i < segments.size(); i++)
+		if (tmem_upload_reads_pending_write(segments[i], addr, byte_count))
 			return true;
-		}
-	}
 
 	return false;
 }
 
 void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 {
-	if (tmem_upload_needs_flush(info.tex_addr))
-		flush_queues();
-
 	// Detect noop cases.
 	if (info.mode != UploadMode::Block)
 	{
@@ -2634,30 +3247,35 @@ void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 			return;
 	}
 
-	if (!is_host_coherent)
+	// RDRAM range the upload reads from.
+	unsigned pixel_count;
+	unsigned offset_pixels;
+	unsigned base_addr = info.tex_addr;
+
+	if (info.mode == UploadMode::Block)
 	{
-		unsigned pixel_count;
-		unsigned offset_pixels;
-		unsigned base_addr = info.tex_addr;
+		pixel_count = (info.shi - info.slo + 1) & 0xfff;
+		offset_pixels = info.slo + info.tex_width * info.tlo;
+	}
+	else
+	{
+		unsigned max_x = ((info.shi >> 2) - (info.slo >> 2)) & 0xfff;
+		unsigned max_y = (info.thi >> 2) - (info.tlo >> 2);
+		pixel_count = max_y * info.tex_width + max_x + 1;
+		offset_pixels = (info.slo >> 2) + info.tex_width * (info.tlo >> 2);
+	}
 
-		if (info.mode == UploadMode::Block)
-		{
-			pixel_count = (info.shi - info.slo + 1) & 0xfff;
-			offset_pixels = info.slo + info.tex_width * info.tlo;
-		}
-		else
-		{
-			unsigned max_x = ((info.shi >> 2) - (info.slo >> 2)) & 0xfff;
-			unsigned max_y = (info.thi >> 2) - (info.tlo >> 2);
-			pixel_count = max_y * info.tex_width + max_x + 1;
-			offset_pixels = (info.slo >> 2) + info.tex_width * (info.tlo >> 2);
-		}
+	// 4-bit VRAM pointers are rejected later, treat them like 8-bit here.
+	unsigned size_shift = std::max(unsigned(info.size), 1u) - 1;
+	unsigned byte_size = pixel_count << size_shift;
+	byte_size = (byte_size + 7) & ~7;
+	base_addr += offset_pixels << size_shift;
 
-		unsigned byte_size = pixel_count << (unsigned(info.size) - 1);
-		byte_size = (byte_size + 7) & ~7;
-		base_addr += offset_pixels << (unsigned(info.size) - 1);
+	if (tmem_upload_needs_split(base_addr, byte_size))
+		split_tmem_uploads();
+
+	if (!is_host_coherent)
 		mark_pages_for_gpu_read(base_addr, byte_size);
-	}
 
 	if (info.mode == UploadMode::Tile)
 	{
@@ -2715,6 +3333,7 @@ void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 			size.shi = info.shi;
 			size.tlo = info.tlo;
 			size.thi = info.thi;
+			stream.tile_dirty_mask |= 1u << tile;
 		}
 		else
 			load_tile_iteration(tile, info, 0);
@@ -2731,6 +3350,7 @@ void Renderer::load_tile_iteration(uint32_t tile, const LoadTileInfo &info, uint
 	size.shi = info.shi;
 	size.tlo = info.tlo;
 	size.thi = info.thi;
+	stream.tile_dirty_mask |= 1u << tile;
 
 	if (meta.fmt == TextureFormat::YUV && ((meta.size != TextureSize::Bpp16) || (info.size != TextureSize::Bpp16)))
 	{
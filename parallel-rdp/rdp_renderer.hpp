@@ -70,11 +70,18 @@ class Renderer : public Vulkan::DebugChannelInterface
 public:
 	explicit Renderer(CommandProcessor &processor);
 	~Renderer();
+	// Must be called before set_device().
+	void set_limits(const RendererLimits &limits);
+	const RendererLimits &get_limits() const;
 	bool set_device(Vulkan::Device *device);
 
-	// If coherent is false, RDRAM is a buffer split into data in lower half and writemask state in upper half, each part being size large.
+	// If coherent is false, RDRAM is a buffer with size bytes of data, followed by a writemask of size / 8 bytes, one bit per byte.
 	// offset must be 0 in this case.
 	void set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t offset, size_t size, bool coherent);
+	// For incoherent RDRAM. When enabled, only pages reported with notify_cpu_write() are uploaded to the GPU.
+	void set_cpu_write_tracking(bool enable);
+	// Thread-safe, can be called while commands are processed on another thread.
+	void notify_cpu_write(uint32_t offset, uint32_t length);
 	void set_hidden_rdram(Vulkan::Buffer *buffer);
 	void set_tmem(Vulkan::Buffer *buffer);
 	void set_shader_bank(const ShaderBank *bank);
@@ -114,20 +121,38 @@ public:
 private:
 	CommandProcessor &processor;
 	Vulkan::Device *device = nullptr;
+	RendererLimits limits;
 	Vulkan::Buffer *rdram = nullptr;
 
 	struct
 	{
 		uint8_t *host_rdram = nullptr;
 		Vulkan::BufferHandle staging_rdram;
-		Vulkan::BufferHandle staging_readback;
+		// Set if RDRAM cannot be mapped, readbacks then go through InternalSynchronization::staging_readback.
+		bool use_staging_readback = false;
 		std::unique_ptr<std::atomic_uint32_t[]> pending_writes_for_page;
 		std::vector<uint32_t> page_to_direct_copy;
 		std::vector<uint32_t> page_to_masked_copy;
 		std::vector<uint32_t> page_to_pending_readback;
+		// Pages written by the CPU since they were last uploaded, if tracked.
+		std::unique_ptr<std::atomic_uint32_t[]> page_cpu_written;
+		// Pages which are not uploaded since the CPU did not write them, but whose write mask must still be cleared.
+		std::vector<uint32_t> page_to_clear_write_mask;
+		// Pages written by the GPU since their write mask was last cleared.
+		std::vector<uint32_t> page_write_mask_dirty;
+		bool track_cpu_writes = false;
+		unsigned page_size = 0;
+		unsigned mask_page_size = 0;
 		unsigned num_pages = 0;
-		unsigned staging_readback_pages = 0;
-		unsigned staging_readback_index = 0; // Ringbuffer the readbacks.
+
+		// Logged with PARALLEL_RDP_BENCH=1, for tuning the page size.
+		struct
+		{
+			uint64_t direct_upload_pages = 0;
+			uint64_t masked_upload_pages = 0;
+			uint64_t readback_pages = 0;
+			uint64_t readback_copies = 0;
+		} counters;
 	} incoherent;
 
 	size_t rdram_offset = 0;
@@ -140,17 +165,33 @@ private:
 	bool init_caps();
 	void init_blender_lut();
 	void init_buffers();
+	void init_span_setups(unsigned index);
+	void init_binning_buffers(unsigned width, unsigned height);
+	void init_tile_instance_buffers(unsigned tile_instances);
+	void ensure_tile_buffers(unsigned fb_width, unsigned fb_height);
 
-	struct
+	// Framebuffer binding and the range of primitives drawn to it within the current stream batch.
+	struct FramebufferSegment
 	{
 		uint32_t addr = 0;
 		uint32_t depth_addr = 0;
 		uint32_t width = 0;
 		uint32_t deduced_height = 0;
 		FBFormat fmt = FBFormat::I8;
-		bool depth_write_pending = false;
-		bool color_write_pending = false;
-	} fb;
+		// One bit per framebuffer row, set for the scissored bounding box of every primitive.
+		uint32_t color_rows_written[Limits::MaxHeight / 32] = {};
+		uint32_t depth_rows_written[Limits::MaxHeight / 32] = {};
+		unsigned first_primitive = 0;
+		unsigned num_primitives = 0;
+	};
+	FramebufferSegment fb;
+
+	// TMEM uploads from first_upload on run once the segments before first_segment are rendered, so they see what those drew.
+	struct TMEMUploadSplit
+	{
+		unsigned first_upload;
+		unsigned first_segment;
+	};
 
 	struct StreamCaches
 	{
@@ -158,25 +199,48 @@ private:
 		StaticRasterizationState static_raster_state = {};
 		DepthBlendState depth_blend_state = {};
 
-		StateCache<StaticRasterizationState, Limits::MaxStaticRasterizationStates> static_raster_state_cache;
+		StateCache<StaticRasterizationState, Limits::MaxStaticRasterizationStatesUpperBound> static_raster_state_cache;
 		StateCache<DepthBlendState, Limits::MaxDepthBlendStates> depth_blend_state_cache;
 		StateCache<TileInfo, Limits::MaxTileInfoStates> tile_info_state_cache;
 
-		StreamCache<TriangleSetup, Limits::MaxPrimitives> triangle_setup;
-		StreamCache<ScissorState, Limits::MaxPrimitives> scissor_setup;
-		StreamCache<AttributeSetup, Limits::MaxPrimitives> attribute_setup;
-		StreamCache<DerivedSetup, Limits::MaxPrimitives> derived_setup;
-		StreamCache<InstanceIndices, Limits::MaxPrimitives> state_indices;
-		StreamCache<SpanInfoOffsets, Limits::MaxPrimitives> span_info_offsets;
-		StreamCache<SpanInterpolationJob, Limits::MaxSpanSetups> span_info_jobs;
+		StreamCache<TriangleSetup> triangle_setup;
+		StreamCache<ScissorState> scissor_setup;
+		StreamCache<AttributeSetup> attribute_setup;
+		StreamCache<DerivedSetup> derived_setup;
+		StreamCache<InstanceIndices> state_indices;
+		StreamCache<SpanInfoOffsets> span_info_offsets;
+		StreamCache<SpanInterpolationJob> span_info_jobs;
 
 		std::vector<UploadInfo> tmem_upload_infos;
+		// Earlier framebuffers in this batch, each rendered in turn before the current one.
+		std::vector<FramebufferSegment> framebuffer_segments;
+		std::vector<TMEMUploadSplit> tmem_upload_splits;
+		unsigned framebuffer_changes = 0;
 		unsigned max_shaded_tiles = 0;
+
+		// State cache indices of tiles, only refreshed for tiles which changed since the last primitive.
+		uint8_t tile_indices[Limits::MaxNumTiles] = {};
+		uint32_t tile_dirty_mask = ~0u;
 	} stream;
 
 	TileInfo tiles[Limits::MaxNumTiles];
-	Vulkan::BufferHandle tmem_instances;
-	Vulkan::BufferHandle span_setups;
+	// Two sets, so a render pass can fill one while the previous pass still reads the other.
+	Vulkan::BufferHandle tmem_instances[2];
+	Vulkan::BufferHandle span_setups[2];
+	unsigned scratch_index = 0;
+
+	struct RDRAMRange
+	{
+		uint32_t begin, end;
+	};
+
+	// RDRAM accesses of the last render pass while later work is not ordered after it with a barrier yet.
+	struct
+	{
+		std::vector<RDRAMRange> writes;
+		bool reads_tmem = false;
+		bool pending = false;
+	} last_render_pass;
 	Vulkan::BufferHandle blender_divider_lut_buffer;
 	Vulkan::BufferViewHandle blender_divider_buffer;
 
@@ -192,6 +256,19 @@ private:
 	Vulkan::BufferHandle per_tile_shaded_shaded_alpha;
 	Vulkan::BufferHandle per_tile_shaded_coverage;
 
+	// Binning and per-tile buffers are sized for the framebuffers and tile instance counts seen so far,
+	// and shrunk to the high-water mark of recent render passes.
+	struct
+	{
+		unsigned width = 0;
+		unsigned height = 0;
+		unsigned tile_instances = 0;
+		unsigned high_water_width = 0;
+		unsigned high_water_height = 0;
+		unsigned high_water_tile_instances = 0;
+		unsigned render_passes = 0;
+	} tile_buffers;
+
 	struct MappedBuffer
 	{
 		Vulkan::BufferHandle buffer;
@@ -200,8 +277,9 @@ private:
 
 	struct RenderBuffers
 	{
-		void init(Vulkan::Device &device, Vulkan::BufferDomain domain, RenderBuffers *borrow);
+		void init(Vulkan::Device &device, Vulkan::BufferDomain domain, const RendererLimits &limits, RenderBuffers *borrow);
 		static MappedBuffer create_buffer(Vulkan::Device &device, Vulkan::BufferDomain domain, VkDeviceSize size, MappedBuffer *borrow);
+		VkDeviceSize get_memory_size() const;
 
 		MappedBuffer triangle_setup;
 		MappedBuffer attribute_setup;
@@ -221,8 +299,15 @@ private:
 
 	struct RenderBuffersUpdater
 	{
-		void init(Vulkan::Device &device);
-		void upload(Vulkan::Device &device, const StreamCaches &caches);
+		void init(Vulkan::Device &device, const RendererLimits &limits);
+		VkDeviceSize get_memory_size() const;
+		// Points the stream caches at the mapped upload buffers.
+		void map(Vulkan::Device &device, StreamCaches &caches);
+		// Flushes the upload buffers and records copies to device memory if the GPU cannot read them in place.
+		void upload(Vulkan::CommandBuffer &cmd, Vulkan::Device &device, const StreamCaches &caches);
+
+		template <typename T>
+		void map(Vulkan::Device &device, const MappedBuffer &cpu, StreamCache<T> &cache);
 
 		template <typename Cache>
 		void upload(Vulkan::CommandBuffer *cmd, Vulkan::Device &device,
@@ -234,6 +319,11 @@ private:
 	struct InternalSynchronization
 	{
 		SyncObject complete;
+		// RDRAM and write mask as read back by the render pass of this buffer instance.
+		// Reused once the render pass completes, so it grows along with the buffer instances.
+		Vulkan::BufferHandle staging_readback;
+		// Coherency operation which last read from staging_readback.
+		uint64_t readback_index = 0;
 	};
 
 	struct Constants
@@ -256,24 +346,47 @@ private:
 		bool use_prim_depth = false;
 	} constants;
 
-	RenderBuffersUpdater buffer_instances[Limits::NumSyncStates];
-	InternalSynchronization internal_sync[Limits::NumSyncStates];
+	// Ring of render pass buffers. Grows when the next instance is still in flight, up to the memory budget.
+	std::vector<RenderBuffersUpdater> buffer_instances;
+	std::vector<InternalSynchronization> internal_sync;
 	unsigned buffer_instance = 0;
+	VkDeviceSize buffer_instance_size = 0;
+	struct
+	{
+		uint64_t waits = 0;
+		uint64_t stall_ns = 0;
+	} buffer_instance_stalls;
 	uint32_t base_primitive_index = 0;
 
-	bool tmem_upload_needs_flush(uint32_t addr) const;
+	bool tmem_upload_needs_split(uint32_t addr, uint32_t byte_count) const;
+	bool tmem_upload_reads_pending_write(const FramebufferSegment &segment, uint32_t addr, uint32_t byte_count) const;
+	bool tmem_upload_reads_rows(const uint32_t *rows_written, uint32_t fb_addr, uint32_t stride,
+	                            uint32_t height, uint32_t addr, uint32_t byte_count) const;
 
 	void flush_queues();
+	void begin_framebuffer_segment();
+	void end_framebuffer_segment();
+	bool start_next_framebuffer_segment();
+	void split_tmem_uploads();
 	void submit_render_pass();
 	void begin_new_context();
+	void begin_buffer_instance();
+	void add_buffer_instance(unsigned index);
+	void init_staging_readback(InternalSynchronization &sync);
 	bool need_flush() const;
-	void update_tmem_instances(Vulkan::CommandBuffer &cmd);
+	bool render_pass_depends_on_previous(bool need_tmem_upload) const;
+	void update_tmem_instances(Vulkan::CommandBuffer &cmd, unsigned first_upload, unsigned num_uploads);
 	void submit_span_setup_jobs(Vulkan::CommandBuffer &cmd);
 	void update_deduced_height(const TriangleSetup &setup);
-	void submit_tile_binning_prepass(Vulkan::CommandBuffer &cmd);
-	void submit_tile_binning_complete(Vulkan::CommandBuffer &cmd);
+	void update_rows_written(const TriangleSetup &setup);
+	void submit_tile_binning_prepass(Vulkan::CommandBuffer &cmd, const FramebufferSegment &segment);
+	void submit_tile_binning_complete(Vulkan::CommandBuffer &cmd, const FramebufferSegment &segment);
 	void clear_indirect_buffer(Vulkan::CommandBuffer &cmd);
-	void submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem);
+	void submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, const FramebufferSegment &segment);
+	void submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, const FramebufferSegment &segment);
+	template <typename T>
+	void set_segment_storage_buffer(Vulkan::CommandBuffer &cmd, unsigned set, unsigned binding,
+	                                const MappedBuffer &buffer, const FramebufferSegment &segment);
 
 	SpanInfoOffsets allocate_span_jobs(const TriangleSetup &setup);
 
@@ -320,9 +433,11 @@ private:
 
 	void resolve_coherency_host_to_gpu();
 	void resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::CommandBuffer &cmd);
-	uint32_t get_byte_size_for_bound_color_framebuffer() const;
-	uint32_t get_byte_size_for_bound_depth_framebuffer() const;
+	static uint32_t get_stride_for_color_framebuffer(const FramebufferSegment &segment);
+	static uint32_t get_byte_size_for_color_framebuffer(const FramebufferSegment &segment);
+	static uint32_t get_byte_size_for_depth_framebuffer(const FramebufferSegment &segment);
 	void mark_pages_for_gpu_read(uint32_t base_addr, uint32_t byte_count);
 	void lock_pages_for_gpu_write(uint32_t base_addr, uint32_t byte_count);
+	void lock_rows_for_gpu_write(const uint32_t *rows_written, uint32_t base_addr, uint32_t stride, uint32_t height);
 };
 }
\ No newline at end of file
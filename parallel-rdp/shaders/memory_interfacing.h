@@ -44,6 +44,17 @@ const int FB_FMT_RGBA5551 = 2;
 const int FB_FMT_IA88 = 3;
 const int FB_FMT_RGBA8888 = 4;
 
+// For incoherent RDRAM, a write mask follows RDRAM in the same buffer.
+// It holds one bit per byte, in host byte order, 32 bytes per word.
+void mark_vram_written(uint byte_offset, uint bits)
+{
+	// Need this memory barrier to ensure the mask readback does not read
+	// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
+	// also coherent.
+	memoryBarrierBuffer();
+	atomicOr(vram32.data[(RDRAM_SIZE >> 2u) + (byte_offset >> 5u)], bits << (byte_offset & 31u));
+}
+
 u8x4 current_color;
 bool current_color_dirty;
 
@@ -167,13 +178,7 @@ void store_vram_color(uint index)
 				hidden_vram.data[index >> 1u] = mem_u8(current_color.a);
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram8.data[(index ^ 3u) + RDRAM_SIZE] = mem_u8(0xff);
-			}
+				mark_vram_written(index ^ 3u, 0x1u);
 			break;
 		}
 
@@ -185,13 +190,7 @@ void store_vram_color(uint index)
 				hidden_vram.data[index >> 1u] = mem_u8((current_color.r & 1) * 3);
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram8.data[(index ^ 3u) + RDRAM_SIZE] = mem_u8(0xff);
-			}
+				mark_vram_written(index ^ 3u, 0x1u);
 			break;
 		}
 
@@ -206,13 +205,7 @@ void store_vram_color(uint index)
 			hidden_vram.data[index] = mem_u8(cov & U8_C(3));
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram16.data[(index ^ 1u) + (RDRAM_SIZE >> 1u)] = mem_u16(0xffff);
-			}
+				mark_vram_written((index ^ 1u) << 1u, 0x3u);
 			break;
 		}
 
@@ -225,13 +218,7 @@ void store_vram_color(uint index)
 			hidden_vram.data[index] = mem_u8((col.y & 1) * 3);
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram16.data[(index ^ 1u) + (RDRAM_SIZE >> 1u)] = mem_u16(0xffff);
-			}
+				mark_vram_written((index ^ 1u) << 1u, 0x3u);
 			break;
 		}
 
@@ -245,13 +232,7 @@ void store_vram_color(uint index)
 			hidden_vram.data[2u * index + 1u] = mem_u8((current_color.a & 1) * 3);
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram32.data[index + (RDRAM_SIZE >> 2u)] = ~0u;
-			}
+				mark_vram_written(index << 2u, 0xfu);
 			break;
 		}
 		}
@@ -270,13 +251,7 @@ void store_vram_depth(uint index)
 			hidden_vram.data[index] = mem_u8(current_dz & U16_C(3));
 
 			if (RDRAM_INCOHERENT)
-			{
-				// Need this memory barrier to ensure the mask readback does not read
-				// an invalid value from RDRAM. If the mask is seen, the valid RDRAM value is
-				// also coherent.
-				memoryBarrierBuffer();
-				vram16.data[(index ^ 1) + (RDRAM_SIZE >> 1u)] = mem_u16(0xffff);
-			}
+				mark_vram_written((index ^ 1u) << 1u, 0x3u);
 		}
 	}
 }
@@ -27,6 +27,10 @@
 #include <thread>
 #include <condition_variable>
 #include <utility>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
 
 #ifdef PARALLEL_RDP_SHADER_DIR
 #include "global_managers.hpp"
@@ -119,4 +123,99 @@ private:
 		}
 	}
 };
-}
\ No newline at end of file
+
+// Splits a batch of tasks between the calling thread and a set of helper threads.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(unsigned num_helper_threads)
+	{
+		for (unsigned i = 0; i < num_helper_threads; i++)
+			threads.emplace_back(&WorkerPool::main_loop, this);
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+			cond.notify_all();
+		}
+
+		for (auto &thr : threads)
+			thr.join();
+	}
+
+	unsigned get_num_threads() const
+	{
+		return unsigned(threads.size()) + 1;
+	}
+
+	// Calls func for every index in [0, count) and returns when all calls are complete.
+	void run(unsigned count, const std::function<void (unsigned)> &func)
+	{
+		if (threads.empty() || count <= 1)
+		{
+			for (unsigned i = 0; i < count; i++)
+				func(i);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			task = &func;
+			task_count = count;
+			next_index.store(0, std::memory_order_relaxed);
+			active_threads = unsigned(threads.size());
+			generation++;
+			cond.notify_all();
+		}
+
+		execute();
+
+		std::unique_lock<std::mutex> holder{lock};
+		done_cond.wait(holder, [this]() { return active_threads == 0; });
+		task = nullptr;
+	}
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable done_cond;
+	const std::function<void (unsigned)> *task = nullptr;
+	unsigned task_count = 0;
+	std::atomic_uint32_t next_index{0};
+	unsigned active_threads = 0;
+	uint64_t generation = 0;
+	bool dead = false;
+
+	void execute()
+	{
+		unsigned index;
+		while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < task_count)
+			(*task)(index);
+	}
+
+	void main_loop()
+	{
+		uint64_t seen_generation = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [&]() { return dead || generation != seen_generation; });
+				if (dead)
+					break;
+				seen_generation = generation;
+			}
+
+			execute();
+
+			std::lock_guard<std::mutex> holder{lock};
+			if (--active_threads == 0)
+				done_cond.notify_one();
+		}
+	}
+};
+}
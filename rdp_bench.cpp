@@ -26,6 +26,7 @@
 #include "timer.hpp"
 #include "application_cli_wrapper.hpp"
 #include <stdlib.h>
+#include <algorithm>
 
 using namespace RDP;
 
@@ -59,25 +60,66 @@ static InputPrimitive generate_input_primitive()
 	return prim;
 }
 
-static int main_inner(Vulkan::Device *device, int, char **)
+// Small triangles laid out on a grid, so many primitives fit in one framebuffer.
+static InputPrimitive generate_small_primitive(unsigned index, unsigned size, unsigned width, unsigned height)
 {
-#ifdef _WIN32
-	_putenv("PARALLEL_RDP_FORCE_SYNC_SHADER=1");
-	_putenv("PARALLEL_RDP_SINGLE_THREADED_COMMAND=1");
-#else
-	setenv("PARALLEL_RDP_FORCE_SYNC_SHADER", "1", 1);
-	setenv("PARALLEL_RDP_SINGLE_THREADED_COMMAND", "1", 1);
-#endif
+	InputPrimitive prim = generate_input_primitive();
+	unsigned cols = std::max(width / size, 1u);
+	unsigned rows = std::max(height / size, 1u);
+	float x = float((index % cols) * size);
+	float y = float(((index / cols) % rows) * size);
+	float s = float(size);
 
-	ReplayerState state;
-	if (!state.init(device))
-		return EXIT_FAILURE;
+	const float xs[3] = { x, x, x + s };
+	const float ys[3] = { y, y + s, y };
+	for (unsigned i = 0; i < 3; i++)
+	{
+		prim.vertices[i].x = 2.0f * xs[i] / float(width) - 1.0f;
+		prim.vertices[i].y = 2.0f * ys[i] / float(height) - 1.0f;
+	}
+	return prim;
+}
 
-	const unsigned iterations = 10000;
-	const unsigned num_quads_per_frame = 10;
+struct BenchArguments
+{
+	unsigned iterations = 10000;
+	unsigned primitives_per_frame = 10;
+	unsigned triangle_size = 0;
+	bool sweep = false;
+	RendererLimits limits;
+};
+
+static void print_help()
+{
+	LOGE("Usage: rdp-bench\n"
+	     "\t[--iterations <count>]\n"
+	     "\t[--primitives <count per frame>]\n"
+	     "\t[--triangle-size <pixels, 0 = fullscreen>]\n"
+	     "\t[--max-primitives <count>]\n"
+	     "\t[--max-span-setups <count>]\n"
+	     "\t[--max-tile-instances <count>]\n"
+	     "\t[--max-static-states <count>]\n"
+	     "\t[--sweep-batch-sizes]\n"
+	);
+}
+
+// effective_limits receives the limits after the renderer clamped them.
+static bool run_benchmark(ReplayerState &state, bool benchmarking, const BenchArguments &args,
+                          const RendererLimits &limits, RendererLimits &effective_limits, double &time_per_frame)
+{
+	const unsigned iterations = args.iterations;
+	const unsigned num_quads_per_frame = args.primitives_per_frame;
 	const unsigned width = 512;
 	const unsigned height = 256;
 
+	// Every run gets a fresh CommandProcessor with its own limits.
+	state.combined.reset();
+	state.gpu.reset();
+	state.gpu = create_replayer_driver_parallel(*state.device, state.builder, state.iface, benchmarking, false, limits);
+	if (!state.gpu)
+		return false;
+	effective_limits = *state.gpu->get_limits();
+
 	auto prim = generate_input_primitive();
 
 	state.builder.set_command_interface(state.gpu.get());
@@ -108,10 +150,16 @@ static int main_inner(Vulkan::Device *device, int, char **)
 	{
 		state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, (iter & 3) * 512, width);
 		for (unsigned count = 0; count < num_quads_per_frame; count++)
-			state.builder.draw_triangle(prim);
+		{
+			if (args.triangle_size)
+				state.builder.draw_triangle(generate_small_primitive(count, args.triangle_size, width, height));
+			else
+				state.builder.draw_triangle(prim);
+		}
 		state.device->next_frame_context();
 		timestamps[iter] = Util::get_current_time_nsecs();
-		LOGI("Completed iteration %u / %u.\n", iter, iterations);
+		if (!args.sweep)
+			LOGI("Completed iteration %u / %u.\n", iter, iterations);
 	}
 
 	state.device->wait_idle();
@@ -120,10 +168,87 @@ static int main_inner(Vulkan::Device *device, int, char **)
 	double delta_s = 1e-9 * double(delta_ns);
 	uint64_t num_frames = iterations - 6;
 	uint64_t num_pixels = num_frames * num_quads_per_frame * width * height;
-	double time_per_frame = (1e-9 * double(delta_ns)) / double(num_frames);
+	time_per_frame = (1e-9 * double(delta_ns)) / double(num_frames);
+
+	if (!args.sweep)
+	{
+		LOGI("Time per frame: %.3f ms.\n", 1000.0 * time_per_frame);
+		if (!args.triangle_size)
+			LOGI("Fill-rate: %.6f Gpixels/s.\n", 1e-9 * double(num_pixels) / delta_s);
+	}
+	return true;
+}
+
+static int main_inner(Vulkan::Device *device, int argc, char **argv)
+{
+	BenchArguments args;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--iterations", [&](Util::CLIParser &parser) { args.iterations = parser.next_uint(); });
+	cbs.add("--primitives", [&](Util::CLIParser &parser) { args.primitives_per_frame = parser.next_uint(); });
+	cbs.add("--triangle-size", [&](Util::CLIParser &parser) { args.triangle_size = parser.next_uint(); });
+	cbs.add("--max-primitives", [&](Util::CLIParser &parser) { args.limits.max_primitives = parser.next_uint(); });
+	cbs.add("--max-span-setups", [&](Util::CLIParser &parser) { args.limits.max_span_setups = parser.next_uint(); });
+	cbs.add("--max-tile-instances", [&](Util::CLIParser &parser) { args.limits.max_tile_instances = parser.next_uint(); });
+	cbs.add("--max-static-states", [&](Util::CLIParser &parser) {
+		args.limits.max_static_rasterization_states = parser.next_uint();
+	});
+	cbs.add("--sweep-batch-sizes", [&](Util::CLIParser &) { args.sweep = true; });
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
-	LOGI("Time per frame: %.3f ms.\n", 1000.0 * time_per_frame);
-	LOGI("Fill-rate: %.6f Gpixels/s.\n", 1e-9 * double(num_pixels) / delta_s);
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (args.iterations < 8)
+	{
+		LOGE("Need at least 8 iterations.\n");
+		return EXIT_FAILURE;
+	}
+
+#ifdef _WIN32
+	_putenv("PARALLEL_RDP_FORCE_SYNC_SHADER=1");
+	_putenv("PARALLEL_RDP_SINGLE_THREADED_COMMAND=1");
+#else
+	setenv("PARALLEL_RDP_FORCE_SYNC_SHADER", "1", 1);
+	setenv("PARALLEL_RDP_SINGLE_THREADED_COMMAND", "1", 1);
+#endif
+
+	ReplayerState state;
+	if (!state.init(device))
+		return EXIT_FAILURE;
+
+	if (!args.sweep)
+	{
+		RendererLimits effective_limits;
+		double time_per_frame;
+		if (!run_benchmark(state, device != nullptr, args, args.limits, effective_limits, time_per_frame))
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	// Doubles the primitive batch size, scaling span setups along with it so they do not become the bottleneck.
+	LOGI("%14s %14s %14s %16s\n", "max-primitives", "span-setups", "tile-instances", "time/frame (ms)");
+	for (unsigned max_primitives = 1024; max_primitives <= Limits::MaxPrimitivesUpperBound; max_primitives *= 2)
+	{
+		RendererLimits limits = args.limits;
+		limits.max_primitives = max_primitives;
+		limits.max_span_setups = std::max(args.limits.max_span_setups,
+		                                  unsigned(uint64_t(Limits::MaxSpanSetups) * max_primitives / Limits::MaxPrimitives));
+
+		RendererLimits effective_limits;
+		double time_per_frame;
+		if (!run_benchmark(state, device != nullptr, args, limits, effective_limits, time_per_frame))
+			return EXIT_FAILURE;
+
+		LOGI("%14u %14u %14u %16.3f\n", effective_limits.max_primitives, effective_limits.max_span_setups,
+		     effective_limits.max_tile_instances, 1000.0 * time_per_frame);
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -946,6 +946,384 @@ static bool run_conformance_load_tile32(ReplayerState &state, const Arguments &a
 	return true;
 }
 
+struct FramebufferSegmentConfig
+{
+	TextureFormat fmt;
+	TextureSize size;
+	uint32_t addr;
+	uint32_t width;
+	uint32_t depth_addr;
+};
+
+static const FramebufferSegmentConfig framebuffer_segment_configs[] = {
+	{ TextureFormat::RGBA, TextureSize::Bpp16, 0, 320, 1u << 20 },
+	{ TextureFormat::RGBA, TextureSize::Bpp32, 0x80000, 256, 1u << 20 },
+	// Same color buffer as the first config with a different depth buffer.
+	{ TextureFormat::RGBA, TextureSize::Bpp16, 0, 320, 0x180000 },
+	{ TextureFormat::RGBA, TextureSize::Bpp16, 0x200000, 288, 0x180000 },
+	// Color and depth alias.
+	{ TextureFormat::RGBA, TextureSize::Bpp16, 0x280000, 320, 0x280000 },
+};
+
+static void set_framebuffer_segment_config(ReplayerState &state, const FramebufferSegmentConfig &config)
+{
+	state.builder.set_color_image(config.fmt, config.size, config.addr, config.width);
+	state.builder.set_depth_image(config.depth_addr);
+}
+
+// Switches color and depth framebuffers several times within one batch, revisiting earlier framebuffers,
+// so primitives are split into framebuffer segments which must observe each other's writes in order.
+static bool run_conformance_framebuffer_segments(ReplayerState &state, const Arguments &args,
+                                                 unsigned max_framebuffer_segments)
+{
+	RendererLimits limits;
+	limits.max_framebuffer_segments = max_framebuffer_segments;
+	if (!state.reset_gpu(limits))
+		return false;
+
+	InputPrimitive prim = {};
+	RNG rng;
+	bool ret = true;
+
+	state.builder.set_viewport({ 0, 0, 320, 240, 0, 1 });
+	state.builder.set_cycle_type(CycleType::Cycle1);
+	state.builder.set_combiner_1cycle({
+		{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Shade },
+		{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::ShadeAlpha }
+	});
+	// Blending against memory color makes every segment depend on what earlier segments wrote.
+	state.builder.set_blend_mode(0, BlendMode1A::PixelColor, BlendMode1B::ShadeAlpha,
+	                             BlendMode2A::MemoryColor, BlendMode2B::InvPixelAlpha);
+	state.builder.set_enable_blend(true);
+	state.builder.set_image_read_enable(true);
+	state.builder.set_depth_test(true);
+	state.builder.set_depth_write(true);
+	state.builder.set_z_mode(ZMode::Opaque);
+
+	constexpr unsigned num_configs = sizeof(framebuffer_segment_configs) / sizeof(framebuffer_segment_configs[0]);
+
+	for (unsigned i = 0; i <= args.hi && ret; i++)
+	{
+		bool run = i >= args.lo;
+		if (run)
+		{
+			clear_rdram(*state.reference);
+			clear_rdram(*state.gpu);
+			state.builder.set_scissor_subpixels(19, 14, 1162, 801);
+			if (args.capture)
+				state.device->begin_renderdoc_capture();
+		}
+
+		unsigned config_index = 0;
+		unsigned num_switches = 4 + (rng.rnd() & 15);
+
+		for (unsigned j = 0; j < num_switches; j++)
+		{
+			config_index = (config_index + 1 + (rng.rnd() % (num_configs - 1))) % num_configs;
+			if (run)
+				set_framebuffer_segment_config(state, framebuffer_segment_configs[config_index]);
+
+			unsigned num_primitives = 1 + (rng.rnd() & 7);
+			for (unsigned k = 0; k < num_primitives; k++)
+			{
+				generate_random_input_primitive(rng, prim, true, true, false);
+				if (run)
+					state.builder.draw_triangle(prim);
+			}
+		}
+
+		if (run)
+		{
+			state.builder.end_frame();
+			if (args.capture)
+				state.device->end_renderdoc_capture();
+
+			if (!compare_rdram(*state.reference, *state.gpu))
+			{
+				LOGE("Framebuffer segment conformance failed in iteration %u!\n", i);
+				ret = false;
+			}
+
+			state.device->next_frame_context();
+		}
+
+		if (ret && args.verbose)
+			LOGI("Iteration %u passed ...\n", i);
+	}
+
+	// Later suites run with default limits.
+	if (!state.reset_gpu({}))
+		return false;
+	return ret;
+}
+
+// Renders to a framebuffer and loads the result into TMEM within the same batch,
+// then samples it while rendering to another framebuffer.
+static bool run_conformance_framebuffer_tmem_feedback(ReplayerState &state, const Arguments &args,
+                                                      unsigned max_framebuffer_segments)
+{
+	RendererLimits limits;
+	limits.max_framebuffer_segments = max_framebuffer_segments;
+	if (!state.reset_gpu(limits))
+		return false;
+
+	constexpr uint32_t src_addr = 0;
+	constexpr uint32_t dst_addr = 0x80000;
+	constexpr unsigned tile_width = 32;
+	constexpr unsigned tile_height = 16;
+
+	InputPrimitive prim = {};
+	RNG rng;
+	bool ret = true;
+
+	state.builder.set_viewport({ 0, 0, 320, 240, 0, 1 });
+	state.builder.set_cycle_type(CycleType::Cycle1);
+	state.builder.set_perspective(false);
+	state.builder.set_blend_mode(0, BlendMode1A::PixelColor, BlendMode1B::PixelAlpha,
+	                             BlendMode2A::PixelColor, BlendMode2B::InvPixelAlpha);
+	state.builder.set_enable_blend(false);
+	state.builder.set_image_read_enable(false);
+	state.builder.set_depth_test(false);
+	state.builder.set_depth_write(false);
+	state.builder.set_depth_image(1u << 20);
+
+	TileMeta info;
+	info.offset = 0;
+	info.stride = tile_width * 2;
+	info.size = TextureSize::Bpp16;
+	info.fmt = TextureFormat::RGBA;
+	info.mask_s = 5;
+	info.mask_t = 4;
+	state.builder.set_tile(0, info);
+	state.builder.set_tile_size(0, 0, 0, tile_width, tile_height);
+	state.builder.set_texture_image(src_addr, TextureFormat::RGBA, TextureSize::Bpp16, 320);
+
+	for (unsigned i = 0; i <= args.hi && ret; i++)
+	{
+		bool run = i >= args.lo;
+		if (run)
+		{
+			clear_rdram(*state.reference);
+			clear_rdram(*state.gpu);
+			state.builder.set_scissor_subpixels(19, 14, 1162, 801);
+			if (args.capture)
+				state.device->begin_renderdoc_capture();
+		}
+
+		unsigned num_rounds = 1 + (rng.rnd() & 3);
+		for (unsigned j = 0; j < num_rounds; j++)
+		{
+			unsigned x = 8 + (rng.rnd() % 240);
+			unsigned y = 8 + (rng.rnd() % 180);
+			unsigned num_primitives = 1 + (rng.rnd() & 7);
+
+			if (run)
+			{
+				state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, src_addr, 320);
+				state.builder.set_combiner_1cycle({
+					{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Shade },
+					{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::ShadeAlpha }
+				});
+			}
+
+			for (unsigned k = 0; k < num_primitives; k++)
+			{
+				generate_random_input_primitive(rng, prim, true, false, false);
+				if (run)
+					state.builder.draw_triangle(prim);
+			}
+
+			// Reads back what was just rendered.
+			if (run)
+			{
+				state.builder.load_tile(0, x, y, tile_width, tile_height);
+				state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, dst_addr, 320);
+				state.builder.set_combiner_1cycle({
+					{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Texel0 },
+					{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::Texel0Alpha }
+				});
+			}
+
+			for (unsigned k = 0; k < num_primitives; k++)
+			{
+				generate_random_input_primitive(rng, prim, false, false, false);
+				if (run)
+					state.builder.draw_triangle(prim);
+			}
+		}
+
+		if (run)
+		{
+			state.builder.end_frame();
+			state.combined->idle();
+			if (args.capture)
+				state.device->end_renderdoc_capture();
+
+			if (!compare_rdram(*state.reference, *state.gpu))
+			{
+				LOGE("Framebuffer TMEM feedback conformance failed in iteration %u!\n", i);
+				ret = false;
+			}
+			else if (memcmp(state.reference->get_tmem(), state.gpu->get_tmem(), 0x1000) != 0)
+			{
+				LOGE("TMEM differs in iteration %u!\n", i);
+				ret = false;
+			}
+
+			state.device->next_frame_context();
+		}
+
+		if (ret && args.verbose)
+			LOGI("Iteration %u passed ...\n", i);
+	}
+
+	// Later suites run with default limits.
+	if (!state.reset_gpu({}))
+		return false;
+	return ret;
+}
+
+// Renders to a framebuffer, samples it from TMEM in a pass which only reads it,
+// then writes to it from the CPU before rendering to it again.
+// With CPU write tracking, the sampling pass does not upload the framebuffer, but must still clear its write mask.
+static bool run_conformance_cpu_write_tracking(ReplayerState &state, const Arguments &args)
+{
+	constexpr uint32_t src_addr = 0;
+	constexpr uint32_t dst_addr = 0x80000;
+	constexpr unsigned tile_width = 32;
+	constexpr unsigned tile_height = 16;
+	constexpr unsigned src_size = 320 * 240 * 2;
+
+	InputPrimitive prim = {};
+	RNG rng;
+	bool ret = true;
+	std::vector<uint8_t> cpu_data;
+
+	state.builder.set_viewport({ 0, 0, 320, 240, 0, 1 });
+	state.builder.set_cycle_type(CycleType::Cycle1);
+	state.builder.set_perspective(false);
+	state.builder.set_depth_test(false);
+	state.builder.set_depth_write(false);
+	state.builder.set_depth_image(1u << 20);
+
+	TileMeta info;
+	info.offset = 0;
+	info.stride = tile_width * 2;
+	info.size = TextureSize::Bpp16;
+	info.fmt = TextureFormat::RGBA;
+	info.mask_s = 5;
+	info.mask_t = 4;
+	state.builder.set_tile(0, info);
+	state.builder.set_tile_size(0, 0, 0, tile_width, tile_height);
+	state.builder.set_texture_image(src_addr, TextureFormat::RGBA, TextureSize::Bpp16, 320);
+
+	for (unsigned i = 0; i <= args.hi && ret; i++)
+	{
+		bool run = i >= args.lo;
+		if (run)
+		{
+			clear_rdram(*state.reference);
+			clear_rdram(*state.gpu);
+			state.builder.set_scissor_subpixels(19, 14, 1162, 801);
+			if (args.capture)
+				state.device->begin_renderdoc_capture();
+		}
+
+		// Write the source framebuffer on the GPU.
+		unsigned num_primitives = 1 + (rng.rnd() & 7);
+		if (run)
+		{
+			state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, src_addr, 320);
+			state.builder.set_enable_blend(false);
+			state.builder.set_image_read_enable(false);
+			state.builder.set_combiner_1cycle({
+				{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Shade },
+				{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::ShadeAlpha }
+			});
+		}
+
+		for (unsigned k = 0; k < num_primitives; k++)
+		{
+			generate_random_input_primitive(rng, prim, true, false, false);
+			if (run)
+				state.builder.draw_triangle(prim);
+		}
+
+		// Only read the source framebuffer.
+		unsigned x = 8 + (rng.rnd() % 240);
+		unsigned y = 8 + (rng.rnd() % 180);
+		num_primitives = 1 + (rng.rnd() & 7);
+		if (run)
+		{
+			state.builder.load_tile(0, x, y, tile_width, tile_height);
+			state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, dst_addr, 320);
+			state.builder.set_combiner_1cycle({
+				{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Texel0 },
+				{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::Texel0Alpha }
+			});
+		}
+
+		for (unsigned k = 0; k < num_primitives; k++)
+		{
+			generate_random_input_primitive(rng, prim, false, false, false);
+			if (run)
+				state.builder.draw_triangle(prim);
+		}
+
+		// Overwrite part of the source framebuffer from the CPU.
+		unsigned cpu_offset = (rng.rnd() % src_size) & ~1u;
+		unsigned cpu_size = std::min(2u + (rng.rnd() % 0x4000), src_size - cpu_offset);
+		cpu_data.resize(cpu_size);
+		for (auto &c : cpu_data)
+			c = uint8_t(rng.rnd());
+		if (run)
+			state.combined->update_rdram(cpu_data.data(), cpu_size, cpu_offset);
+
+		// Write the source framebuffer again. Blending reads memory, so the CPU writes must be visible,
+		// and bytes which are not rendered must keep what the CPU wrote.
+		num_primitives = 1 + (rng.rnd() & 7);
+		if (run)
+		{
+			state.builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, src_addr, 320);
+			state.builder.set_combiner_1cycle({
+				{ RGBMulAdd::Zero,   RGBMulSub::Zero,   RGBMul::Zero,   RGBAdd::Shade },
+				{ AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::ShadeAlpha }
+			});
+			state.builder.set_blend_mode(0, BlendMode1A::PixelColor, BlendMode1B::ShadeAlpha,
+			                             BlendMode2A::MemoryColor, BlendMode2B::InvPixelAlpha);
+			state.builder.set_enable_blend(true);
+			state.builder.set_image_read_enable(true);
+		}
+
+		for (unsigned k = 0; k < num_primitives; k++)
+		{
+			generate_random_input_primitive(rng, prim, true, false, false);
+			if (run)
+				state.builder.draw_triangle(prim);
+		}
+
+		if (run)
+		{
+			state.builder.end_frame();
+			if (args.capture)
+				state.device->end_renderdoc_capture();
+
+			if (!compare_rdram(*state.reference, *state.gpu))
+			{
+				LOGE("CPU write tracking conformance failed in iteration %u!\n", i);
+				ret = false;
+			}
+
+			state.device->next_frame_context();
+		}
+
+		if (ret && args.verbose)
+			LOGI("Iteration %u passed ...\n", i);
+	}
+
+	return ret;
+}
+
 static void print_help()
 {
 	LOGE("Usage: rdp-conformance\n"
@@ -1528,6 +1906,19 @@ static int main_inner(int argc, char **argv)
 	suites.push_back({ "texture-load-tlut-4", run_conformance_load_tlut4 });
 	suites.push_back({ "texture-load-tlut-8", run_conformance_load_tlut8 });
 	suites.push_back({ "texture-load-tlut-16", run_conformance_load_tlut16 });
+	suites.push_back({ "framebuffer-segments-4", [](ReplayerState &state, const Arguments &args) -> bool {
+		return run_conformance_framebuffer_segments(state, args, 4);
+	}});
+	suites.push_back({ "framebuffer-segments-16", [](ReplayerState &state, const Arguments &args) -> bool {
+		return run_conformance_framebuffer_segments(state, args, 16);
+	}});
+	suites.push_back({ "framebuffer-tmem-feedback", [](ReplayerState &state, const Arguments &args) -> bool {
+		return run_conformance_framebuffer_tmem_feedback(state, args, 1);
+	}});
+	suites.push_back({ "framebuffer-tmem-feedback-segments", [](ReplayerState &state, const Arguments &args) -> bool {
+		return run_conformance_framebuffer_tmem_feedback(state, args, 4);
+	}});
+	suites.push_back({ "cpu-write-tracking", run_conformance_cpu_write_tracking });
 
 	if (list_suites)
 	{
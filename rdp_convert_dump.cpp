@@ -0,0 +1,270 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_dump.hpp"
+#include "rdp_dump_compression.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "global_managers.hpp"
+#include <string.h>
+#include <stdlib.h>
+
+using namespace RDP;
+
+// Chunks are cut at frame boundaries, or earlier once they grow past this.
+static constexpr size_t TargetChunkSize = 1024 * 1024;
+
+struct FileDeleter
+{
+	void operator()(FILE *f) { fclose(f); }
+};
+
+struct DumpConverter
+{
+	std::unique_ptr<FILE, FileDeleter> input, output;
+	std::vector<uint8_t> rdram_shadow, hidden_rdram_shadow;
+	std::vector<uint8_t> chunk, compressed, payload;
+	uint64_t input_size = 0, output_size = 0;
+	bool failed = false;
+
+	bool read_word(uint32_t &value);
+	bool read_bytes(void *data, size_t size);
+	void write(const void *data, size_t size);
+	void append_word(uint32_t value);
+	void flush_chunk();
+	bool convert();
+};
+
+bool DumpConverter::read_word(uint32_t &value)
+{
+	return read_bytes(&value, sizeof(value));
+}
+
+bool DumpConverter::read_bytes(void *data, size_t size)
+{
+	if (size && fread(data, 1, size, input.get()) != size)
+		return false;
+	input_size += size;
+	return true;
+}
+
+void DumpConverter::write(const void *data, size_t size)
+{
+	if (size && fwrite(data, 1, size, output.get()) != size)
+		failed = true;
+	output_size += size;
+}
+
+void DumpConverter::append_word(uint32_t value)
+{
+	uint8_t bytes[sizeof(value)];
+	memcpy(bytes, &value, sizeof(value));
+	chunk.insert(chunk.end(), bytes, bytes + sizeof(value));
+}
+
+void DumpConverter::flush_chunk()
+{
+	if (chunk.empty())
+		return;
+
+	compressed.clear();
+	compress_block(chunk.data(), chunk.size(), compressed);
+
+	uint32_t sizes[2] = { uint32_t(chunk.size()), uint32_t(compressed.size()) };
+	if (compressed.size() >= chunk.size())
+	{
+		sizes[1] = sizes[0];
+		write(sizes, sizeof(sizes));
+		write(chunk.data(), chunk.size());
+	}
+	else
+	{
+		write(sizes, sizeof(sizes));
+		write(compressed.data(), compressed.size());
+	}
+
+	chunk.clear();
+}
+
+bool DumpConverter::convert()
+{
+	char header[8];
+	uint32_t sizes[2];
+	if (!read_bytes(header, sizeof(header)) || memcmp(header, "RDPDUMP2", sizeof(header)) != 0)
+	{
+		LOGE("Input is not an RDPDUMP2 file.\n");
+		return false;
+	}
+
+	if (!read_bytes(sizes, sizeof(sizes)))
+		return false;
+	rdram_shadow.resize(sizes[0]);
+	hidden_rdram_shadow.resize(sizes[1]);
+
+	write("RDPDUMP3", 8);
+	write(sizes, sizeof(sizes));
+
+	uint32_t command_u32;
+	bool eof = false;
+	while (!eof && read_word(command_u32))
+	{
+		auto command = static_cast<Command>(command_u32);
+		switch (command)
+		{
+		case Command::RDPCommand:
+		{
+			uint32_t cmd_id, word_count;
+			if (!read_word(cmd_id) || !read_word(word_count))
+				return false;
+			payload.resize(word_count * sizeof(uint32_t));
+			if (!read_bytes(payload.data(), payload.size()))
+				return false;
+
+			append_word(command_u32);
+			append_word(cmd_id);
+			append_word(word_count);
+			chunk.insert(chunk.end(), payload.begin(), payload.end());
+			break;
+		}
+
+		case Command::SetVIRegister:
+		{
+			uint32_t index, value;
+			if (!read_word(index) || !read_word(value))
+				return false;
+			append_word(command_u32);
+			append_word(index);
+			append_word(value);
+			break;
+		}
+
+		case Command::UpdateDram:
+		case Command::UpdateHiddenDram:
+		{
+			uint32_t offset, size;
+			if (!read_word(offset) || !read_word(size))
+				return false;
+
+			auto &shadow = command == Command::UpdateDram ? rdram_shadow : hidden_rdram_shadow;
+			if (size_t(offset) + size > shadow.size())
+				return false;
+			payload.resize(size);
+			if (!read_bytes(payload.data(), size))
+				return false;
+
+			append_word(uint32_t(command == Command::UpdateDram ? Command::UpdateDramDelta : Command::UpdateHiddenDramDelta));
+			append_word(offset);
+			append_word(size);
+			encode_xor_delta(payload.data(), shadow.data() + offset, size, chunk);
+			break;
+		}
+
+		case Command::EndFrame:
+		case Command::SignalComplete:
+		case Command::UpdateDramFlush:
+		case Command::UpdateHiddenDramFlush:
+			append_word(command_u32);
+			break;
+
+		case Command::EndOfFile:
+			append_word(command_u32);
+			eof = true;
+			break;
+
+		default:
+			LOGE("Unknown command %u in dump.\n", command_u32);
+			return false;
+		}
+
+		if (command == Command::EndFrame || chunk.size() >= TargetChunkSize)
+			flush_chunk();
+	}
+
+	flush_chunk();
+	return !failed && fflush(output.get()) == 0;
+}
+
+static void print_help()
+{
+	LOGE("Usage: rdp-convert-dump\n"
+	     "\t<Path to RDPDUMP2 input>\n"
+	     "\t<Path to RDPDUMP3 output>\n"
+	);
+}
+
+static int main_inner(int argc, char *argv[])
+{
+	std::vector<std::string> paths;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.default_handler = [&](const char *arg) { paths.push_back(arg); };
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (paths.size() != 2)
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	DumpConverter converter;
+	converter.input.reset(fopen(paths[0].c_str(), "rb"));
+	if (!converter.input)
+	{
+		LOGE("Failed to open %s.\n", paths[0].c_str());
+		return EXIT_FAILURE;
+	}
+
+	converter.output.reset(fopen(paths[1].c_str(), "wb"));
+	if (!converter.output)
+	{
+		LOGE("Failed to open %s.\n", paths[1].c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (!converter.convert())
+	{
+		LOGE("Failed to convert dump.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Converted %llu bytes to %llu bytes.\n",
+	     static_cast<unsigned long long>(converter.input_size),
+	     static_cast<unsigned long long>(converter.output_size));
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	Granite::Global::init();
+	int ret = main_inner(argc, argv);
+	Granite::Global::deinit();
+	return ret;
+}
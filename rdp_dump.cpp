@@ -21,62 +21,281 @@
  */
 
 #include "rdp_dump.hpp"
+#include "rdp_dump_index.hpp"
+#include "rdp_dump_compression.hpp"
 #include <string.h>
 #include <algorithm>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace RDP
 {
-enum class Command : uint32_t
+static bool seek_file(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+	return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t tell_file(FILE *file)
+{
+#ifdef _WIN32
+	return uint64_t(_ftelli64(file));
+#else
+	return uint64_t(ftello(file));
+#endif
+}
+
+DumpPlayer::~DumpPlayer()
+{
+	unmap_file();
+}
+
+bool DumpPlayer::parse_header(const uint8_t *header)
 {
-	Invalid = 0,
-	UpdateDram = 1,
-	RDPCommand = 2,
-	SetVIRegister = 3,
-	EndFrame = 4,
-	SignalComplete = 5,
-	EndOfFile = 6,
-	UpdateDramFlush = 7,
-	UpdateHiddenDram = 8,
-	UpdateHiddenDramFlush = 9
-};
+	if (memcmp(header, "RDPDUMP2", 8) == 0)
+		version = 2;
+	else if (memcmp(header, "RDPDUMP3", 8) == 0)
+		version = 3;
+	else
+		return false;
+
+	uint32_t rdram_size_, hidden_dram_size_;
+	memcpy(&rdram_size_, header + 8, sizeof(uint32_t));
+	memcpy(&hidden_dram_size_, header + 12, sizeof(uint32_t));
+
+	if (rdram_size_ != 4 * 1024 * 1024 && rdram_size_ != 8 * 1024 * 1024)
+		return false;
+	if (hidden_dram_size_ != 4 * 1024 * 1024)
+		return false;
+
+	rdram_size = rdram_size_;
+	hidden_rdram_size = hidden_dram_size_;
+	return true;
+}
 
 bool DumpPlayer::load_dump(const char *path)
 {
+	unmap_file();
 	file.reset(fopen(path, "rb"));
 	if (!file)
 		return false;
 
-	char header[8];
-	if (fread(header, 1, 8, file.get()) != 8)
+	uint8_t header[16];
+	if (fread(header, 1, sizeof(header), file.get()) != sizeof(header))
 		return false;
 
-	if (memcmp(header, "RDPDUMP2", 8) != 0)
+	if (!parse_header(header))
 		return false;
 
-	uint32_t rdram_size, hidden_dram_size;
-	if (!read_word(rdram_size) || !read_word(hidden_dram_size))
-		return false;
+	rdram_cache.resize(rdram_size);
+	rdram_hidden_cache.resize(hidden_rdram_size);
+	reset_chunk(16);
+	return true;
+}
 
-	if (rdram_size != 4 * 1024 * 1024 && rdram_size != 8 * 1024 * 1024)
+bool DumpPlayer::load_dump_mapped(const char *path)
+{
+	file.reset();
+
+	if (!map_file(path))
 		return false;
-	if (hidden_dram_size != 4 * 1024 * 1024)
+
+	if (mapped.size < 16 || !parse_header(mapped.data))
+	{
+		unmap_file();
 		return false;
+	}
+
+	// Compressed dumps are decoded chunk by chunk, so there is nothing to gain from mapping them.
+	if (version != 2)
+	{
+		unmap_file();
+		return load_dump(path);
+	}
 
 	rdram_cache.resize(rdram_size);
-	rdram_hidden_cache.resize(hidden_dram_size);
+	rdram_hidden_cache.resize(hidden_rdram_size);
+	return rewind();
+}
+
+bool DumpPlayer::map_file(const char *path)
+{
+	unmap_file();
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+	                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	mapped.file = handle;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+	{
+		unmap_file();
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		unmap_file();
+		return false;
+	}
+	mapped.mapping = mapping;
+
+	void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr)
+	{
+		unmap_file();
+		return false;
+	}
+
+	mapped.data = static_cast<const uint8_t *>(ptr);
+	mapped.size = size_t(size.QuadPart);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(fd, &s) < 0 || s.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return false;
+
+	// Dumps are consumed front to back.
+	madvise(ptr, size_t(s.st_size), MADV_SEQUENTIAL);
+	mapped.data = static_cast<const uint8_t *>(ptr);
+	mapped.size = size_t(s.st_size);
+#endif
+
+	mapped.offset = 0;
 	return true;
 }
 
+void DumpPlayer::unmap_file()
+{
+#ifdef _WIN32
+	if (mapped.data)
+		UnmapViewOfFile(mapped.data);
+	if (mapped.mapping)
+		CloseHandle(mapped.mapping);
+	if (mapped.file)
+		CloseHandle(mapped.file);
+	mapped.mapping = nullptr;
+	mapped.file = nullptr;
+#else
+	if (mapped.data)
+		munmap(const_cast<uint8_t *>(mapped.data), mapped.size);
+#endif
+
+	mapped.data = nullptr;
+	mapped.size = 0;
+	mapped.offset = 0;
+}
+
 bool DumpPlayer::rewind()
 {
-	if (fseek(file.get(), 16, SEEK_SET) == 0)
+	if (mapped.data)
+		mapped.offset = 16;
+	else if (seek_file(file.get(), 16))
+		reset_chunk(16);
+	else
+		return false;
+
+	std::fill(rdram_cache.begin(), rdram_cache.end(), 0);
+	std::fill(rdram_hidden_cache.begin(), rdram_hidden_cache.end(), 0);
+	return true;
+}
+
+uint64_t DumpPlayer::tell() const
+{
+	if (mapped.data)
+		return mapped.offset;
+	else if (version == 3)
+	{
+		// Position inside a decoded chunk goes in the upper bits.
+		if (chunk.offset >= chunk.data.size())
+			return chunk.next_file_offset;
+		else
+			return chunk.file_offset | (uint64_t(chunk.offset) << ChunkFileOffsetBits);
+	}
+	else if (file)
+		return tell_file(file.get());
+	else
+		return 0;
+}
+
+bool DumpPlayer::seek(const DumpKeyframe &keyframe)
+{
+	if (mapped.data)
 	{
-		std::fill(rdram_cache.begin(), rdram_cache.end(), 0);
-		std::fill(rdram_hidden_cache.begin(), rdram_hidden_cache.end(), 0);
-		return true;
+		if (keyframe.dump_offset < 16 || keyframe.dump_offset > mapped.size)
+			return false;
+		mapped.offset = keyframe.dump_offset;
+	}
+	else if (version == 3)
+	{
+		uint64_t file_offset = keyframe.dump_offset & ((uint64_t(1) << ChunkFileOffsetBits) - 1);
+		size_t chunk_offset = size_t(keyframe.dump_offset >> ChunkFileOffsetBits);
+		if (!file || !seek_file(file.get(), file_offset))
+			return false;
+		reset_chunk(file_offset);
+		if (chunk_offset)
+		{
+			if (!read_chunk() || chunk_offset > chunk.data.size())
+				return false;
+			chunk.offset = chunk_offset;
+		}
 	}
 	else
+	{
+		if (!file || !seek_file(file.get(), keyframe.dump_offset))
+			return false;
+	}
+
+	if (keyframe.rdram_shadow.size() != rdram_cache.size() ||
+	    keyframe.hidden_rdram_shadow.size() != rdram_hidden_cache.size())
 		return false;
+	memcpy(rdram_cache.data(), keyframe.rdram_shadow.data(), rdram_cache.size());
+	memcpy(rdram_hidden_cache.data(), keyframe.hidden_rdram_shadow.data(), rdram_hidden_cache.size());
+
+	for (unsigned i = 0; i < unsigned(VIRegister::Count); i++)
+		if (keyframe.vi_register_mask & (1u << i))
+			iface->set_vi_register(VIRegister(i), keyframe.vi_registers[i]);
+
+	const uint32_t *cmd = keyframe.state_commands.data();
+	const uint32_t *end = cmd + keyframe.state_commands.size();
+	while (cmd + 2 <= end)
+	{
+		auto op = Op(cmd[0]);
+		uint32_t num_words = cmd[1];
+		cmd += 2;
+		if (cmd + num_words > end)
+			return false;
+		iface->command(op, num_words, cmd);
+		cmd += num_words;
+	}
+
+	return true;
 }
 
 void DumpPlayer::set_command_interface(CommandListenerInterface *iface_)
@@ -86,6 +305,11 @@ void DumpPlayer::set_command_interface(CommandListenerInterface *iface_)
 
 bool DumpPlayer::iterate()
 {
+	if (mapped.data)
+		return iterate_mapped();
+	else if (version == 3)
+		return iterate_compressed();
+
 	uint32_t command_u32;
 	if (!read_word(command_u32))
 		return false;
@@ -189,13 +413,295 @@ bool DumpPlayer::read_word(uint32_t &value)
 	return fread(&value, sizeof(value), 1, file.get()) == 1;
 }
 
+const uint8_t *DumpPlayer::read_mapped_bytes(size_t size)
+{
+	if (size > mapped.size - mapped.offset)
+		return nullptr;
+	const uint8_t *ptr = mapped.data + mapped.offset;
+	mapped.offset += size;
+	return ptr;
+}
+
+bool DumpPlayer::read_mapped_word(uint32_t &value)
+{
+	auto *ptr = read_mapped_bytes(sizeof(value));
+	if (!ptr)
+		return false;
+	memcpy(&value, ptr, sizeof(value));
+	return true;
+}
+
+bool DumpPlayer::iterate_mapped()
+{
+	uint32_t command_u32;
+	if (!read_mapped_word(command_u32))
+		return false;
+	auto command = static_cast<Command>(command_u32);
+
+	switch (command)
+	{
+	case Command::EndOfFile:
+		iface->eof();
+		return false;
+
+	case Command::SetVIRegister:
+	{
+		uint32_t index, value;
+		if (!read_mapped_word(index) || !read_mapped_word(value))
+			return false;
+
+		iface->set_vi_register(VIRegister(index), value);
+		break;
+	}
+
+	case Command::RDPCommand:
+	{
+		uint32_t cmd_id;
+		if (!read_mapped_word(cmd_id))
+			return false;
+		uint32_t word_count;
+		if (!read_mapped_word(word_count))
+			return false;
+
+		auto *ptr = read_mapped_bytes(size_t(word_count) * sizeof(uint32_t));
+		if (!ptr)
+			return false;
+
+		// Odd-sized RDRAM updates earlier in the dump can leave payloads misaligned.
+		const uint32_t *words;
+		if ((reinterpret_cast<uintptr_t>(ptr) & (alignof(uint32_t) - 1)) == 0)
+			words = reinterpret_cast<const uint32_t *>(ptr);
+		else
+		{
+			command_buffer.resize(word_count);
+			memcpy(command_buffer.data(), ptr, size_t(word_count) * sizeof(uint32_t));
+			words = command_buffer.data();
+		}
+
+		iface->command(static_cast<Op>(cmd_id), word_count, words);
+		break;
+	}
+
+	case Command::EndFrame:
+		iface->end_frame();
+		break;
+
+	case Command::SignalComplete:
+		iface->signal_complete();
+		break;
+
+	case Command::UpdateDram:
+	case Command::UpdateHiddenDram:
+	{
+		uint32_t offset, size;
+		if (!read_mapped_word(offset) || !read_mapped_word(size))
+			return false;
+
+		auto &cache = command == Command::UpdateHiddenDram ? rdram_hidden_cache : rdram_cache;
+		if (size_t(offset) + size > cache.size())
+			return false;
+
+		auto *ptr = read_mapped_bytes(size);
+		if (!ptr)
+			return false;
+
+		memcpy(cache.data() + offset, ptr, size);
+		break;
+	}
+
+	// The whole shadow is forwarded like in the stdio path,
+	// so RDRAM the RDP rendered to is overwritten with what the dump last uploaded there.
+	case Command::UpdateDramFlush:
+		iface->update_rdram(rdram_cache.data(), rdram_cache.size(), 0);
+		break;
+
+	case Command::UpdateHiddenDramFlush:
+		iface->update_hidden_rdram(rdram_hidden_cache.data(), rdram_hidden_cache.size(), 0);
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+void DumpPlayer::reset_chunk(uint64_t file_offset)
+{
+	chunk.data.clear();
+	chunk.offset = 0;
+	chunk.file_offset = file_offset;
+	chunk.next_file_offset = file_offset;
+}
+
+bool DumpPlayer::read_chunk()
+{
+	chunk.file_offset = tell_file(file.get());
+	chunk.offset = 0;
+	chunk.data.clear();
+
+	uint32_t decoded_size, compressed_size;
+	if (!read_word(decoded_size) || !read_word(compressed_size))
+		return false;
+	if (decoded_size > MaxChunkSize || compressed_size > decoded_size)
+		return false;
+
+	chunk.data.resize(decoded_size);
+	if (compressed_size == decoded_size)
+	{
+		// Stored as-is, didn't compress.
+		if (decoded_size && fread(chunk.data.data(), 1, decoded_size, file.get()) != decoded_size)
+			return false;
+	}
+	else
+	{
+		chunk.compressed.resize(compressed_size);
+		if (compressed_size && fread(chunk.compressed.data(), 1, compressed_size, file.get()) != compressed_size)
+			return false;
+		if (!decompress_block(chunk.compressed.data(), compressed_size, chunk.data.data(), decoded_size))
+			return false;
+	}
+
+	chunk.next_file_offset = tell_file(file.get());
+	return true;
+}
+
+const uint8_t *DumpPlayer::read_chunk_bytes(size_t size)
+{
+	if (size > chunk.data.size() - chunk.offset)
+		return nullptr;
+	const uint8_t *ptr = chunk.data.data() + chunk.offset;
+	chunk.offset += size;
+	return ptr;
+}
+
+bool DumpPlayer::read_chunk_word(uint32_t &value)
+{
+	auto *ptr = read_chunk_bytes(sizeof(value));
+	if (!ptr)
+		return false;
+	memcpy(&value, ptr, sizeof(value));
+	return true;
+}
+
+bool DumpPlayer::iterate_compressed()
+{
+	// Commands never straddle chunks.
+	if (chunk.offset >= chunk.data.size())
+	{
+		if (!read_chunk())
+			return false;
+	}
+
+	uint32_t command_u32;
+	if (!read_chunk_word(command_u32))
+		return false;
+	auto command = static_cast<Command>(command_u32);
+
+	switch (command)
+	{
+	case Command::EndOfFile:
+		iface->eof();
+		return false;
+
+	case Command::SetVIRegister:
+	{
+		uint32_t index, value;
+		if (!read_chunk_word(index) || !read_chunk_word(value))
+			return false;
+
+		iface->set_vi_register(VIRegister(index), value);
+		break;
+	}
+
+	case Command::RDPCommand:
+	{
+		uint32_t cmd_id;
+		if (!read_chunk_word(cmd_id))
+			return false;
+		uint32_t word_count;
+		if (!read_chunk_word(word_count))
+			return false;
+
+		auto *ptr = read_chunk_bytes(size_t(word_count) * sizeof(uint32_t));
+		if (!ptr)
+			return false;
+
+		const uint32_t *words;
+		if ((reinterpret_cast<uintptr_t>(ptr) & (alignof(uint32_t) - 1)) == 0)
+			words = reinterpret_cast<const uint32_t *>(ptr);
+		else
+		{
+			command_buffer.resize(word_count);
+			memcpy(command_buffer.data(), ptr, size_t(word_count) * sizeof(uint32_t));
+			words = command_buffer.data();
+		}
+
+		iface->command(static_cast<Op>(cmd_id), word_count, words);
+		break;
+	}
+
+	case Command::EndFrame:
+		iface->end_frame();
+		break;
+
+	case Command::SignalComplete:
+		iface->signal_complete();
+		break;
+
+	case Command::UpdateDram:
+	case Command::UpdateHiddenDram:
+	case Command::UpdateDramDelta:
+	case Command::UpdateHiddenDramDelta:
+	{
+		uint32_t offset, size;
+		if (!read_chunk_word(offset) || !read_chunk_word(size))
+			return false;
+
+		bool hidden = command == Command::UpdateHiddenDram || command == Command::UpdateHiddenDramDelta;
+		auto &cache = hidden ? rdram_hidden_cache : rdram_cache;
+		if (size_t(offset) + size > cache.size())
+			return false;
+
+		if (command == Command::UpdateDram || command == Command::UpdateHiddenDram)
+		{
+			auto *ptr = read_chunk_bytes(size);
+			if (!ptr)
+				return false;
+			memcpy(cache.data() + offset, ptr, size);
+		}
+		else
+		{
+			const uint8_t *ptr = chunk.data.data() + chunk.offset;
+			if (!apply_xor_delta(ptr, chunk.data.data() + chunk.data.size(), cache.data() + offset, size))
+				return false;
+			chunk.offset = size_t(ptr - chunk.data.data());
+		}
+		break;
+	}
+
+	case Command::UpdateDramFlush:
+		iface->update_rdram(rdram_cache.data(), rdram_cache.size(), 0);
+		break;
+
+	case Command::UpdateHiddenDramFlush:
+		iface->update_hidden_rdram(rdram_hidden_cache.data(), rdram_hidden_cache.size(), 0);
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
 size_t DumpPlayer::get_rdram_size() const
 {
-	return rdram_cache.size();
+	return rdram_size;
 }
 
 size_t DumpPlayer::get_hidden_rdram_size() const
 {
-	return rdram_hidden_cache.size();
+	return hidden_rdram_size;
 }
 }
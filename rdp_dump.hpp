@@ -30,6 +30,30 @@
 
 namespace RDP
 {
+struct DumpKeyframe;
+
+// Commands in the dump stream.
+enum class Command : uint32_t
+{
+	Invalid = 0,
+	UpdateDram = 1,
+	RDPCommand = 2,
+	SetVIRegister = 3,
+	EndFrame = 4,
+	SignalComplete = 5,
+	EndOfFile = 6,
+	UpdateDramFlush = 7,
+	UpdateHiddenDram = 8,
+	UpdateHiddenDramFlush = 9,
+	// RDPDUMP3 only, payload is encoded with encode_xor_delta().
+	UpdateDramDelta = 10,
+	UpdateHiddenDramDelta = 11
+};
+
+// RDPDUMP3 stores the RDPDUMP2 command stream in chunks of (u32 decoded size, u32 compressed size, data),
+// see rdp_dump_compression.hpp. A chunk which did not compress is stored with both sizes equal.
+constexpr unsigned ChunkFileOffsetBits = 40;
+constexpr uint32_t MaxChunkSize = 1u << (64 - ChunkFileOffsetBits);
 
 struct CommandListenerInterface
 {
@@ -53,13 +77,34 @@ struct CommandInterface
 class DumpPlayer : public CommandInterface
 {
 public:
+	DumpPlayer() = default;
+	~DumpPlayer();
+	// Owns the file mapping of load_dump_mapped(), which must not be unmapped twice.
+	DumpPlayer(const DumpPlayer &) = delete;
+	void operator=(const DumpPlayer &) = delete;
 	bool load_dump(const char *path);
+
+	// Maps the whole dump into memory and parses it in-place.
+	// Commands point straight into the mapping instead of being read into a buffer.
+	// RDRAM updates go through the same shadow copy as load_dump(), so playback is identical.
+	bool load_dump_mapped(const char *path);
+
 	size_t get_rdram_size() const override;
 	size_t get_hidden_rdram_size() const override;
 	bool iterate();
 	bool rewind();
 	void set_command_interface(CommandListenerInterface *iface) override;
 
+	// Position of the next command in the dump.
+	// For RDPDUMP3 this is the file offset of the current chunk in the lower 40 bits,
+	// with the offset into the decoded chunk in the upper bits.
+	uint64_t tell() const;
+
+	// Resumes playback from a keyframe, see rdp_dump_index.hpp.
+	// RDP and VI state in the keyframe is replayed through the command interface,
+	// restoring RDRAM and TMEM in the listener is up to the caller.
+	bool seek(const DumpKeyframe &keyframe);
+
 private:
 	CommandListenerInterface *iface = nullptr;
 
@@ -71,6 +116,42 @@ private:
 	std::vector<uint8_t> rdram_cache;
 	std::vector<uint8_t> rdram_hidden_cache;
 	std::vector<uint32_t> command_buffer;
+	size_t rdram_size = 0;
+	size_t hidden_rdram_size = 0;
 	bool read_word(uint32_t &value);
+	bool parse_header(const uint8_t *header);
+	unsigned version = 2;
+
+	struct
+	{
+		std::vector<uint8_t> data;
+		std::vector<uint8_t> compressed;
+		size_t offset = 0;
+		uint64_t file_offset = 0;
+		uint64_t next_file_offset = 0;
+	} chunk;
+
+	void reset_chunk(uint64_t file_offset);
+	bool read_chunk();
+	bool iterate_compressed();
+	bool read_chunk_word(uint32_t &value);
+	const uint8_t *read_chunk_bytes(size_t size);
+
+	struct
+	{
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+		size_t offset = 0;
+#ifdef _WIN32
+		void *file = nullptr;
+		void *mapping = nullptr;
+#endif
+	} mapped;
+
+	bool map_file(const char *path);
+	void unmap_file();
+	bool iterate_mapped();
+	bool read_mapped_word(uint32_t &value);
+	const uint8_t *read_mapped_bytes(size_t size);
 };
 }
\ No newline at end of file
@@ -0,0 +1,272 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_dump_compression.hpp"
+#include <string.h>
+#include <algorithm>
+
+namespace RDP
+{
+static constexpr size_t MinMatch = 4;
+static constexpr size_t LastLiterals = 5;
+static constexpr size_t MatchFindLimit = 12;
+static constexpr size_t MaxOffset = 0xffff;
+static constexpr unsigned HashLog = 16;
+
+static inline uint32_t read_u32(const uint8_t *ptr)
+{
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HashLog);
+}
+
+static void write_length(std::vector<uint8_t> &dst, size_t len)
+{
+	while (len >= 255)
+	{
+		dst.push_back(255);
+		len -= 255;
+	}
+	dst.push_back(uint8_t(len));
+}
+
+static void write_sequence(std::vector<uint8_t> &dst, const uint8_t *literals, size_t num_literals,
+                           size_t offset, size_t match_len)
+{
+	size_t match_code = match_len ? match_len - MinMatch : 0;
+	dst.push_back(uint8_t((std::min<size_t>(num_literals, 15) << 4) | std::min<size_t>(match_code, 15)));
+	if (num_literals >= 15)
+		write_length(dst, num_literals - 15);
+	dst.insert(dst.end(), literals, literals + num_literals);
+
+	if (match_len)
+	{
+		dst.push_back(uint8_t(offset & 0xff));
+		dst.push_back(uint8_t(offset >> 8));
+		if (match_code >= 15)
+			write_length(dst, match_code - 15);
+	}
+}
+
+void compress_block(const uint8_t *src, size_t size, std::vector<uint8_t> &dst)
+{
+	size_t anchor = 0;
+
+	if (size > MatchFindLimit)
+	{
+		std::vector<uint32_t> table(1u << HashLog, UINT32_MAX);
+		size_t match_limit = size - MatchFindLimit;
+		size_t pos = 0;
+
+		while (pos < match_limit)
+		{
+			uint32_t seq = read_u32(src + pos);
+			uint32_t &entry = table[hash_sequence(seq)];
+			size_t ref = entry;
+			entry = uint32_t(pos);
+
+			if (ref != UINT32_MAX && pos - ref <= MaxOffset && read_u32(src + ref) == seq)
+			{
+				size_t len = MinMatch;
+				while (pos + len < size - LastLiterals && src[ref + len] == src[pos + len])
+					len++;
+
+				write_sequence(dst, src + anchor, pos - anchor, pos - ref, len);
+				pos += len;
+				anchor = pos;
+			}
+			else
+				pos++;
+		}
+	}
+
+	write_sequence(dst, src + anchor, size - anchor, 0, 0);
+}
+
+static bool read_length(const uint8_t *&src, const uint8_t *end, size_t &len)
+{
+	uint8_t v;
+	do
+	{
+		if (src >= end)
+			return false;
+		v = *src++;
+		len += v;
+	} while (v == 255);
+	return true;
+}
+
+bool decompress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size)
+{
+	const uint8_t *end = src + size;
+	uint8_t *out = dst;
+	uint8_t *out_end = dst + dst_size;
+
+	while (src < end)
+	{
+		uint8_t token = *src++;
+
+		size_t num_literals = token >> 4;
+		if (num_literals == 15 && !read_length(src, end, num_literals))
+			return false;
+		if (num_literals > size_t(end - src) || num_literals > size_t(out_end - out))
+			return false;
+		memcpy(out, src, num_literals);
+		out += num_literals;
+		src += num_literals;
+
+		// Last sequence has no match.
+		if (src == end)
+			break;
+
+		if (end - src < 2)
+			return false;
+		size_t offset = src[0] | (size_t(src[1]) << 8);
+		src += 2;
+		if (offset == 0 || offset > size_t(out - dst))
+			return false;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && !read_length(src, end, match_len))
+			return false;
+		match_len += MinMatch;
+		if (match_len > size_t(out_end - out))
+			return false;
+
+		// Matches may overlap with the output being written.
+		const uint8_t *match = out - offset;
+		if (offset >= match_len)
+			memcpy(out, match, match_len);
+		else
+			for (size_t i = 0; i < match_len; i++)
+				out[i] = match[i];
+		out += match_len;
+	}
+
+	return out == out_end;
+}
+
+// Classify in small units so that short unchanged spans inside a modified region don't fragment the op list.
+static constexpr size_t DeltaUnitSize = 16;
+
+static DeltaOp classify_unit(const uint8_t *data, const uint8_t *shadow, size_t size)
+{
+	if (memcmp(data, shadow, size) == 0)
+		return DeltaOp::Skip;
+
+	for (size_t i = 0; i < size; i++)
+		if (data[i] != 0)
+			return DeltaOp::Xor;
+	return DeltaOp::Zero;
+}
+
+static void write_u32(std::vector<uint8_t> &out, uint32_t v)
+{
+	uint8_t bytes[4];
+	memcpy(bytes, &v, sizeof(v));
+	out.insert(out.end(), bytes, bytes + 4);
+}
+
+void encode_xor_delta(const uint8_t *data, uint8_t *shadow, size_t size, std::vector<uint8_t> &out)
+{
+	size_t pos = 0;
+	while (pos < size)
+	{
+		size_t unit = std::min(DeltaUnitSize, size - pos);
+		DeltaOp op = classify_unit(data + pos, shadow + pos, unit);
+
+		size_t run = unit;
+		while (pos + run < size)
+		{
+			size_t next_unit = std::min(DeltaUnitSize, size - pos - run);
+			if (classify_unit(data + pos + run, shadow + pos + run, next_unit) != op)
+				break;
+			run += next_unit;
+		}
+
+		write_u32(out, (uint32_t(op) << 28) | uint32_t(run));
+
+		if (op == DeltaOp::Xor)
+		{
+			size_t base = out.size();
+			out.resize(base + ((run + 3) & ~size_t(3)));
+			for (size_t i = 0; i < run; i++)
+				out[base + i] = data[pos + i] ^ shadow[pos + i];
+			memcpy(shadow + pos, data + pos, run);
+		}
+		else if (op == DeltaOp::Zero)
+			memset(shadow + pos, 0, run);
+
+		pos += run;
+	}
+}
+
+bool apply_xor_delta(const uint8_t *&src, const uint8_t *end, uint8_t *dst, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size)
+	{
+		if (end - src < 4)
+			return false;
+		uint32_t word = read_u32(src);
+		src += 4;
+
+		auto op = DeltaOp(word >> 28);
+		size_t run = word & 0x0fffffffu;
+		if (run == 0 || run > size - pos)
+			return false;
+
+		switch (op)
+		{
+		case DeltaOp::Skip:
+			break;
+
+		case DeltaOp::Zero:
+			memset(dst + pos, 0, run);
+			break;
+
+		case DeltaOp::Xor:
+		{
+			size_t padded = (run + 3) & ~size_t(3);
+			if (size_t(end - src) < padded)
+				return false;
+			for (size_t i = 0; i < run; i++)
+				dst[pos + i] ^= src[i];
+			src += padded;
+			break;
+		}
+
+		default:
+			return false;
+		}
+
+		pos += run;
+	}
+
+	return true;
+}
+}
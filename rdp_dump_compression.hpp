@@ -0,0 +1,53 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace RDP
+{
+// Helpers for the RDPDUMP3 format.
+
+// Fast LZ77 block codec, compatible with the LZ4 block format.
+// Appends compressed data to dst.
+void compress_block(const uint8_t *src, size_t size, std::vector<uint8_t> &dst);
+bool decompress_block(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size);
+
+// RDRAM updates are stored as a list of operations against the previous contents of the same range.
+// Each operation is a u32 with the opcode in the top 4 bits and byte count in the rest.
+// XOR operations are followed by the XOR-ed bytes, padded to 4 bytes.
+enum class DeltaOp : uint32_t
+{
+	Skip = 0,
+	Zero = 1,
+	Xor = 2
+};
+
+// Encodes data against shadow and updates shadow to match data.
+void encode_xor_delta(const uint8_t *data, uint8_t *shadow, size_t size, std::vector<uint8_t> &out);
+
+// Applies an encoded delta to dst. Advances src past the encoded data.
+bool apply_xor_delta(const uint8_t *&src, const uint8_t *end, uint8_t *dst, size_t size);
+}
@@ -0,0 +1,540 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_dump_index.hpp"
+#include "logging.hpp"
+#include <string.h>
+#include <algorithm>
+
+namespace RDP
+{
+// Layout of an index file:
+// Header: "RDPINDX2", rdram size, hidden RDRAM size, keyframe interval, reserved, u64 dump size, u64 dump hash (see get_dump_identity()).
+// Keyframe payloads, back to back.
+// Frame offset table: u64 per frame.
+// Keyframe table: (u32 frame, u32 reserved, u64 dump offset, u64 payload offset) per keyframe.
+// Footer: u64 frame table offset, u32 num frames, u32 num keyframes, u64 keyframe table offset, "RDPINDX2".
+static const char IndexMagic[8] = { 'R', 'D', 'P', 'I', 'N', 'D', 'X', '2' };
+static constexpr size_t IndexHeaderSize = 40;
+static constexpr size_t IndexFooterSize = 32;
+static constexpr size_t TMEMSize = 0x1000;
+
+static bool seek_file(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+	return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+static bool seek_file_end(FILE *file, int64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_END) == 0;
+#else
+	return fseeko(file, off_t(offset), SEEK_END) == 0;
+#endif
+}
+
+static uint64_t tell_file(FILE *file)
+{
+#ifdef _WIN32
+	return uint64_t(_ftelli64(file));
+#else
+	return uint64_t(ftello(file));
+#endif
+}
+
+template <typename T>
+static bool read_value(FILE *file, T &value)
+{
+	return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+static bool read_pages(FILE *file, uint8_t *data, size_t size)
+{
+	uint32_t count;
+	if (!read_value(file, count))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t page;
+		if (!read_value(file, page))
+			return false;
+		if ((size_t(page) + 1) * DumpIndexPageSize > size)
+			return false;
+		if (fread(data + page * DumpIndexPageSize, 1, DumpIndexPageSize, file) != DumpIndexPageSize)
+			return false;
+	}
+
+	return true;
+}
+
+// Identifies the dump an index was built from by its size and an FNV-1a hash, in 64-bit words,
+// over the first and last DumpIdentitySampleSize bytes. The start covers the header and the end
+// whatever was appended last, while loading an index stays cheap no matter how large the dump is.
+static constexpr size_t DumpIdentitySampleSize = 1024 * 1024;
+
+static bool get_dump_identity(const char *path, uint64_t &size, uint64_t &hash)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	bool ret = seek_file_end(f, 0);
+	size = ret ? tell_file(f) : 0;
+
+	std::vector<uint64_t> block(DumpIdentitySampleSize / sizeof(uint64_t));
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	const auto hash_range = [&](uint64_t offset, size_t range_size) -> bool {
+		if (!seek_file(f, offset) || fread(block.data(), 1, range_size, f) != range_size)
+			return false;
+
+		// Zero-pad to a whole word.
+		if (range_size & 7)
+			memset(reinterpret_cast<uint8_t *>(block.data()) + range_size, 0, 8 - (range_size & 7));
+
+		size_t num_words = (range_size + 7) / 8;
+		for (size_t i = 0; i < num_words; i++)
+			h = (h ^ block[i]) * 0x100000001b3ull;
+		return true;
+	};
+
+	if (ret)
+	{
+		size_t head_size = size_t(std::min<uint64_t>(size, DumpIdentitySampleSize));
+		ret = hash_range(0, head_size);
+
+		// Small dumps are hashed whole by the first range.
+		uint64_t tail_offset = std::max<uint64_t>(size - std::min<uint64_t>(size, DumpIdentitySampleSize), head_size);
+		if (ret && tail_offset < size)
+			ret = hash_range(tail_offset, size_t(size - tail_offset));
+	}
+
+	hash = h;
+	fclose(f);
+	return ret;
+}
+
+std::string get_dump_index_path(const std::string &dump_path)
+{
+	return dump_path + ".index";
+}
+
+bool DumpIndex::load(const char *path, const char *dump_path)
+{
+	frame_offsets.clear();
+	keyframes.clear();
+
+	file.reset(fopen(path, "rb"));
+	if (!file)
+		return false;
+
+	char magic[8];
+	uint32_t interval, reserved;
+	if (fread(magic, 1, sizeof(magic), file.get()) != sizeof(magic) || memcmp(magic, IndexMagic, sizeof(magic)) != 0)
+		return false;
+	if (!read_value(file.get(), rdram_size) || !read_value(file.get(), hidden_rdram_size) ||
+	    !read_value(file.get(), interval) || !read_value(file.get(), reserved))
+		return false;
+
+	uint64_t index_dump_size, index_dump_hash;
+	if (!read_value(file.get(), index_dump_size) || !read_value(file.get(), index_dump_hash))
+		return false;
+
+	uint64_t dump_size, dump_hash;
+	if (!get_dump_identity(dump_path, dump_size, dump_hash) ||
+	    dump_size != index_dump_size || dump_hash != index_dump_hash)
+	{
+		LOGE("Dump index %s was not built from %s, ignoring it.\n", path, dump_path);
+		file.reset();
+		return false;
+	}
+
+	if (!seek_file_end(file.get(), -int64_t(IndexFooterSize)))
+		return false;
+
+	uint64_t frame_table_offset, keyframe_table_offset;
+	uint32_t num_frames, num_keyframes;
+	if (!read_value(file.get(), frame_table_offset) || !read_value(file.get(), num_frames) ||
+	    !read_value(file.get(), num_keyframes) || !read_value(file.get(), keyframe_table_offset))
+		return false;
+	if (fread(magic, 1, sizeof(magic), file.get()) != sizeof(magic) || memcmp(magic, IndexMagic, sizeof(magic)) != 0)
+		return false;
+
+	frame_offsets.resize(num_frames);
+	if (!seek_file(file.get(), frame_table_offset))
+		return false;
+	if (num_frames && fread(frame_offsets.data(), sizeof(uint64_t), num_frames, file.get()) != num_frames)
+		return false;
+
+	keyframes.resize(num_keyframes);
+	if (!seek_file(file.get(), keyframe_table_offset))
+		return false;
+
+	for (auto &keyframe : keyframes)
+	{
+		if (!read_value(file.get(), keyframe.frame) || !read_value(file.get(), reserved) ||
+		    !read_value(file.get(), keyframe.dump_offset) || !read_value(file.get(), keyframe.payload_offset))
+			return false;
+	}
+
+	return true;
+}
+
+unsigned DumpIndex::get_num_frames() const
+{
+	return unsigned(frame_offsets.size());
+}
+
+uint64_t DumpIndex::get_frame_offset(unsigned frame) const
+{
+	return frame < frame_offsets.size() ? frame_offsets[frame] : 0;
+}
+
+bool DumpIndex::find_keyframe(unsigned frame, unsigned &index) const
+{
+	auto itr = std::upper_bound(keyframes.begin(), keyframes.end(), frame,
+	                            [](unsigned f, const DumpKeyframeLocation &keyframe) { return f < keyframe.frame; });
+	if (itr == keyframes.begin())
+		return false;
+
+	index = unsigned(itr - keyframes.begin()) - 1;
+	return true;
+}
+
+unsigned DumpIndex::get_keyframe_frame(unsigned index) const
+{
+	return keyframes[index].frame;
+}
+
+bool DumpIndex::load_keyframe(unsigned index, DumpKeyframe &keyframe) const
+{
+	if (index >= keyframes.size())
+		return false;
+
+	auto &location = keyframes[index];
+	FILE *f = file.get();
+	if (!seek_file(f, location.payload_offset))
+		return false;
+
+	keyframe.frame = location.frame;
+	keyframe.dump_offset = location.dump_offset;
+
+	uint32_t num_state_words;
+	if (!read_value(f, keyframe.vi_register_mask))
+		return false;
+	if (fread(keyframe.vi_registers, sizeof(uint32_t), unsigned(VIRegister::Count), f) != unsigned(VIRegister::Count))
+		return false;
+	if (!read_value(f, num_state_words))
+		return false;
+	keyframe.state_commands.resize(num_state_words);
+	if (num_state_words && fread(keyframe.state_commands.data(), sizeof(uint32_t), num_state_words, f) != num_state_words)
+		return false;
+
+	keyframe.rdram_shadow.assign(rdram_size, 0);
+	keyframe.hidden_rdram_shadow.assign(hidden_rdram_size, 0);
+	if (!read_pages(f, keyframe.rdram_shadow.data(), rdram_size) ||
+	    !read_pages(f, keyframe.hidden_rdram_shadow.data(), hidden_rdram_size))
+		return false;
+
+	// Replayer memory is stored as a delta against the shadow copies.
+	keyframe.rdram = keyframe.rdram_shadow;
+	keyframe.hidden_rdram = keyframe.hidden_rdram_shadow;
+	if (!read_pages(f, keyframe.rdram.data(), rdram_size) ||
+	    !read_pages(f, keyframe.hidden_rdram.data(), hidden_rdram_size))
+		return false;
+
+	keyframe.tmem.resize(TMEMSize);
+	if (fread(keyframe.tmem.data(), 1, TMEMSize, f) != TMEMSize)
+		return false;
+
+	return true;
+}
+
+DumpIndexBuilder::DumpIndexBuilder(DumpPlayer &player_, ReplayerDriver &driver_)
+	: player(player_), driver(driver_)
+{
+}
+
+bool DumpIndexBuilder::begin(const char *path, const char *dump_path, unsigned keyframe_interval_)
+{
+	uint64_t dump_size, dump_hash;
+	if (!get_dump_identity(dump_path, dump_size, dump_hash))
+		return false;
+
+	file.reset(fopen(path, "wb"));
+	if (!file)
+		return false;
+
+	keyframe_interval = keyframe_interval_;
+	frame = 0;
+	failed = false;
+	frame_offsets.clear();
+	keyframes.clear();
+	state_commands.clear();
+	state_commands.resize(80);
+	state_sequence = 0;
+	vi_register_mask = 0;
+	memset(vi_registers, 0, sizeof(vi_registers));
+	rdram_shadow.assign(player.get_rdram_size(), 0);
+	hidden_rdram_shadow.assign(player.get_hidden_rdram_size(), 0);
+
+	const uint32_t header[4] = {
+		uint32_t(rdram_shadow.size()), uint32_t(hidden_rdram_shadow.size()), keyframe_interval, 0,
+	};
+	write_data(IndexMagic, sizeof(IndexMagic));
+	write_data(header, sizeof(header));
+	write_data(&dump_size, sizeof(dump_size));
+	write_data(&dump_hash, sizeof(dump_hash));
+
+	frame_offsets.push_back(player.tell());
+	return !failed;
+}
+
+bool DumpIndexBuilder::end()
+{
+	if (!file)
+		return false;
+
+	uint64_t frame_table_offset = tell_file(file.get());
+	write_data(frame_offsets.data(), frame_offsets.size() * sizeof(uint64_t));
+
+	uint64_t keyframe_table_offset = tell_file(file.get());
+	for (auto &keyframe : keyframes)
+	{
+		const uint32_t words[2] = { keyframe.frame, 0 };
+		write_data(words, sizeof(words));
+		write_data(&keyframe.dump_offset, sizeof(keyframe.dump_offset));
+		write_data(&keyframe.payload_offset, sizeof(keyframe.payload_offset));
+	}
+
+	const uint32_t counts[2] = { uint32_t(frame_offsets.size()), uint32_t(keyframes.size()) };
+	write_data(&frame_table_offset, sizeof(frame_table_offset));
+	write_data(counts, sizeof(counts));
+	write_data(&keyframe_table_offset, sizeof(keyframe_table_offset));
+	write_data(IndexMagic, sizeof(IndexMagic));
+
+	bool ret = !failed && fflush(file.get()) == 0;
+	file.reset();
+	return ret;
+}
+
+void DumpIndexBuilder::write_data(const void *data, size_t size)
+{
+	if (size && fwrite(data, 1, size, file.get()) != size)
+		failed = true;
+}
+
+void DumpIndexBuilder::write_pages(const uint8_t *data, const uint8_t *base, size_t size)
+{
+	static const uint8_t zero_page[DumpIndexPageSize] = {};
+	uint32_t num_pages = uint32_t(size / DumpIndexPageSize);
+
+	const auto page_differs = [&](uint32_t page) {
+		return memcmp(data + page * DumpIndexPageSize,
+		              base ? base + page * DumpIndexPageSize : zero_page,
+		              DumpIndexPageSize) != 0;
+	};
+
+	uint32_t count = 0;
+	for (uint32_t page = 0; page < num_pages; page++)
+		if (page_differs(page))
+			count++;
+	write_data(&count, sizeof(count));
+
+	for (uint32_t page = 0; page < num_pages; page++)
+	{
+		if (page_differs(page))
+		{
+			write_data(&page, sizeof(page));
+			write_data(data + page * DumpIndexPageSize, DumpIndexPageSize);
+		}
+	}
+}
+
+void DumpIndexBuilder::write_keyframe()
+{
+	driver.idle();
+	driver.invalidate_caches();
+
+	DumpKeyframeLocation location = {};
+	location.frame = frame;
+	location.dump_offset = player.tell();
+	location.payload_offset = tell_file(file.get());
+
+	write_data(&vi_register_mask, sizeof(vi_register_mask));
+	write_data(vi_registers, sizeof(vi_registers));
+
+	std::vector<const StateCommand *> ordered;
+	for (auto &cmd : state_commands)
+		if (cmd.sequence)
+			ordered.push_back(&cmd);
+	std::sort(ordered.begin(), ordered.end(), [](const StateCommand *a, const StateCommand *b) {
+		return a->sequence < b->sequence;
+	});
+
+	std::vector<uint32_t> packed;
+	for (auto *cmd : ordered)
+	{
+		packed.push_back(uint32_t(cmd->op));
+		packed.push_back(uint32_t(cmd->words.size()));
+		packed.insert(packed.end(), cmd->words.begin(), cmd->words.end());
+	}
+	uint32_t num_state_words = uint32_t(packed.size());
+	write_data(&num_state_words, sizeof(num_state_words));
+	write_data(packed.data(), packed.size() * sizeof(uint32_t));
+
+	write_pages(rdram_shadow.data(), nullptr, rdram_shadow.size());
+	write_pages(hidden_rdram_shadow.data(), nullptr, hidden_rdram_shadow.size());
+
+	size_t rdram_size = std::min(rdram_shadow.size(), driver.get_rdram_size());
+	size_t hidden_rdram_size = std::min(hidden_rdram_shadow.size(), driver.get_hidden_rdram_size());
+	write_pages(driver.get_rdram(), rdram_shadow.data(), rdram_size);
+	write_pages(driver.get_hidden_rdram(), hidden_rdram_shadow.data(), hidden_rdram_size);
+	write_data(driver.get_tmem(), TMEMSize);
+
+	keyframes.push_back(location);
+}
+
+static int get_state_command_slot(Op op, const uint32_t *words)
+{
+	unsigned tile = (words[1] >> 24) & 7;
+
+	switch (op)
+	{
+	case Op::SetTile:
+		return 64 + tile;
+
+	// Loads update the tile coordinates just like SET_TILE_SIZE does.
+	// TMEM contents are restored separately, so replaying the load only serves to restore the tile size.
+	case Op::SetTileSize:
+	case Op::LoadTile:
+	case Op::LoadBlock:
+	case Op::LoadTLut:
+		return 72 + tile;
+
+	case Op::SetKeyGB:
+	case Op::SetKeyR:
+	case Op::SetConvert:
+	case Op::SetScissor:
+	case Op::SetPrimDepth:
+	case Op::SetOtherModes:
+	case Op::SetFillColor:
+	case Op::SetFogColor:
+	case Op::SetBlendColor:
+	case Op::SetPrimColor:
+	case Op::SetEnvColor:
+	case Op::SetCombine:
+	case Op::SetTextureImage:
+	case Op::SetMaskImage:
+	case Op::SetColorImage:
+		return int(op);
+
+	default:
+		return -1;
+	}
+}
+
+void DumpIndexBuilder::set_vi_register(VIRegister reg, uint32_t value)
+{
+	if (unsigned(reg) < unsigned(VIRegister::Count))
+	{
+		vi_registers[unsigned(reg)] = value;
+		vi_register_mask |= 1u << unsigned(reg);
+	}
+	driver.set_vi_register(reg, value);
+}
+
+void DumpIndexBuilder::signal_complete()
+{
+	driver.signal_complete();
+}
+
+void DumpIndexBuilder::command(Op cmd_id, uint32_t num_words, const uint32_t *words)
+{
+	if (num_words >= 2)
+	{
+		int slot = get_state_command_slot(cmd_id, words);
+		if (slot >= 0)
+		{
+			auto &cmd = state_commands[slot];
+			cmd.sequence = ++state_sequence;
+			cmd.op = cmd_id;
+			cmd.words.assign(words, words + num_words);
+		}
+	}
+
+	driver.command(cmd_id, num_words, words);
+}
+
+void DumpIndexBuilder::end_frame()
+{
+	driver.end_frame();
+	frame++;
+	frame_offsets.push_back(player.tell());
+	if (keyframe_interval && (frame % keyframe_interval) == 0)
+		write_keyframe();
+}
+
+void DumpIndexBuilder::eof()
+{
+	driver.eof();
+}
+
+void DumpIndexBuilder::update_rdram(const void *data, size_t size, size_t offset)
+{
+	if (offset + size <= rdram_shadow.size())
+		memcpy(rdram_shadow.data() + offset, data, size);
+	driver.update_rdram(data, size, offset);
+}
+
+void DumpIndexBuilder::update_hidden_rdram(const void *data, size_t size, size_t offset)
+{
+	if (offset + size <= hidden_rdram_shadow.size())
+		memcpy(hidden_rdram_shadow.data() + offset, data, size);
+	driver.update_hidden_rdram(data, size, offset);
+}
+
+void restore_keyframe_memory(ReplayerDriver &driver, const DumpKeyframe &keyframe)
+{
+	driver.idle();
+	driver.invalidate_caches();
+
+	auto *rdram = driver.get_rdram();
+	if (rdram)
+		memcpy(rdram, keyframe.rdram.data(), std::min(keyframe.rdram.size(), driver.get_rdram_size()));
+
+	auto *hidden_rdram = driver.get_hidden_rdram();
+	if (hidden_rdram)
+		memcpy(hidden_rdram, keyframe.hidden_rdram.data(), std::min(keyframe.hidden_rdram.size(), driver.get_hidden_rdram_size()));
+
+	auto *tmem = driver.get_tmem();
+	if (tmem)
+		memcpy(tmem, keyframe.tmem.data(), std::min<size_t>(keyframe.tmem.size(), TMEMSize));
+
+	driver.flush_caches();
+}
+}
@@ -0,0 +1,152 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <string>
+#include "rdp_dump.hpp"
+#include "replayer_driver.hpp"
+
+namespace RDP
+{
+// Sidecar index for RDP dumps, normally stored as <dump>.index.
+// Records where every frame begins in the dump and stores periodic keyframes
+// with enough state to resume playback from that frame without replaying the dump up to it.
+constexpr unsigned DumpIndexPageSize = 1024;
+
+struct DumpKeyframe
+{
+	// Frame which begins at dump_offset, i.e. number of EndFrame commands before it.
+	unsigned frame = 0;
+	uint64_t dump_offset = 0;
+
+	uint32_t vi_register_mask = 0;
+	uint32_t vi_registers[unsigned(VIRegister::Count)] = {};
+
+	// Last instance of every RDP state command in dump order, packed as (op, num_words, words...).
+	std::vector<uint32_t> state_commands;
+
+	// RDRAM as last uploaded by the dump itself.
+	std::vector<uint8_t> rdram_shadow;
+	std::vector<uint8_t> hidden_rdram_shadow;
+
+	// Memory as seen by the replayer, i.e. including what the RDP rendered since last upload.
+	std::vector<uint8_t> rdram;
+	std::vector<uint8_t> hidden_rdram;
+	std::vector<uint8_t> tmem;
+};
+
+struct DumpKeyframeLocation
+{
+	uint32_t frame;
+	uint64_t dump_offset;
+	uint64_t payload_offset;
+};
+
+class DumpIndex
+{
+public:
+	// Fails if the index was built from a different dump than the one at dump_path.
+	bool load(const char *path, const char *dump_path);
+	unsigned get_num_frames() const;
+	uint64_t get_frame_offset(unsigned frame) const;
+
+	// Finds the last keyframe at or before frame.
+	bool find_keyframe(unsigned frame, unsigned &index) const;
+	unsigned get_keyframe_frame(unsigned index) const;
+	bool load_keyframe(unsigned index, DumpKeyframe &keyframe) const;
+
+private:
+	struct FileDeleter
+	{
+		void operator()(FILE *f) { fclose(f); }
+	};
+	std::unique_ptr<FILE, FileDeleter> file;
+	uint32_t rdram_size = 0;
+	uint32_t hidden_rdram_size = 0;
+	std::vector<uint64_t> frame_offsets;
+
+	std::vector<DumpKeyframeLocation> keyframes;
+};
+
+// Sits between a DumpPlayer and a replayer and writes an index while the dump plays back.
+class DumpIndexBuilder : public CommandListenerInterface
+{
+public:
+	DumpIndexBuilder(DumpPlayer &player, ReplayerDriver &driver);
+	// dump_path is the dump the player reads, its size and content hash are stored in the index.
+	bool begin(const char *path, const char *dump_path, unsigned keyframe_interval);
+	bool end();
+
+	void set_vi_register(VIRegister reg, uint32_t value) override;
+	void signal_complete() override;
+	void command(Op cmd_id, uint32_t num_words, const uint32_t *words) override;
+	void end_frame() override;
+	void eof() override;
+	void update_rdram(const void *data, size_t size, size_t offset) override;
+	void update_hidden_rdram(const void *data, size_t size, size_t offset) override;
+
+private:
+	DumpPlayer &player;
+	ReplayerDriver &driver;
+
+	struct FileDeleter
+	{
+		void operator()(FILE *f) { fclose(f); }
+	};
+	std::unique_ptr<FILE, FileDeleter> file;
+	unsigned keyframe_interval = 0;
+	unsigned frame = 0;
+	bool failed = false;
+
+	std::vector<uint64_t> frame_offsets;
+	std::vector<DumpKeyframeLocation> keyframes;
+
+	std::vector<uint8_t> rdram_shadow;
+	std::vector<uint8_t> hidden_rdram_shadow;
+	uint32_t vi_register_mask = 0;
+	uint32_t vi_registers[unsigned(VIRegister::Count)] = {};
+
+	struct StateCommand
+	{
+		uint64_t sequence = 0;
+		Op op = Op::Nop;
+		std::vector<uint32_t> words;
+	};
+	std::vector<StateCommand> state_commands;
+	uint64_t state_sequence = 0;
+
+	void write_keyframe();
+	void write_pages(const uint8_t *data, const uint8_t *base, size_t size);
+	void write_data(const void *data, size_t size);
+};
+
+// Writes keyframe memory into a replayer. Call after DumpPlayer::seek().
+void restore_keyframe_memory(ReplayerDriver &driver, const DumpKeyframe &keyframe);
+
+// Default sidecar path for a dump.
+std::string get_dump_index_path(const std::string &dump_path);
+}
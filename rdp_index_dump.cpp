@@ -0,0 +1,127 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_dump.hpp"
+#include "rdp_dump_index.hpp"
+#include "replayer_driver.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "global_managers.hpp"
+#include <stdlib.h>
+
+using namespace RDP;
+
+struct NullEventInterface : ReplayerEventInterface
+{
+	void update_screen(const void *, unsigned, unsigned, unsigned) override {}
+	void notify_command(Op, uint32_t, const uint32_t *) override {}
+	void message(MessageType, const char *) override {}
+	void eof() override {}
+	void set_context_index(unsigned) override {}
+	void signal_complete() override {}
+};
+
+static void print_help()
+{
+	LOGE("Usage: rdp-index-dump\n"
+	     "\t<Path to dump>\n"
+	     "\t[--output <path>]\n"
+	     "\t[--keyframe-interval <frames>]\n"
+	     "\t[--mmap]\n"
+	);
+}
+
+static int main_inner(int argc, char *argv[])
+{
+	std::string path;
+	std::string output;
+	unsigned keyframe_interval = 256;
+	bool mmap = false;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](Util::CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--keyframe-interval", [&](Util::CLIParser &parser) { keyframe_interval = parser.next_uint(); });
+	cbs.add("--mmap", [&](Util::CLIParser &) { mmap = true; });
+	cbs.default_handler = [&](const char *arg) { path = arg; };
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (path.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (output.empty())
+		output = get_dump_index_path(path);
+
+	DumpPlayer player;
+	if (!(mmap ? player.load_dump_mapped(path.c_str()) : player.load_dump(path.c_str())))
+	{
+		LOGE("Failed to load dump: %s\n", path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Keyframes are taken from the reference renderer, since that is what paraLLEl-RDP is validated against.
+	NullEventInterface iface;
+	auto reference = create_replayer_driver_angrylion(player, iface);
+	if (!reference)
+		return EXIT_FAILURE;
+
+	DumpIndexBuilder builder(player, *reference);
+	player.set_command_interface(&builder);
+
+	if (!builder.begin(output.c_str(), path.c_str(), keyframe_interval))
+	{
+		LOGE("Failed to open index for writing: %s\n", output.c_str());
+		return EXIT_FAILURE;
+	}
+
+	while (player.iterate())
+	{
+	}
+
+	if (!builder.end())
+	{
+		LOGE("Failed to write index: %s\n", output.c_str());
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Wrote index to %s.\n", output.c_str());
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	Granite::Global::init();
+	int ret = main_inner(argc, argv);
+	Granite::Global::deinit();
+	return ret;
+}
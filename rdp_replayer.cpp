@@ -22,6 +22,7 @@
 
 #include "replayer_driver.hpp"
 #include "rdp_dump.hpp"
+#include "rdp_dump_index.hpp"
 
 #include <vector>
 
@@ -80,6 +81,8 @@ struct DebugApplication : Application, EventHandler, ReplayerEventInterface
 	}
 
 	DumpPlayer dump;
+	DumpIndex dump_index;
+	bool has_dump_index = false;
 	std::unique_ptr<ReplayerDriver> replayers[2];
 	std::unique_ptr<ReplayerDriver> combined_replayer;
 	std::string dump_path;
@@ -106,6 +109,7 @@ struct DebugApplication : Application, EventHandler, ReplayerEventInterface
 
 	template <typename Op>
 	void replay_until(const Op &op);
+	void seek_to_keyframe(unsigned target_frame);
 
 	void add_message(std::string message, MessageType type);
 
@@ -550,6 +554,9 @@ void DebugApplication::on_device_created(const DeviceCreatedEvent &e)
 	replayers[1] = create_replayer_driver_parallel(e.get_device(), dump, *this);
 	combined_replayer = create_side_by_side_driver(replayers[0].get(), replayers[1].get(), *this);
 	dump.set_command_interface(combined_replayer.get());
+	has_dump_index = dump_index.load(get_dump_index_path(dump_path).c_str(), dump_path.c_str());
+	if (has_dump_index)
+		add_message("Loaded dump index.", MessageType::Info);
 #else
 	replayers[0] = create_replayer_driver_angrylion(builder, *this);
 	replayers[1] = create_replayer_driver_parallel(e.get_device(), builder, *this);
@@ -605,6 +612,28 @@ void DebugApplication::render_scanout_texture(CommandBuffer &cmd)
 	}
 }
 
+void DebugApplication::seek_to_keyframe(unsigned target_frame)
+{
+	// Only worth it if the keyframe is ahead of where we are.
+	unsigned keyframe_index;
+	if (!has_dump_index || !dump_index.find_keyframe(target_frame, keyframe_index) ||
+	    dump_index.get_keyframe_frame(keyframe_index) <= ui.replay_vi_frame_count)
+		return;
+
+	DumpKeyframe keyframe;
+	if (!dump_index.load_keyframe(keyframe_index, keyframe) || !dump.seek(keyframe))
+	{
+		add_message("Failed to seek to keyframe!", MessageType::Error);
+		return;
+	}
+
+	for (auto &replayer : replayers)
+		restore_keyframe_memory(*replayer, keyframe);
+	ui.replay_vi_frame_count = keyframe.frame;
+	ui.replay_draw_count_in_frame = 0;
+	add_message(Util::join("Seeked to keyframe at frame ", keyframe.frame, "."), MessageType::Info);
+}
+
 template <typename Op>
 void DebugApplication::replay_until(const Op &op)
 {
@@ -788,6 +817,7 @@ void DebugApplication::render_frame(double, double)
 	{
 		// Iterate until we get a vdac_scanout event or iterate fails (EOF usually, just freeze on last frame until we rewind.
 		unsigned target_frame = ui.replay_vi_frame_count + std::max(ui.frame_step, 1u);
+		seek_to_keyframe(target_frame);
 		replay_until([&]() { return ui.replay_vi_frame_count >= target_frame; });
 	}
 	else if (ui.replay_mode == ReplayMode::DrawCall)
@@ -22,9 +22,29 @@
 
 #include "conformance_utils.hpp"
 #include "rdp_dump.hpp"
+#include "rdp_dump_index.hpp"
 #include "cli_parser.hpp"
 #include "context.hpp"
 #include "device.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <thread>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
 
 using namespace RDP;
 
@@ -34,169 +54,832 @@ static void print_help()
 	     "\t<Path to dump>\n"
 	     "\t[--begin-frame <frame>]\n"
 	     "\t[--sync-only]\n"
+	     "\t[--mmap]\n"
+	     "\t[--index <path>]\n"
+	     "\t[--result <path>]\n"
+	     "\t[--bisect]\n"
+	     "\t[--compare-interval <syncs>]\n"
+	     "\t[--full-compare]\n"
+	     "\n"
+	     "Batch mode, validates every dump in a directory or manifest (one path per line) in separate processes:\n"
+	     "\t--batch <directory or manifest>\n"
+	     "\t[--jobs <count>]\n"
+	     "\t[--summary <path>]\n"
+	     "\t[--work-dir <directory>]\n"
 	);
 }
 
-static int main_inner(int argc, char *argv[])
+struct ValidateOptions
 {
 	std::string path;
+	std::string index_path;
 	unsigned begin_frame = 0;
 	bool sync_only = false;
 	bool capture = false;
+	bool mmap = false;
+	bool bisect = false;
+	bool full_compare = false;
+	unsigned compare_interval = 0;
+};
 
-	Util::CLICallbacks cbs;
-	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
-	cbs.add("--begin-frame", [&](Util::CLIParser &parser) { begin_frame = parser.next_uint(); });
-	cbs.add("--sync-only", [&](Util::CLIParser &) { sync_only = true; });
-	cbs.add("--capture", [&](Util::CLIParser &) { capture = true; });
-	cbs.default_handler = [&](const char *arg) { path = arg; };
-	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+struct ValidateResult
+{
+	enum class Status
+	{
+		Pass,
+		Fail,
+		Error
+	};
+	Status status = Status::Error;
+	unsigned frame = 0;
+	unsigned draw = 0;
+	unsigned sync = 0;
+	double replay_time = 0.0;
+	std::string message;
+};
 
-	if (capture)
-		if (!Vulkan::Device::init_renderdoc_capture())
-			LOGE("Failed to initialize RenderDoc capture.\n");
+static const char *status_to_string(ValidateResult::Status status)
+{
+	switch (status)
+	{
+	case ValidateResult::Status::Pass:
+		return "pass";
+	case ValidateResult::Status::Fail:
+		return "fail";
+	default:
+		return "error";
+	}
+}
 
-	if (!parser.parse())
+static std::string escape_json(const std::string &str)
+{
+	std::string ret;
+	for (char c : str)
 	{
-		print_help();
-		return EXIT_FAILURE;
+		switch (c)
+		{
+		case '"':
+			ret += "\\\"";
+			break;
+		case '\\':
+			ret += "\\\\";
+			break;
+		case '\n':
+			ret += "\\n";
+			break;
+		case '\t':
+			ret += "\\t";
+			break;
+		default:
+			if (uint8_t(c) < 0x20)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", unsigned(uint8_t(c)));
+				ret += buf;
+			}
+			else
+				ret += c;
+			break;
+		}
 	}
-	else if (parser.is_ended_state())
-		return EXIT_SUCCESS;
+	return ret;
+}
+
+static bool write_result(const std::string &path, const ValidateResult &result)
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	file << "{ \"status\": \"" << status_to_string(result.status) << "\""
+	     << ", \"frame\": " << result.frame
+	     << ", \"draw\": " << result.draw
+	     << ", \"sync\": " << result.sync
+	     << ", \"replay_time_seconds\": " << result.replay_time
+	     << ", \"message\": \"" << escape_json(result.message) << "\" }\n";
+	return bool(file);
+}
+
+static void report_fault_coordinate(const Interface &iface, uint32_t fault_addr, bool fault_hidden)
+{
+	if (fault_hidden)
+		fault_addr *= 2;
+
+	if (!iface.fb.width)
+		return;
+
+	int color_x, color_y, depth_x, depth_y;
+	int color_offset = int(fault_addr - iface.fb.addr);
+	int depth_offset = int(fault_addr - iface.fb.depth_addr);
+	depth_offset >>= 1;
+
+	switch (iface.fb.size)
+	{
+	case 2:
+		color_offset >>= 1;
+		break;
+
+	case 3:
+		color_offset >>= 2;
+		break;
+
+	default:
+		break;
+	}
+
+	color_x = color_offset % iface.fb.width;
+	color_y = color_offset / iface.fb.width;
+	depth_x = depth_offset % iface.fb.width;
+	depth_y = depth_offset / iface.fb.width;
+
+	if ((color_offset <= depth_offset || depth_offset < 0) && color_offset >= 0)
+	{
+		if (fault_hidden)
+			LOGE("Failure at hidden color coord (%d, %d).\n", color_x, color_y);
+		else
+			LOGE("Failure at color coord (%d, %d).\n", color_x, color_y);
+	}
+	else if ((depth_offset <= color_offset || color_offset < 0) && depth_offset >= 0)
+	{
+		if (fault_hidden)
+			LOGE("Failure at hidden depth coord (%d, %d).\n", depth_x, depth_y);
+		else
+			LOGE("Failure at depth coord (%d, %d).\n", depth_x, depth_y);
+	}
+	else
+		LOGE("Uncertain failure coordinate.\n");
+}
+
+enum class ReplayGranularity
+{
+	Draw,
+	Sync,
+	Frame
+};
+
+// Replays until the next draw, until sync_interval syncs have completed, or until the frame ends.
+static void replay_step(DumpPlayer &player, const Interface &iface, ReplayGranularity granularity, unsigned sync_interval)
+{
+	unsigned current_draw_count = iface.draw_calls_for_context[1];
+	unsigned current_frame_count = iface.frame_count_for_context[1];
+	unsigned current_syncs = iface.syncs_for_context[1];
+
+	while (current_frame_count == iface.frame_count_for_context[1] &&
+	       (granularity != ReplayGranularity::Draw || current_draw_count == iface.draw_calls_for_context[1]) &&
+	       (granularity != ReplayGranularity::Sync || iface.syncs_for_context[1] - current_syncs < sync_interval) &&
+	       player.iterate())
+	{
+	}
+}
+
+// Between frames, only pages the replayers report as written are compared, through page hashes.
+// All of RDRAM is still compared whenever a frame ends, in case a replayer writes outside of what is tracked.
+struct CompareState
+{
+	RDRAMPageHashes hashes;
+	std::vector<uint32_t> reference_pages, reference_hidden_pages;
+	std::vector<uint32_t> gpu_pages, gpu_hidden_pages;
+	unsigned last_frame = ~0u;
+};
+
+static bool compare_rdram_incremental(ReplayerState &state, const ValidateOptions &opts, CompareState &compare,
+                                      uint32_t *fault_addr, bool *fault_hidden)
+{
+	unsigned frame = state.iface.frame_count_for_context[1];
+	bool frame_changed = frame != compare.last_frame;
+	compare.last_frame = frame;
+
+	if (opts.full_compare)
+		return compare_rdram(*state.reference, *state.gpu, fault_addr, fault_hidden);
+
+	state.reference->consume_dirty_pages(compare.reference_pages, compare.reference_hidden_pages);
+	state.gpu->consume_dirty_pages(compare.gpu_pages, compare.gpu_hidden_pages);
+	if (!compare_rdram_hashed(*state.reference, *state.gpu, compare.hashes,
+	                          &compare.reference_pages, &compare.reference_hidden_pages,
+	                          &compare.gpu_pages, &compare.gpu_hidden_pages,
+	                          fault_addr, fault_hidden))
+	{
+		return false;
+	}
+
+	return !frame_changed || compare_rdram(*state.reference, *state.gpu, fault_addr, fault_hidden);
+}
+
+static bool compare_replayers(ReplayerState &state, const ValidateOptions &opts, CompareState &compare,
+                              ValidateResult &result)
+{
+	auto &iface = state.iface;
+	unsigned frame = iface.frame_count_for_context[1];
+	unsigned draw = iface.draw_calls_for_context[1];
+	unsigned sync = iface.syncs_for_context[1];
+
+	uint32_t fault_addr;
+	bool fault_hidden = false;
+	const char *what = nullptr;
+	static const char tmem_mismatch[] = "TMEM mismatch.";
+
+	if (!compare_memory("TMEM", state.reference->get_tmem(), state.gpu->get_tmem(), 4096, &fault_addr))
+		what = tmem_mismatch;
+	else if (!compare_rdram_incremental(state, opts, compare, &fault_addr, &fault_hidden))
+		what = fault_hidden ? "Hidden RDRAM mismatch." : "RDRAM mismatch.";
+	else
+		return true;
+
+	if (opts.sync_only)
+		LOGE("Dump validation failed in frame %u, sync %u!\n", frame, sync);
+	else
+		LOGE("Dump validation failed in frame %u, draw %u!\n", frame, draw);
+
+	if (what != tmem_mismatch)
+		report_fault_coordinate(iface, fault_addr, fault_hidden);
+
+	result.status = ValidateResult::Status::Fail;
+	result.frame = frame;
+	result.draw = draw;
+	result.sync = sync;
+	result.message = what;
+	return false;
+}
+
+static bool seek_to_frame(ReplayerState &state, DumpPlayer &player, const std::string &dump_path,
+                          const std::string &index_path, unsigned frame, bool require_index, std::string &error)
+{
+	auto &iface = state.iface;
+
+	DumpIndex index;
+	unsigned keyframe_index;
+	if (!index.load(index_path.c_str(), dump_path.c_str()))
+	{
+		if (require_index)
+		{
+			LOGE("Failed to load dump index: %s\n", index_path.c_str());
+			error = "Failed to load dump index.";
+			return false;
+		}
+		return true;
+	}
+
+	if (!index.find_keyframe(frame, keyframe_index))
+		return true;
+
+	DumpKeyframe keyframe;
+	if (!index.load_keyframe(keyframe_index, keyframe) || !player.seek(keyframe))
+	{
+		LOGE("Failed to seek to keyframe in %s.\n", index_path.c_str());
+		error = "Failed to seek to keyframe.";
+		return false;
+	}
+
+	restore_keyframe_memory(*state.reference, keyframe);
+	restore_keyframe_memory(*state.gpu, keyframe);
+	for (auto &count : iface.frame_count_for_context)
+		count = keyframe.frame;
+	for (auto &count : iface.draw_calls_for_context)
+		count = 0;
+	for (auto &count : iface.syncs_for_context)
+		count = 0;
+	iface.is_eof = false;
+	LOGI("Resuming from keyframe at frame %u.\n", keyframe.frame);
+	return true;
+}
+
+// Replays the first diverging frame again, this time comparing after every draw (or sync).
+static void bisect_frame(ReplayerState &state, DumpPlayer &player, const ValidateOptions &opts,
+                         unsigned frame, ValidateResult &result)
+{
+	auto &iface = state.iface;
+	LOGI("Divergence detected in frame %u, replaying it at %s granularity.\n", frame, opts.sync_only ? "sync" : "draw");
+
+	// Start over with fresh replayers, then skip ahead to the closest keyframe if the dump has been indexed.
+	if (!player.rewind() || !state.reset(player))
+	{
+		LOGE("Failed to rewind dump.\n");
+		result.status = ValidateResult::Status::Error;
+		result.message = "Failed to rewind dump.";
+		return;
+	}
+
+	std::string error;
+	if (!seek_to_frame(state, player, opts.path, opts.index_path, frame, false, error))
+	{
+		result.status = ValidateResult::Status::Error;
+		result.message = error;
+		return;
+	}
+
+	while (!iface.is_eof && iface.frame_count_for_context[1] < frame)
+	{
+		replay_step(player, iface, ReplayGranularity::Frame, 0);
+		state.device->next_frame_context();
+	}
+
+	CompareState compare;
+	while (!iface.is_eof && iface.frame_count_for_context[1] == frame)
+	{
+		replay_step(player, iface, opts.sync_only ? ReplayGranularity::Sync : ReplayGranularity::Draw, 1);
+		if (!compare_replayers(state, opts, compare, result))
+			return;
+		state.device->next_frame_context();
+	}
+
+	// Can happen if the divergence depends on timing of CPU writes relative to rendering.
+	LOGE("Divergence in frame %u did not reproduce at %s granularity.\n", frame, opts.sync_only ? "sync" : "draw");
+	result.frame = frame;
+	result.draw = 0;
+	result.sync = 0;
+	result.message += " Did not reproduce when bisecting.";
+}
+
+static void validate_dump(ValidateOptions opts, ValidateResult &result)
+{
+	result = {};
+	auto start_time = Util::get_current_time_nsecs();
 
 	DumpPlayer player;
-	if (!player.load_dump(path.c_str()))
+	if (!(opts.mmap ? player.load_dump_mapped(opts.path.c_str()) : player.load_dump(opts.path.c_str())))
 	{
-		LOGE("Failed to load dump: %s\n", path.c_str());
-		return EXIT_FAILURE;
+		LOGE("Failed to load dump: %s\n", opts.path.c_str());
+		result.message = "Failed to load dump.";
+		return;
 	}
 
 	ReplayerState state;
 	if (!state.init(player))
 	{
 		LOGE("Failed to initialize Vulkan device.\n");
-		return EXIT_FAILURE;
+		result.message = "Failed to initialize Vulkan device.";
+		return;
 	}
 
 	auto &iface = state.iface;
 
+	bool explicit_index = !opts.index_path.empty();
+	if (!explicit_index)
+		opts.index_path = get_dump_index_path(opts.path);
+
+	// Skip ahead to the closest keyframe if the dump has been indexed.
+	if (opts.begin_frame && !seek_to_frame(state, player, opts.path, opts.index_path, opts.begin_frame,
+	                                       explicit_index, result.message))
+		return;
+
+	ReplayGranularity granularity;
+	unsigned sync_interval = 1;
+	if (opts.bisect)
+	{
+		granularity = opts.compare_interval ? ReplayGranularity::Sync : ReplayGranularity::Frame;
+		sync_interval = opts.compare_interval;
+	}
+	else
+		granularity = opts.sync_only ? ReplayGranularity::Sync : ReplayGranularity::Draw;
+
+	CompareState compare;
 	while (!state.iface.is_eof)
 	{
-		if (capture)
+		if (opts.capture)
 			state.device->begin_renderdoc_capture();
 
+		unsigned segment_frame = iface.frame_count_for_context[1];
+		replay_step(player, iface, granularity, sync_interval);
+
+		if (opts.capture)
+			state.device->end_renderdoc_capture();
+
 		unsigned current_draw_count = iface.draw_calls_for_context[1];
 		unsigned current_frame_count = iface.frame_count_for_context[1];
 		unsigned current_syncs = iface.syncs_for_context[1];
-		while (current_frame_count == iface.frame_count_for_context[1] &&
-		       ((!sync_only && current_draw_count == iface.draw_calls_for_context[1]) ||
-		        (sync_only && current_syncs == iface.syncs_for_context[1])) &&
-		       player.iterate())
+
+		if (current_frame_count >= opts.begin_frame && !compare_replayers(state, opts, compare, result))
 		{
+			if (opts.bisect)
+				bisect_frame(state, player, opts, segment_frame, result);
+			result.replay_time = 1e-9 * double(Util::get_current_time_nsecs() - start_time);
+			return;
 		}
 
-		if (capture)
-			state.device->end_renderdoc_capture();
+		state.device->next_frame_context();
 
-		uint32_t fault_addr;
-		bool fault_hidden;
+		if (current_frame_count >= opts.begin_frame)
+		{
+			if (opts.bisect && !opts.compare_interval)
+				LOGI("Passed frame %u.\n", segment_frame);
+			else if (opts.sync_only || opts.bisect)
+				LOGI("Passed frame %u, sync %u.\n", current_frame_count, current_syncs);
+			else
+				LOGI("Passed frame %u, draw %u.\n", current_frame_count, current_draw_count);
+		}
+	}
 
-		current_draw_count = iface.draw_calls_for_context[1];
-		current_frame_count = iface.frame_count_for_context[1];
-		current_syncs = iface.syncs_for_context[1];
+	result.status = ValidateResult::Status::Pass;
+	result.frame = iface.frame_count_for_context[1];
+	result.replay_time = 1e-9 * double(Util::get_current_time_nsecs() - start_time);
+}
 
-		if (current_frame_count >= begin_frame &&
-		    !compare_memory("TMEM", state.reference->get_tmem(), state.gpu->get_tmem(), 4096, &fault_addr))
+static bool is_dump_file(const std::string &path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	char magic[8];
+	bool ret = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+	           (memcmp(magic, "RDPDUMP2", 8) == 0 || memcmp(magic, "RDPDUMP3", 8) == 0);
+	fclose(file);
+	return ret;
+}
+
+static bool gather_dumps(const std::string &path, std::vector<std::string> &dumps)
+{
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(path.c_str());
+	if (attr == INVALID_FILE_ATTRIBUTES)
+		return false;
+
+	if (attr & FILE_ATTRIBUTE_DIRECTORY)
+	{
+		WIN32_FIND_DATAA data;
+		HANDLE handle = FindFirstFileA((path + "\\*").c_str(), &data);
+		if (handle == INVALID_HANDLE_VALUE)
+			return false;
+		do
 		{
-			if (sync_only)
+			if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
 			{
-				LOGE("Dump validation failed in frame %u, sync %u!\n",
-				     current_frame_count, current_syncs);
+				auto file_path = path + "\\" + data.cFileName;
+				if (is_dump_file(file_path))
+					dumps.push_back(std::move(file_path));
 			}
-			else
+		} while (FindNextFileA(handle, &data));
+		FindClose(handle);
+		std::sort(dumps.begin(), dumps.end());
+		return true;
+	}
+#else
+	if (DIR *dir = opendir(path.c_str()))
+	{
+		while (auto *entry = readdir(dir))
+		{
+			if (entry->d_name[0] == '.')
+				continue;
+			auto file_path = path + "/" + entry->d_name;
+			if (is_dump_file(file_path))
+				dumps.push_back(std::move(file_path));
+		}
+		closedir(dir);
+		std::sort(dumps.begin(), dumps.end());
+		return true;
+	}
+#endif
+
+	// Manifest, one dump per line. Empty lines and lines starting with # are ignored.
+	std::ifstream manifest(path);
+	if (!manifest)
+		return false;
+
+	std::string line;
+	while (std::getline(manifest, line))
+	{
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+		dumps.push_back(line);
+	}
+
+	return true;
+}
+
+struct BatchOptions
+{
+	std::string batch_path;
+	std::string summary_path;
+	std::string work_dir = ".";
+	unsigned jobs = 0;
+};
+
+struct BatchJob
+{
+	std::string dump_path;
+	std::string result_path;
+	std::string log_path;
+	uint64_t start_time = 0;
+	double wall_time = 0.0;
+	int exit_code = -1;
+#ifdef _WIN32
+	HANDLE process = nullptr;
+#else
+	pid_t pid = -1;
+#endif
+};
+
+#ifdef _WIN32
+// Quotes for CommandLineToArgvW rules: backslashes are literal unless they precede a quote,
+// so runs of them before a quote, or before the closing quote, are doubled.
+static std::string quote_argument(const std::string &arg)
+{
+	std::string ret = "\"";
+	size_t num_backslashes = 0;
+	for (char c : arg)
+	{
+		if (c == '\\')
+			num_backslashes++;
+		else if (c == '"')
+		{
+			ret.append(num_backslashes + 1, '\\');
+			num_backslashes = 0;
+		}
+		else
+			num_backslashes = 0;
+		ret += c;
+	}
+	ret.append(num_backslashes, '\\');
+	ret += '"';
+	return ret;
+}
+#endif
+
+// Every dump is validated in its own process, since the reference renderer is a global singleton.
+static bool spawn_job(const char *exe, const std::vector<std::string> &args, BatchJob &job)
+{
+#ifdef _WIN32
+	std::string cmdline = quote_argument(exe);
+	for (auto &arg : args)
+		cmdline += " " + quote_argument(arg);
+
+	SECURITY_ATTRIBUTES sa = {};
+	sa.nLength = sizeof(sa);
+	sa.bInheritHandle = TRUE;
+	HANDLE log = CreateFileA(job.log_path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa,
+	                         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (log == INVALID_HANDLE_VALUE)
+		return false;
+
+	STARTUPINFOA si = {};
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = log;
+	si.hStdError = log;
+
+	PROCESS_INFORMATION pi = {};
+	BOOL ret = CreateProcessA(nullptr, &cmdline[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi);
+	CloseHandle(log);
+	if (!ret)
+		return false;
+
+	CloseHandle(pi.hThread);
+	job.process = pi.hProcess;
+	return true;
+#else
+	std::vector<char *> argv;
+	argv.push_back(const_cast<char *>(exe));
+	for (auto &arg : args)
+		argv.push_back(const_cast<char *>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, job.log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+	int ret = posix_spawnp(&job.pid, exe, &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	return ret == 0;
+#endif
+}
+
+// Blocks until one of the running jobs completes and returns its index.
+// If waiting fails, the first running job is given up on and reported as failed,
+// so the caller still collects every other job.
+static size_t wait_for_job(std::vector<BatchJob *> &running)
+{
+#ifdef _WIN32
+	std::vector<HANDLE> handles;
+	for (auto *job : running)
+		handles.push_back(job->process);
+
+	// Jobs are capped well below MAXIMUM_WAIT_OBJECTS.
+	DWORD ret = WaitForMultipleObjects(DWORD(handles.size()), handles.data(), FALSE, INFINITE);
+	size_t index = size_t(ret - WAIT_OBJECT_0);
+	bool failed = index >= running.size();
+	if (failed)
+		index = 0;
+
+	auto *job = running[index];
+	DWORD code = DWORD(-1);
+	if (failed)
+	{
+		LOGE("Failed to wait for validation of %s.\n", job->dump_path.c_str());
+		TerminateProcess(job->process, code);
+	}
+	else
+		GetExitCodeProcess(job->process, &code);
+	CloseHandle(job->process);
+	job->process = nullptr;
+	job->exit_code = int(code);
+	return index;
+#else
+	for (;;)
+	{
+		int status = 0;
+		pid_t pid = wait(&status);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOGE("Failed to wait for validation of %s.\n", running.front()->dump_path.c_str());
+			running.front()->exit_code = -1;
+			return 0;
+		}
+
+		for (size_t i = 0; i < running.size(); i++)
+		{
+			if (running[i]->pid == pid)
 			{
-				LOGE("Dump validation failed in frame %u, draw %u!\n",
-				     current_frame_count, current_draw_count);
+				running[i]->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+				return i;
 			}
-			return EXIT_FAILURE;
 		}
+	}
+#endif
+}
+
+static std::string read_file(const std::string &path)
+{
+	std::ifstream file(path);
+	if (!file)
+		return {};
+	std::stringstream str;
+	str << file.rdbuf();
+	auto ret = str.str();
+	while (!ret.empty() && (ret.back() == '\n' || ret.back() == '\r'))
+		ret.pop_back();
+	return ret;
+}
+
+static int run_batch(const char *exe, const BatchOptions &batch, const ValidateOptions &opts)
+{
+	std::vector<std::string> dumps;
+	if (!gather_dumps(batch.batch_path, dumps))
+	{
+		LOGE("Failed to read dumps from %s.\n", batch.batch_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	unsigned num_jobs = batch.jobs ? batch.jobs : std::max(1u, std::thread::hardware_concurrency());
+	num_jobs = std::min(num_jobs, 32u);
+
+	std::vector<BatchJob> jobs(dumps.size());
+	for (size_t i = 0; i < dumps.size(); i++)
+	{
+		jobs[i].dump_path = dumps[i];
+		jobs[i].result_path = batch.work_dir + "/rdp-validate-" + std::to_string(i) + ".json";
+		jobs[i].log_path = batch.work_dir + "/rdp-validate-" + std::to_string(i) + ".log";
+	}
+
+	auto batch_start = Util::get_current_time_nsecs();
+	std::vector<BatchJob *> running;
+	size_t next_job = 0;
+	size_t completed = 0;
 
-		if (current_frame_count >= begin_frame &&
-		    !compare_rdram(*state.reference, *state.gpu, &fault_addr, &fault_hidden))
+	while (completed < jobs.size())
+	{
+		while (running.size() < num_jobs && next_job < jobs.size())
 		{
-			if (sync_only)
+			auto &job = jobs[next_job++];
+			std::vector<std::string> args = { job.dump_path, "--result", job.result_path };
+			if (opts.sync_only)
+				args.push_back("--sync-only");
+			if (opts.mmap)
+				args.push_back("--mmap");
+			if (opts.full_compare)
+				args.push_back("--full-compare");
+			if (opts.bisect && !opts.compare_interval)
+				args.push_back("--bisect");
+			else if (opts.compare_interval)
 			{
-				LOGE("Dump validation failed in frame %u, sync %u!\n",
-				     current_frame_count, current_syncs);
+				args.push_back("--compare-interval");
+				args.push_back(std::to_string(opts.compare_interval));
 			}
-			else
+			if (opts.begin_frame)
 			{
-				LOGE("Dump validation failed in frame %u, draw %u!\n",
-				     current_frame_count, current_draw_count);
+				args.push_back("--begin-frame");
+				args.push_back(std::to_string(opts.begin_frame));
 			}
 
-			if (fault_hidden)
-				fault_addr *= 2;
-
-			if (state.iface.fb.width)
+			remove(job.result_path.c_str());
+			job.start_time = Util::get_current_time_nsecs();
+			if (spawn_job(exe, args, job))
+				running.push_back(&job);
+			else
 			{
-				int color_x, color_y, depth_x, depth_y;
-				int color_offset = int(fault_addr - state.iface.fb.addr);
-				int depth_offset = int(fault_addr - state.iface.fb.depth_addr);
-				depth_offset >>= 1;
-
-				switch (state.iface.fb.size)
-				{
-				case 2:
-					color_offset >>= 1;
-					break;
-
-				case 3:
-					color_offset >>= 2;
-					break;
-
-				default:
-					break;
-				}
-
-				color_x = color_offset % state.iface.fb.width;
-				color_y = color_offset / state.iface.fb.width;
-				depth_x = depth_offset % state.iface.fb.width;
-				depth_y = depth_offset / state.iface.fb.width;
-
-				if ((color_offset <= depth_offset || depth_offset < 0) && color_offset >= 0)
-				{
-					if (fault_hidden)
-						LOGE("Failure at hidden color coord (%d, %d).\n", color_x, color_y);
-					else
-						LOGE("Failure at color coord (%d, %d).\n", color_x, color_y);
-				}
-				else if ((depth_offset <= color_offset || color_offset < 0) && depth_offset >= 0)
-				{
-					if (fault_hidden)
-						LOGE("Failure at hidden depth coord (%d, %d).\n", depth_x, depth_y);
-					else
-						LOGE("Failure at depth coord (%d, %d).\n", depth_x, depth_y);
-				}
-				else
-					LOGE("Uncertain failure coordinate.\n");
+				LOGE("Failed to spawn validation of %s.\n", job.dump_path.c_str());
+				completed++;
 			}
-
-			return EXIT_FAILURE;
 		}
 
-		state.device->next_frame_context();
+		if (running.empty())
+			break;
 
-		if (current_frame_count >= begin_frame)
+		size_t index = wait_for_job(running);
+		auto *job = running[index];
+		job->wall_time = 1e-9 * double(Util::get_current_time_nsecs() - job->start_time);
+		running.erase(running.begin() + index);
+		completed++;
+		LOGI("[%zu / %zu] %s: %s (%.3f s).\n", completed, jobs.size(), job->dump_path.c_str(),
+		     job->exit_code == 0 ? "passed" : "failed", job->wall_time);
+	}
+
+	double batch_time = 1e-9 * double(Util::get_current_time_nsecs() - batch_start);
+
+	std::ostringstream summary;
+	unsigned passed = 0;
+	summary << "{\n\t\"dumps\": [\n";
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		auto &job = jobs[i];
+		auto result = read_file(job.result_path);
+		remove(job.result_path.c_str());
+		if (job.exit_code == 0 && !result.empty())
+			passed++;
+
+		summary << "\t\t{ \"path\": \"" << escape_json(job.dump_path) << "\""
+		        << ", \"exit_code\": " << job.exit_code
+		        << ", \"wall_time_seconds\": " << job.wall_time
+		        << ", \"log\": \"" << escape_json(job.log_path) << "\""
+		        << ", \"result\": " << (result.empty() ? "null" : result)
+		        << " }" << (i + 1 < jobs.size() ? ",\n" : "\n");
+	}
+	summary << "\t],\n";
+	summary << "\t\"passed\": " << passed << ",\n";
+	summary << "\t\"failed\": " << (jobs.size() - passed) << ",\n";
+	summary << "\t\"jobs\": " << num_jobs << ",\n";
+	summary << "\t\"wall_time_seconds\": " << batch_time << "\n";
+	summary << "}\n";
+
+	if (batch.summary_path.empty())
+		fputs(summary.str().c_str(), stdout);
+	else
+	{
+		std::ofstream file(batch.summary_path);
+		if (!(file << summary.str()))
 		{
-			if (sync_only)
-				LOGI("Passed frame %u, sync %u.\n", current_frame_count, current_syncs);
-			else
-				LOGI("Passed frame %u, draw %u.\n", current_frame_count, current_draw_count);
+			LOGE("Failed to write summary to %s.\n", batch.summary_path.c_str());
+			return EXIT_FAILURE;
 		}
 	}
 
-	return EXIT_SUCCESS;
+	LOGI("%u / %zu dumps passed.\n", passed, jobs.size());
+	return passed == jobs.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int main_inner(int argc, char *argv[])
+{
+	ValidateOptions opts;
+	BatchOptions batch;
+	std::string result_path;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--begin-frame", [&](Util::CLIParser &parser) { opts.begin_frame = parser.next_uint(); });
+	cbs.add("--sync-only", [&](Util::CLIParser &) { opts.sync_only = true; });
+	cbs.add("--capture", [&](Util::CLIParser &) { opts.capture = true; });
+	cbs.add("--mmap", [&](Util::CLIParser &) { opts.mmap = true; });
+	cbs.add("--index", [&](Util::CLIParser &parser) { opts.index_path = parser.next_string(); });
+	cbs.add("--bisect", [&](Util::CLIParser &) { opts.bisect = true; });
+	cbs.add("--compare-interval", [&](Util::CLIParser &parser) { opts.compare_interval = parser.next_uint(); opts.bisect = true; });
+	cbs.add("--full-compare", [&](Util::CLIParser &) { opts.full_compare = true; });
+	cbs.add("--result", [&](Util::CLIParser &parser) { result_path = parser.next_string(); });
+	cbs.add("--batch", [&](Util::CLIParser &parser) { batch.batch_path = parser.next_string(); });
+	cbs.add("--jobs", [&](Util::CLIParser &parser) { batch.jobs = parser.next_uint(); });
+	cbs.add("--summary", [&](Util::CLIParser &parser) { batch.summary_path = parser.next_string(); });
+	cbs.add("--work-dir", [&](Util::CLIParser &parser) { batch.work_dir = parser.next_string(); });
+	cbs.default_handler = [&](const char *arg) { opts.path = arg; };
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (!batch.batch_path.empty())
+	{
+		if (!opts.index_path.empty())
+			LOGE("--index is ignored with --batch, every dump uses its own index.\n");
+		return run_batch(argv[0], batch, opts);
+	}
+
+	if (opts.capture)
+		if (!Vulkan::Device::init_renderdoc_capture())
+			LOGE("Failed to initialize RenderDoc capture.\n");
+
+	ValidateResult result;
+	validate_dump(opts, result);
+
+	if (!result_path.empty() && !write_result(result_path, result))
+		LOGE("Failed to write result to %s.\n", result_path.c_str());
+
+	return result.status == ValidateResult::Status::Pass ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[])
@@ -205,4 +888,4 @@ int main(int argc, char *argv[])
 	int ret = main_inner(argc, argv);
 	Granite::Global::deinit();
 	return ret;
-}
\ No newline at end of file
+}
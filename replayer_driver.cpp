@@ -21,9 +21,132 @@
  */
 
 #include "replayer_driver.hpp"
+#include <algorithm>
 
 namespace RDP
 {
+void RDRAMWriteTracker::init(size_t rdram_size_, size_t hidden_rdram_size_)
+{
+	rdram_size = rdram_size_;
+	hidden_rdram_size = hidden_rdram_size_;
+	rdram_pages.assign((rdram_size / ReplayerDirtyPageSize + 31) / 32, 0);
+	hidden_rdram_pages.assign((hidden_rdram_size / ReplayerDirtyPageSize + 31) / 32, 0);
+}
+
+void RDRAMWriteTracker::mark_pages(std::vector<uint32_t> &pages, size_t total_size, size_t offset, size_t size)
+{
+	if (!size || !total_size)
+		return;
+
+	// Addresses wrap around like they do on the RDP.
+	size_t num_pages = (total_size + ReplayerDirtyPageSize - 1) / ReplayerDirtyPageSize;
+	size_t start_page = offset / ReplayerDirtyPageSize;
+	size_t end_page = (offset + size - 1) / ReplayerDirtyPageSize + 1;
+	if (end_page - start_page > num_pages)
+		end_page = start_page + num_pages;
+
+	for (size_t page = start_page; page < end_page; page++)
+	{
+		size_t wrapped_page = page % num_pages;
+		pages[wrapped_page / 32] |= 1u << (wrapped_page & 31);
+	}
+}
+
+void RDRAMWriteTracker::mark_rdram(size_t offset, size_t size)
+{
+	mark_pages(rdram_pages, rdram_size, offset, size);
+}
+
+void RDRAMWriteTracker::mark_hidden_rdram(size_t offset, size_t size)
+{
+	mark_pages(hidden_rdram_pages, hidden_rdram_size, offset, size);
+}
+
+void RDRAMWriteTracker::mark_all()
+{
+	mark_rdram(0, rdram_size);
+	mark_hidden_rdram(0, hidden_rdram_size);
+}
+
+void RDRAMWriteTracker::mark_rows(int yh, int yl)
+{
+	// Y coordinates are in 2 bits of subpixel precision.
+	yh = std::max(yh, int(scissor_yh));
+	yl = std::min(yl, int(scissor_yl));
+	if (yl < yh || color_width == 0)
+		return;
+
+	unsigned first_row = unsigned(yh) >> 2;
+	unsigned num_rows = (unsigned(yl) >> 2) - first_row + 1;
+
+	// Color pixel sizes are 4, 8, 16 and 32 bits. Hidden RDRAM holds one byte per 16 bits of RDRAM.
+	size_t color_stride = (size_t(color_width) << color_size) >> 1;
+	size_t color_offset = color_addr + first_row * color_stride;
+	size_t color_bytes = num_rows * color_stride;
+	mark_rdram(color_offset, color_bytes);
+	mark_hidden_rdram(color_offset >> 1, (color_bytes + 1) >> 1);
+
+	size_t depth_stride = size_t(color_width) * 2;
+	size_t depth_offset = depth_addr + first_row * depth_stride;
+	size_t depth_bytes = num_rows * depth_stride;
+	mark_rdram(depth_offset, depth_bytes);
+	mark_hidden_rdram(depth_offset >> 1, depth_bytes >> 1);
+}
+
+static inline int sign_extend_14(uint32_t v)
+{
+	return int32_t(v << 18) >> 18;
+}
+
+void RDRAMWriteTracker::command(Op cmd_id, const uint32_t *words)
+{
+	switch (cmd_id)
+	{
+	case Op::SetColorImage:
+		color_size = (words[0] >> 19) & 3;
+		color_width = (words[0] & 1023) + 1;
+		color_addr = words[1] & 0xffffff;
+		break;
+
+	case Op::SetMaskImage:
+		depth_addr = words[1] & 0xffffff;
+		break;
+
+	case Op::SetScissor:
+		scissor_yh = words[0] & 0xfff;
+		scissor_yl = words[1] & 0xfff;
+		break;
+
+	case Op::FillTriangle:
+	case Op::FillZBufferTriangle:
+	case Op::TextureTriangle:
+	case Op::TextureZBufferTriangle:
+	case Op::ShadeTriangle:
+	case Op::ShadeZBufferTriangle:
+	case Op::ShadeTextureTriangle:
+	case Op::ShadeTextureZBufferTriangle:
+		mark_rows(sign_extend_14(words[1]), sign_extend_14(words[0]) | 3);
+		break;
+
+	case Op::TextureRectangle:
+	case Op::TextureRectangleFlip:
+	case Op::FillRectangle:
+		mark_rows(int(words[1] & 0xfff), int(words[0] & 0xfff) | 3);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void RDRAMWriteTracker::consume(std::vector<uint32_t> &rdram_pages_, std::vector<uint32_t> &hidden_rdram_pages_)
+{
+	rdram_pages_ = rdram_pages;
+	hidden_rdram_pages_ = hidden_rdram_pages;
+	std::fill(rdram_pages.begin(), rdram_pages.end(), 0);
+	std::fill(hidden_rdram_pages.begin(), hidden_rdram_pages.end(), 0);
+}
+
 struct SideBySideDriver : ReplayerDriver
 {
 	SideBySideDriver(ReplayerDriver *first_, ReplayerDriver *second_, ReplayerEventInterface &iface_)
@@ -72,6 +195,7 @@ struct SideBySideDriver : ReplayerDriver
 
 	void invalidate_caches() override;
 	void flush_caches() override;
+	void consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages) override;
 
 	ReplayerDriver *first;
 	ReplayerDriver *second;
@@ -90,6 +214,21 @@ void SideBySideDriver::flush_caches()
 	second->flush_caches();
 }
 
+void SideBySideDriver::consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages)
+{
+	// Union of both replayers.
+	std::vector<uint32_t> second_rdram_pages, second_hidden_rdram_pages;
+	first->consume_dirty_pages(rdram_pages, hidden_rdram_pages);
+	second->consume_dirty_pages(second_rdram_pages, second_hidden_rdram_pages);
+
+	rdram_pages.resize(std::max(rdram_pages.size(), second_rdram_pages.size()));
+	for (size_t i = 0; i < second_rdram_pages.size(); i++)
+		rdram_pages[i] |= second_rdram_pages[i];
+	hidden_rdram_pages.resize(std::max(hidden_rdram_pages.size(), second_hidden_rdram_pages.size()));
+	for (size_t i = 0; i < second_hidden_rdram_pages.size(); i++)
+		hidden_rdram_pages[i] |= second_hidden_rdram_pages[i];
+}
+
 void SideBySideDriver::set_vi_register(VIRegister index, uint32_t value)
 {
 	iface.set_context_index(0);
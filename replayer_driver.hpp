@@ -24,7 +24,9 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include "rdp_dump.hpp"
+#include "rdp_data_structures.hpp"
 
 namespace Vulkan
 {
@@ -61,6 +63,39 @@ static inline const char *command_name(Op cmd_id)
 		return "???";
 }
 
+// Conservatively tracks which RDRAM pages a replayer may have written, derived from the command stream
+// (bound color and depth framebuffers within the primitive's Y range and scissor) and from memory updates.
+constexpr size_t ReplayerDirtyPageSize = 1024;
+
+class RDRAMWriteTracker
+{
+public:
+	void init(size_t rdram_size, size_t hidden_rdram_size);
+	void command(Op cmd_id, const uint32_t *words);
+	void mark_rdram(size_t offset, size_t size);
+	void mark_hidden_rdram(size_t offset, size_t size);
+	void mark_all();
+
+	// Returns pages written since last call as bitmasks, one bit per page, and clears the tracked set.
+	void consume(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages);
+
+private:
+	std::vector<uint32_t> rdram_pages;
+	std::vector<uint32_t> hidden_rdram_pages;
+	size_t rdram_size = 0;
+	size_t hidden_rdram_size = 0;
+
+	uint32_t color_addr = 0;
+	uint32_t color_width = 0;
+	uint32_t color_size = 0;
+	uint32_t depth_addr = 0;
+	uint32_t scissor_yh = 0;
+	uint32_t scissor_yl = 0xfff;
+
+	void mark_rows(int yh, int yl);
+	static void mark_pages(std::vector<uint32_t> &pages, size_t total_size, size_t offset, size_t size);
+};
+
 class ReplayerDriver : public CommandListenerInterface
 {
 public:
@@ -74,6 +109,13 @@ public:
 
 	virtual void flush_caches() = 0;
 	virtual void invalidate_caches() = 0;
+
+	// RDRAM and hidden RDRAM pages (ReplayerDirtyPageSize each) written since the previous call.
+	// Memory written by the host between invalidate_caches() and flush_caches() counts as fully dirty.
+	virtual void consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages) = 0;
+
+	// Render pass limits in effect after clamping, or nullptr if the replayer has none.
+	virtual const RendererLimits *get_limits() { return nullptr; }
 };
 
 static inline bool command_is_draw_call(Op cmd_id)
@@ -109,7 +151,10 @@ struct ReplayerEventInterface
 };
 
 std::unique_ptr<ReplayerDriver> create_replayer_driver_angrylion(CommandInterface &player, ReplayerEventInterface &iface);
+// With pipelined_scanout, end_frame() reports scanout from a few frames earlier to avoid stalling on the GPU every frame.
+// The last few frames are reported after eof().
 std::unique_ptr<ReplayerDriver> create_replayer_driver_parallel(Vulkan::Device &device, CommandInterface &player, ReplayerEventInterface &iface,
-                                                                bool benchmarking = false);
+                                                                bool benchmarking = false, bool pipelined_scanout = false,
+                                                                const RendererLimits &limits = {});
 std::unique_ptr<ReplayerDriver> create_side_by_side_driver(ReplayerDriver *first, ReplayerDriver *second, ReplayerEventInterface &iface);
 }
\ No newline at end of file
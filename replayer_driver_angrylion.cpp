@@ -83,16 +83,23 @@ public:
 
 	void flush_caches() override
 	{
+		dirty.mark_all();
 	}
 
 	void invalidate_caches() override
 	{
 	}
 
+	void consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages) override
+	{
+		dirty.consume(rdram_pages, hidden_rdram_pages);
+	}
+
 private:
 	CommandInterface &player;
 	ReplayerEventInterface &iface;
 	std::vector<uint8_t> rdram;
+	RDRAMWriteTracker dirty;
 	uint32_t vi_regs[VI_NUM_REG] = {};
 	uint32_t dp_regs[DP_NUM_REG] = {};
 	uint32_t irq_reg = 0;
@@ -186,16 +193,19 @@ void AngrylionReplayer::signal_complete()
 void AngrylionReplayer::update_rdram(const void *data, size_t size, size_t offset)
 {
 	memcpy(rdram.data() + offset, data, size);
+	dirty.mark_rdram(offset, size);
 }
 
 void AngrylionReplayer::update_hidden_rdram(const void *data, size_t size, size_t offset)
 {
 	memcpy(rdram_hidden + offset, data, size);
+	dirty.mark_hidden_rdram(offset, size);
 }
 
 void AngrylionReplayer::command(Op command_id, uint32_t num_words, const uint32_t *words)
 {
 	rdp_cmd(0, words);
+	dirty.command(command_id, words);
 	iface.notify_command(command_id, num_words, words);
 }
 
@@ -214,6 +224,7 @@ AngrylionReplayer::AngrylionReplayer(CommandInterface &player_, ReplayerEventInt
 	: player(player_), iface(iface_)
 {
 	rdram.resize(player.get_rdram_size());
+	dirty.init(rdram.size(), sizeof(rdram_hidden));
 	for (unsigned i = 0; i < VI_NUM_REG; i++)
 		p_vi_regs[i] = &vi_regs[i];
 	for (unsigned i = 0; i < DP_NUM_REG; i++)
@@ -234,6 +245,8 @@ AngrylionReplayer::AngrylionReplayer(CommandInterface &player_, ReplayerEventInt
 AngrylionReplayer::~AngrylionReplayer()
 {
 	n64video_close();
+	if (global_replayer == this)
+		global_replayer = nullptr;
 }
 
 std::unique_ptr<ReplayerDriver> create_replayer_driver_angrylion(CommandInterface &player, ReplayerEventInterface &iface)
@@ -31,20 +31,25 @@ class ParallelReplayer : public ReplayerDriver
 {
 public:
 	ParallelReplayer(Vulkan::Device &device, CommandInterface &player_,
-	                 ReplayerEventInterface &iface_, bool benchmarking)
+	                 ReplayerEventInterface &iface_, bool benchmarking, bool pipelined_scanout_,
+	                 const RendererLimits &limits)
 		: player(player_)
 		, iface(iface_)
+		, pipelined_scanout(pipelined_scanout_)
 		, host_memory(Util::memalign_calloc(64 * 1024, player.get_rdram_size()))
 		, gpu(device, host_memory.get(), 0, player.get_rdram_size(), player.get_hidden_rdram_size(),
-			  benchmarking ? 0 : (COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_HIDDEN_RDRAM_BIT | COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_TMEM_BIT))
+			  COMMAND_PROCESSOR_FLAG_TRACK_CPU_WRITES_BIT |
+			  (benchmarking ? 0 : (COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_HIDDEN_RDRAM_BIT | COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_TMEM_BIT)), limits)
 	{
 		if (!gpu.device_is_supported())
 			throw std::runtime_error("GPU is not supported.");
+		dirty.init(gpu.get_rdram_size(), gpu.get_hidden_rdram_size());
 	}
 
 private:
 	CommandInterface &player;
 	ReplayerEventInterface &iface;
+	bool pipelined_scanout;
 	struct AlignedDeleter
 	{
 		void operator()(void *ptr)
@@ -54,6 +59,7 @@ private:
 	};
 	std::unique_ptr<void, AlignedDeleter> host_memory;
 	CommandProcessor gpu;
+	RDRAMWriteTracker dirty;
 
 	void eof() override;
 	void signal_complete() override;
@@ -71,11 +77,19 @@ private:
 
 	void invalidate_caches() override;
 	void flush_caches() override;
+	void consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages) override;
+	const RendererLimits *get_limits() override;
 };
 
 void ParallelReplayer::eof()
 {
 	iface.eof();
+
+	// Deliver the frames still queued for pipelined scanout. They come after eof(),
+	// since end_frame() already reported a placeholder for each of them.
+	CommandProcessor::ScanoutReadback readback;
+	while (pipelined_scanout && gpu.scanout_async_drain(readback))
+		iface.update_screen(readback.colors, readback.width, readback.height, readback.width);
 }
 
 void ParallelReplayer::signal_complete()
@@ -89,12 +103,21 @@ void ParallelReplayer::update_rdram(const void *data, size_t size, size_t offset
 	gpu.idle();
 	memcpy(static_cast<uint8_t *>(host_memory.get()) + offset, data, size);
 	gpu.end_write_rdram();
+	gpu.notify_cpu_write(offset, size);
+	dirty.mark_rdram(offset, size);
 }
 
 void ParallelReplayer::flush_caches()
 {
 	gpu.end_write_rdram();
+	gpu.notify_cpu_write(0, gpu.get_rdram_size());
 	gpu.end_write_hidden_rdram();
+	dirty.mark_all();
+}
+
+void ParallelReplayer::consume_dirty_pages(std::vector<uint32_t> &rdram_pages, std::vector<uint32_t> &hidden_rdram_pages)
+{
+	dirty.consume(rdram_pages, hidden_rdram_pages);
 }
 
 void ParallelReplayer::invalidate_caches()
@@ -108,11 +131,13 @@ void ParallelReplayer::update_hidden_rdram(const void *data, size_t size, size_t
 	gpu.idle();
 	memcpy(static_cast<uint8_t *>(gpu.begin_read_hidden_rdram()) + offset, data, size);
 	gpu.end_write_hidden_rdram();
+	dirty.mark_hidden_rdram(offset, size);
 }
 
 void ParallelReplayer::command(Op command_id, uint32_t num_words, const uint32_t *words)
 {
 	gpu.enqueue_command(num_words, words);
+	dirty.command(command_id, words);
 	iface.notify_command(command_id, num_words, words);
 }
 
@@ -149,8 +174,23 @@ void ParallelReplayer::idle()
 	gpu.idle();
 }
 
+const RendererLimits *ParallelReplayer::get_limits()
+{
+	return &gpu.get_limits();
+}
+
 void ParallelReplayer::end_frame()
 {
+	if (pipelined_scanout)
+	{
+		CommandProcessor::ScanoutReadback readback;
+		if (gpu.scanout_async(readback))
+			iface.update_screen(readback.colors, readback.width, readback.height, readback.width);
+		else
+			iface.update_screen(nullptr, 0, 0, 0);
+		return;
+	}
+
 	std::vector<RGBA> colors;
 	unsigned width, height;
 	gpu.scanout_sync(colors, width, height);
@@ -163,8 +203,9 @@ void ParallelReplayer::set_vi_register(VIRegister index, uint32_t value)
 }
 
 std::unique_ptr<ReplayerDriver> create_replayer_driver_parallel(Vulkan::Device &device, CommandInterface &player, ReplayerEventInterface &iface,
-                                                                bool benchmarking)
+                                                                bool benchmarking, bool pipelined_scanout,
+                                                                const RendererLimits &limits)
 {
-	return std::make_unique<ParallelReplayer>(device, player, iface, benchmarking);
+	return std::make_unique<ParallelReplayer>(device, player, iface, benchmarking, pipelined_scanout, limits);
 }
 }